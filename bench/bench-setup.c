@@ -0,0 +1,247 @@
+/* Copyright 2012, Guilherme P. Gonçalves (guilherme.p.gonc@gmail.com)
+ *
+ * This file is part of ipod-syncer.
+ *
+ * ipod-syncer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ipod-syncer.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/* Sets up the fixtures for run-bench.sh: a fake iPod, a directory of
+ * generated tracks and a medialib holding them.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+#include <glib/gprintf.h>
+#include <glib/gstdio.h>
+#include <gpod/itdb.h>
+#include <xmmsclient/xmmsclient.h>
+
+#include "riff.h"
+
+/* An iPod Video, which has no special requirements on its tracks */
+#define BENCH_MODEL "MA147"
+
+#define WAV_RATE 44100
+#define WAV_CHANNELS 2
+#define WAV_HEADER_SIZE 44
+
+/* How long to wait for the medialib to read the tracks' properties */
+#define IMPORT_TIMEOUT (30 * 60)
+
+#define SET_ERROR(err, message) \
+    g_set_error_literal (err, g_quark_from_static_string (__func__), 0, message);
+
+static GByteArray *build_wav (guint seconds, guint pitch);
+static gboolean make_ipod (const gchar *mountpoint, GError **err);
+static gboolean make_tracks (const gchar *dir, guint count, guint seconds, GError **err);
+static gint count_ready (xmmsc_connection_t *conn);
+static gboolean import_tracks (const gchar *dir, guint count, GError **err);
+
+/**
+ * Build a wav file holding a sawtooth wave, so tracks differ and don't
+ * compress to nothing.
+ */
+static GByteArray *
+build_wav (guint seconds, guint pitch)
+{
+    guint i, frames = seconds * WAV_RATE;
+    guint32 data_size = frames * WAV_CHANNELS * 2;
+    guint64 phase;
+    gint16 sample;
+    GByteArray *wav;
+
+    wav = g_byte_array_sized_new (WAV_HEADER_SIZE + data_size);
+
+    riff_append_chunk (wav, "RIFF", WAV_HEADER_SIZE - 8 + data_size);
+    g_byte_array_append (wav, (const guint8 *) "WAVE", 4);
+    riff_append_chunk (wav, "fmt ", 16);
+    riff_append_u16 (wav, 1 /* PCM */);
+    riff_append_u16 (wav, WAV_CHANNELS);
+    riff_append_u32 (wav, WAV_RATE);
+    riff_append_u32 (wav, WAV_RATE * WAV_CHANNELS * 2);
+    riff_append_u16 (wav, WAV_CHANNELS * 2);
+    riff_append_u16 (wav, 16);
+    riff_append_chunk (wav, "data", data_size);
+
+    for (i = 0; i < frames * WAV_CHANNELS; i++) {
+        phase = ((guint64) (i / WAV_CHANNELS) * pitch) % WAV_RATE;
+        sample = phase * 16384 / WAV_RATE - 8192;
+        riff_append_u16 (wav, (guint16) sample);
+    }
+
+    return wav;
+}
+
+/**
+ * Create an empty iPod tree at mountpoint.
+ */
+static gboolean
+make_ipod (const gchar *mountpoint, GError **err)
+{
+    if (g_mkdir_with_parents (mountpoint, 0755) != 0) {
+        SET_ERROR (err, "can't create the mountpoint");
+        return FALSE;
+    }
+
+    return itdb_init_ipod (mountpoint, BENCH_MODEL, "Bench", err);
+}
+
+/**
+ * Generate count tracks of the given length in dir.
+ */
+static gboolean
+make_tracks (const gchar *dir, guint count, guint seconds, GError **err)
+{
+    guint i;
+    gchar *name, *path;
+    gboolean ret = TRUE;
+    GByteArray *wav;
+
+    if (g_mkdir_with_parents (dir, 0755) != 0) {
+        SET_ERROR (err, "can't create the track directory");
+        return FALSE;
+    }
+
+    for (i = 0; ret && i < count; i++) {
+        name = g_strdup_printf ("track-%05u.wav", i);
+        path = g_build_filename (dir, name, NULL);
+
+        wav = build_wav (seconds, 110 + i % 880);
+        ret = g_file_set_contents (path, (const gchar *) wav->data, wav->len, err);
+
+        g_byte_array_free (wav, TRUE);
+        g_free (path);
+        g_free (name);
+    }
+
+    return ret;
+}
+
+/**
+ * Count the medialib entries whose properties have been read.
+ * Returns -1 upon error.
+ */
+static gint
+count_ready (xmmsc_connection_t *conn)
+{
+    gint ret = -1;
+    xmmsc_result_t *res;
+    xmmsv_coll_t *coll;
+    xmmsv_t *val;
+
+    if (!xmmsv_coll_parse ("+duration", &coll)) {
+        return -1;
+    }
+
+    res = xmmsc_coll_query_ids (conn, coll, NULL, 0, 0);
+    xmmsc_result_wait (res);
+
+    val = xmmsc_result_get_value (res);
+    if (!xmmsv_is_error (val)) {
+        ret = xmmsv_list_get_size (val);
+    }
+
+    xmmsc_result_unref (res);
+    xmmsv_coll_unref (coll);
+
+    return ret;
+}
+
+/**
+ * Import the tracks in dir into the medialib of the server at XMMS_PATH,
+ * and wait until all count of them have their properties read.
+ */
+static gboolean
+import_tracks (const gchar *dir, guint count, GError **err)
+{
+    gint ready = 0;
+    gchar *url;
+    const gchar *errstr;
+    gboolean ret = FALSE;
+    xmmsc_connection_t *conn;
+    xmmsc_result_t *res;
+    GTimer *timer;
+
+    conn = xmmsc_init ("ipod-syncer-bench");
+    if (!xmmsc_connect (conn, getenv ("XMMS_PATH"))) {
+        SET_ERROR (err, "can't connect to the xmms2 server");
+        xmmsc_unref (conn);
+        return FALSE;
+    }
+
+    if (!(url = g_filename_to_uri (dir, NULL, err))) {
+        xmmsc_unref (conn);
+        return FALSE;
+    }
+
+    res = xmmsc_medialib_import_path (conn, url);
+    xmmsc_result_wait (res);
+
+    if (xmmsv_get_error (xmmsc_result_get_value (res), &errstr)) {
+        g_set_error (err, g_quark_from_static_string (__func__), 0,
+                     "can't import tracks: %s", errstr);
+        goto out;
+    }
+
+    timer = g_timer_new ();
+
+    while ((ready = count_ready (conn)) >= 0 && ready < count &&
+           g_timer_elapsed (timer, NULL) < IMPORT_TIMEOUT) {
+        g_usleep (G_USEC_PER_SEC / 4);
+    }
+
+    g_timer_destroy (timer);
+
+    if (!(ret = ready >= (gint) count)) {
+        SET_ERROR (err, "the medialib didn't read all tracks in time");
+    }
+
+out:
+    xmmsc_result_unref (res);
+    xmmsc_unref (conn);
+    g_free (url);
+
+    return ret;
+}
+
+int
+main (int argc, char **argv)
+{
+    gboolean ret = FALSE;
+    GError *err = NULL;
+
+    if (argc == 3 && !strcmp (argv[1], "ipod")) {
+        ret = make_ipod (argv[2], &err);
+    } else if (argc == 5 && !strcmp (argv[1], "tracks")) {
+        ret = make_tracks (argv[2], atoi (argv[3]), atoi (argv[4]), &err);
+    } else if (argc == 4 && !strcmp (argv[1], "import")) {
+        ret = import_tracks (argv[2], atoi (argv[3]), &err);
+    } else {
+        g_fprintf (stderr,
+                   "usage: %s ipod MOUNTPOINT\n"
+                   "       %s tracks DIR COUNT SECONDS\n"
+                   "       %s import DIR COUNT\n", argv[0], argv[0], argv[0]);
+        return 2;
+    }
+
+    if (!ret) {
+        g_fprintf (stderr, "%s: %s\n", argv[1], err ? err->message : "failed");
+        g_clear_error (&err);
+    }
+
+    return !ret;
+}
@@ -0,0 +1,107 @@
+#!/bin/sh
+# Script that benchmarks ipod-syncer against a fake iPod
+#
+# USAGE:
+#
+# run-bench.sh ipod-syncer bench-setup [count...]
+#
+# For each count (default: 100 1000 10000), generates that many wav tracks,
+# imports them into a scratch medialib served by an xmms2d of our own, and
+# syncs them all to a freshly initialized iPod tree. The total time and the
+# time spent in each stage, as given by ipod-syncer --stats, are reported,
+# one line per count. Stages run in parallel, like convert, add up the time
+# spent by each worker. The last column is the peak resident set size of
+# the syncer, in kB.
+# The fake iPod plays wav, so the syncer is run with --mp3-only to still
+# convert every track, as it would for formats the iPod doesn't play.
+# Nothing outside a temporary directory is touched.
+#
+# Environment:
+#   BENCH_SECONDS   length of the generated tracks (default: 1)
+#   BENCH_ARGS      extra options for ipod-syncer (default: none)
+
+syncer=`realpath "$1"`
+setup=`realpath "$2"`
+shift 2
+
+counts=${*:-"100 1000 10000"}
+seconds=${BENCH_SECONDS:-1}
+stages="query fetch import convert copy voiceover write"
+
+workdir=`mktemp -d "${TMPDIR:-/tmp}/ipod-syncer-bench.XXXXXX"` || exit 1
+
+stop_server() {
+    if [ -n "$XMMS_PATH" ]; then
+        xmms2 server shutdown >/dev/null 2>&1
+        XMMS_PATH=""
+    fi
+}
+
+cleanup() {
+    stop_server
+    rm -rf "$workdir"
+}
+
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+printf "%-8s %-9s" tracks total
+for stage in $stages; do
+    printf " %-9s" $stage
+done
+printf " %s\n" rss
+
+for count in $counts; do
+    run="$workdir/$count"
+
+    # everything the server and the syncer keep is private to this run
+    export XDG_CONFIG_HOME="$run/config"
+    export XDG_CACHE_HOME="$run/cache"
+    export XMMS_PATH="unix://$run/ipc"
+
+    mkdir -p "$XDG_CONFIG_HOME" "$XDG_CACHE_HOME" || exit 1
+
+    if ! xmms2-launcher -i "$XMMS_PATH" >"$run/xmms2d.log" 2>&1; then
+        echo "Failed to start xmms2d, see $run/xmms2d.log" >&2
+        exit 1
+    fi
+
+    "$setup" ipod "$run/ipod" &&
+    "$setup" tracks "$run/tracks" $count $seconds &&
+    "$setup" import "$run/tracks" $count || exit 1
+
+    start=`date +%s.%N`
+    "$syncer" --stats --mp3-only $BENCH_ARGS -m "$run/ipod" "+url" >"$run/sync.log" 2>&1
+    status=$?
+    end=`date +%s.%N`
+
+    stop_server
+
+    if [ $status -ne 0 ]; then
+        echo "Sync of $count tracks failed:" >&2
+        tail "$run/sync.log" >&2
+        exit 1
+    fi
+
+    awk -v count=$count -v start=$start -v end=$end -v stages="$stages" '
+        /^    "[a-z]+": \{"count"/ {
+            split($0, fields, "\"")
+            match($0, /"seconds": [0-9.e+-]+/)
+            took[fields[2]] = substr($0, RSTART + 11, RLENGTH - 11)
+        }
+        /^  "peak_rss_kb"/ {
+            match($0, /[0-9]+/)
+            rss = substr($0, RSTART, RLENGTH)
+        }
+        END {
+            printf "%-8s %-9.3f", count, end - start
+            n = split(stages, names, " ")
+            for (i = 1; i <= n; i++) {
+                printf " %-9.3f", took[names[i]]
+            }
+            printf " %d\n", rss
+        }' "$run/sync.log"
+
+    # the tracks for this run are no longer needed
+    rm -rf "$run"
+done
@@ -9,6 +9,7 @@
 #
 #   -x  Print converted filename extension and exit
 #   -f  Set converted filename
+#   -F  Source format, as probed by ipod-syncer, instead of the extension
 # 	-a	Artist tag
 #	-A 	Album tag
 #	-T	Track tag
@@ -33,10 +34,11 @@
 # GNU General Public License 2.0
 
 # Get parameters
-while getopts q:a:A:T:t:g:c:y:f:x opt ; do
+while getopts q:a:A:T:t:g:c:y:f:F:x opt ; do
 	case "$opt" in
 	    x)  echo "$extension"; exit 0 ;;
 	    f)  outfile="$OPTARG" ;;
+	    F)  filetype="$OPTARG" ;;
 		a)	artist="$OPTARG" ;;
 		A)	album="$OPTARG" ;;
 		T)	track="$OPTARG" ;;
@@ -83,16 +85,18 @@ fi
 
 # Determine decoder
 
-# Convert the source extension to lowercase.
-filetype=`echo ${infile_extension}| tr '[:upper:]' '[:lower:]'`
+# Convert the source extension to lowercase, unless the format is known.
+if [ "$filetype" = "" ]; then
+    filetype=`echo ${infile_extension}| tr '[:upper:]' '[:lower:]'`
+fi
 case "$filetype" in
 	flac)	decoder="flac" ; options="-d -c --"  ;;
-	oga|ogg|ogv|ogx)
+	oga|ogg|ogv|ogx|vorbis)
 	        # Quiet mode is needed to workaround a bug in oggdec
 	        # 1.4 which prints the version banner to stdout, which
 	        # then corrupts the decoded track.
 		decoder="oggdec" ; options="--quiet --output - --" ;;
-	m4a)	decoder="faad" ; options="-o -" ;;
+	m4a|aac)	decoder="faad" ; options="-o -" ;;
 	wav)	decoder="" ;;
 	*)	decoder="ffmpeg" ;;
 esac
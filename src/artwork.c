@@ -0,0 +1,320 @@
+/* Copyright 2012, Guilherme P. Gonçalves (guilherme.p.gonc@gmail.com)
+ *
+ * This file is part of ipod-syncer.
+ *
+ * ipod-syncer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ipod-syncer.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gpod/itdb.h>
+#include <gdk-pixbuf/gdk-pixbuf.h>
+
+#include "artwork.h"
+
+/* Size images are scaled to for devices that don't list their formats */
+#define DEFAULT_SIZE 320
+
+/* Cover art is shared by all the tracks of an album, and the medialib
+ * tells images apart by the hash of their contents. Each image is
+ * fetched, decoded and scaled down once, to the largest cover art format
+ * of the device, and the same pixbuf is attached to every track that
+ * uses it. Scaled images are kept in the user's cache directory as png
+ * files named after their hash, so later runs don't fetch or decode
+ * them again.
+ *
+ * The store follows the device it was last set up for, see
+ * artwork_set_device; a size of 0 means the device shows no artwork.
+ */
+struct artwork_St {
+    GMutex lock;
+    gint size;
+    gchar *dir;
+
+    /* hash -> GdkPixbuf, or NULL for images that couldn't be used */
+    GHashTable *images;
+};
+
+static void unref_image (gpointer pixbuf);
+static GdkPixbuf *scale_image (gint size, GdkPixbuf *pixbuf);
+static gchar *cache_path (artwork_t *artwork, const gchar *hash);
+static gint device_size (const Itdb_Device *device);
+
+static void
+unref_image (gpointer pixbuf)
+{
+    if (pixbuf) {
+        g_object_unref (pixbuf);
+    }
+
+    return;
+}
+
+/**
+ * Internal, scale an image down to fit in size, keeping its aspect
+ * ratio. Returns a new reference.
+ */
+static GdkPixbuf *
+scale_image (gint size, GdkPixbuf *pixbuf)
+{
+    gint width, height;
+
+    width = gdk_pixbuf_get_width (pixbuf);
+    height = gdk_pixbuf_get_height (pixbuf);
+
+    if (width <= size && height <= size) {
+        return g_object_ref (pixbuf);
+    }
+
+    if (width > height) {
+        height = MAX (height * size / width, 1);
+        width = size;
+    } else {
+        width = MAX (width * size / height, 1);
+        height = size;
+    }
+
+    return gdk_pixbuf_scale_simple (pixbuf, width, height, GDK_INTERP_BILINEAR);
+}
+
+/**
+ * Internal, the path of the cached copy of an image, or NULL if its hash
+ * isn't fit for a file name.
+ */
+static gchar *
+cache_path (artwork_t *artwork, const gchar *hash)
+{
+    gchar *filename, *path;
+
+    if (!*hash || strchr (hash, G_DIR_SEPARATOR) || hash[0] == '.') {
+        return NULL;
+    }
+
+    filename = g_strconcat (hash, ".png", NULL);
+    path = g_build_filename (artwork->dir, filename, NULL);
+    g_free (filename);
+
+    return path;
+}
+
+/**
+ * Internal, the size images are scaled to for a device, that of its
+ * largest cover art format, or 0 if it doesn't show artwork.
+ */
+static gint
+device_size (const Itdb_Device *device)
+{
+    GList *formats, *n;
+    const Itdb_ArtworkFormat *format;
+    gint size = 0;
+
+    if (!device || !itdb_device_supports_artwork (device)) {
+        return 0;
+    }
+
+    formats = itdb_device_get_cover_art_formats (device);
+    for (n = formats; n; n = g_list_next (n)) {
+        format = (const Itdb_ArtworkFormat *) n->data;
+        size = MAX (size, MAX (format->width, format->height));
+    }
+
+    g_list_free (formats);
+
+    return size > 0 ? size : DEFAULT_SIZE;
+}
+
+/**
+ * Create an artwork store for a device, see artwork_set_device.
+ */
+artwork_t *
+artwork_new (const Itdb_Device *device)
+{
+    artwork_t *artwork;
+
+    artwork = g_new0 (artwork_t, 1);
+    g_mutex_init (&artwork->lock);
+
+    artwork->images = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                             g_free, unref_image);
+
+    artwork_set_device (artwork, device);
+
+    return artwork;
+}
+
+/**
+ * Set the store up for a device, say after the iPod was swapped for
+ * another model. If its images are of another size, those in memory are
+ * dropped. For devices that don't show artwork, every image counts as
+ * stored, so none is fetched, and no track gets thumbnails.
+ * Safe to call while the store is in use from other threads.
+ */
+void
+artwork_set_device (artwork_t *artwork, const Itdb_Device *device)
+{
+    gint size;
+    gchar *name;
+
+    size = device_size (device);
+
+    g_mutex_lock (&artwork->lock);
+
+    if (size != artwork->size) {
+        artwork->size = size;
+        g_hash_table_remove_all (artwork->images);
+
+        g_free (artwork->dir);
+        artwork->dir = NULL;
+
+        /* images scaled for another size are of no use */
+        if (size > 0) {
+            name = g_strdup_printf ("%d", size);
+            artwork->dir = g_build_filename (g_get_user_cache_dir (), "ipod-syncer",
+                                             "artwork", name, NULL);
+            g_free (name);
+
+            g_mkdir_with_parents (artwork->dir, 0755);
+        }
+    }
+
+    g_mutex_unlock (&artwork->lock);
+
+    return;
+}
+
+void
+artwork_free (artwork_t *artwork)
+{
+    g_hash_table_destroy (artwork->images);
+    g_mutex_clear (&artwork->lock);
+    g_free (artwork->dir);
+    g_free (artwork);
+
+    return;
+}
+
+/**
+ * Check whether an image is already in the store, loading it from the
+ * cache if it was stored by an earlier run. Images that couldn't be
+ * used count as stored, so they aren't fetched over and over, and so do
+ * all images if the device doesn't show artwork.
+ * Safe to call from several threads at once.
+ */
+gboolean
+artwork_contains (artwork_t *artwork, const gchar *hash)
+{
+    GdkPixbuf *pixbuf = NULL;
+    gchar *path;
+    gboolean ret;
+
+    g_mutex_lock (&artwork->lock);
+
+    if (!(ret = artwork->size == 0 || g_hash_table_contains (artwork->images, hash))) {
+        path = cache_path (artwork, hash);
+
+        if (path && (pixbuf = gdk_pixbuf_new_from_file (path, NULL))) {
+            g_hash_table_insert (artwork->images, g_strdup (hash), pixbuf);
+            ret = TRUE;
+        }
+
+        g_free (path);
+    }
+
+    g_mutex_unlock (&artwork->lock);
+
+    return ret;
+}
+
+/**
+ * Decode an image fetched from the medialib, scale it down and keep it,
+ * in memory and in the cache. If data is NULL or can't be decoded, the
+ * image is remembered as unusable.
+ * Safe to call from several threads at once.
+ */
+void
+artwork_store (artwork_t *artwork, const gchar *hash,
+               const guchar *data, gsize len)
+{
+    GdkPixbufLoader *loader;
+    GdkPixbuf *pixbuf = NULL;
+    gchar *path;
+    gint size;
+
+    /* decoded without the lock, for the size at the time */
+    g_mutex_lock (&artwork->lock);
+    size = artwork->size;
+    path = size > 0 ? cache_path (artwork, hash) : NULL;
+    g_mutex_unlock (&artwork->lock);
+
+    if (size == 0) {
+        return;
+    }
+
+    if (data) {
+        loader = gdk_pixbuf_loader_new ();
+
+        if (gdk_pixbuf_loader_write (loader, data, len, NULL) &&
+            gdk_pixbuf_loader_close (loader, NULL) &&
+            gdk_pixbuf_loader_get_pixbuf (loader)) {
+            pixbuf = scale_image (size, gdk_pixbuf_loader_get_pixbuf (loader));
+        } else {
+            /* a failed write leaves the loader open */
+            gdk_pixbuf_loader_close (loader, NULL);
+        }
+
+        g_object_unref (loader);
+    }
+
+    if (pixbuf && path) {
+        gdk_pixbuf_save (pixbuf, path, "png", NULL, NULL);
+    }
+
+    g_free (path);
+
+    g_mutex_lock (&artwork->lock);
+
+    if (artwork->size == size) {
+        g_hash_table_replace (artwork->images, g_strdup (hash), pixbuf);
+    } else {
+        unref_image (pixbuf);
+    }
+
+    g_mutex_unlock (&artwork->lock);
+
+    return;
+}
+
+/**
+ * Attach a stored image to a track as its thumbnails.
+ * Returns false if the image isn't in the store or couldn't be used.
+ */
+gboolean
+artwork_set_thumbnails (artwork_t *artwork, Itdb_Track *track,
+                        const gchar *hash)
+{
+    GdkPixbuf *pixbuf;
+    gboolean ret = FALSE;
+
+    g_mutex_lock (&artwork->lock);
+
+    /* the track takes a reference of its own */
+    if ((pixbuf = g_hash_table_lookup (artwork->images, hash))) {
+        ret = itdb_track_set_thumbnails_from_pixbuf (track, pixbuf);
+    }
+
+    g_mutex_unlock (&artwork->lock);
+
+    return ret;
+}
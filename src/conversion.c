@@ -1,41 +1,197 @@
+#include <unistd.h>
+#include <sys/wait.h>
 #include <glib.h>
+#include <glib/gstdio.h>
+#include <gpod/itdb.h>
+#include "format-probe.h"
 #include "conversion.h"
+#include "transcode-cache.h"
+
+#ifdef NATIVE_CONVERSION
+    #include "native-conversion.h"
+#endif
+
+static gchar *cache_options (const conversion_tags_t *tags);
+static gboolean run_conversion_script (gchar *filepath, audio_format_t format, gchar *mp3path, const conversion_tags_t *tags, GError **err);
+
+/**
+ * Build the encoder options part of a transcode cache key.
+ * Tags are embedded in the converted file, so they are part of it too.
+ */
+static gchar *
+cache_options (const conversion_tags_t *tags)
+{
+    #define OR_EMPTY(s) ((s) ? (s) : "")
+
+    return g_strdup_printf ("%s\n%s\n%s\n%s\n%s\n%d", ENCODER_OPTS,
+                            OR_EMPTY (tags->title), OR_EMPTY (tags->artist),
+                            OR_EMPTY (tags->album), OR_EMPTY (tags->genre),
+                            tags->track_nr);
+
+    #undef OR_EMPTY
+}
+
+/**
+ * Convert a file to mp3 using the conversion script, which is told the
+ * file's format unless it's unknown, so it needn't trust the extension.
+ */
+static gboolean
+run_conversion_script (gchar *filepath, audio_format_t format, gchar *mp3path,
+                       const conversion_tags_t *tags, GError **err)
+{
+    gint status;
+    gboolean ret = FALSE;
+    gchar *track;
+    GPtrArray *argv;
+
+    argv = g_ptr_array_new ();
+    track = g_strdup_printf ("%d", tags->track_nr);
+
+    g_ptr_array_add (argv, SCRIPTDIR "convert-2mp3.sh");
+    g_ptr_array_add (argv, "-q");
+    g_ptr_array_add (argv, ENCODER_OPTS);
+    g_ptr_array_add (argv, "-f");
+    g_ptr_array_add (argv, mp3path);
+
+    if (format != AUDIO_FORMAT_UNKNOWN) {
+        g_ptr_array_add (argv, "-F");
+        g_ptr_array_add (argv, (gpointer) format_name (format));
+    }
+
+    #define ADD_TAG(opt, value) \
+        if (value) { \
+            g_ptr_array_add (argv, opt); \
+            g_ptr_array_add (argv, (gpointer) (value)); \
+        }
+
+    ADD_TAG ("-t", tags->title);
+    ADD_TAG ("-a", tags->artist);
+    ADD_TAG ("-A", tags->album);
+    ADD_TAG ("-g", tags->genre);
+    ADD_TAG ("-T", tags->track_nr > 0 ? track : NULL);
+
+    #undef ADD_TAG
+
+    g_ptr_array_add (argv, filepath);
+    g_ptr_array_add (argv, NULL);
+
+    if (!g_spawn_sync (NULL,
+                       (gchar **) argv->pdata,
+                       NULL,
+                       G_SPAWN_STDOUT_TO_DEV_NULL | G_SPAWN_STDERR_TO_DEV_NULL,
+                       NULL,
+                       NULL,
+                       NULL,
+                       NULL,
+                       &status,
+                       err)) {
+        /* err is set already */
+    } else if (WIFEXITED (status) && WEXITSTATUS (status) == 0) {
+        ret = TRUE;
+    } else if (WIFEXITED (status)) {
+        /* the script's own exit codes, see convert-2mp3.sh */
+        g_set_error (err, g_quark_from_static_string (__func__),
+                     WEXITSTATUS (status), "conversion script exited with status %d",
+                     WEXITSTATUS (status));
+    } else if (WIFSIGNALED (status)) {
+        g_set_error (err, g_quark_from_static_string (__func__), status,
+                     "conversion script killed by signal %d", WTERMSIG (status));
+    } else {
+        g_set_error (err, g_quark_from_static_string (__func__), status,
+                     "conversion script failed with wait status %d", status);
+    }
+
+    g_ptr_array_free (argv, TRUE);
+    g_free (track);
+
+    return ret;
+}
 
 /**
- * Check whether a file is an mp3 file.
+ * Convert a file to mp3 format, tagging it with the given tags, and
+ * write the result to mp3path, which must already exist. The decoder is
+ * picked by the file's format, as told by format_probe.
+ * Formats the native engine supports are converted in-process, the
+ * conversion script is only used for everything else. If loudness isn't
+ * NULL and the file is converted in-process, its loudness is measured on
+ * the way and stored in it; otherwise it's left untouched.
+ * Safe to call from several threads at once.
  */
 gboolean
-is_mp3 (const gchar *filepath)
+convert_to_mp3_at (gchar *filepath, audio_format_t format, gchar *mp3path,
+                   const conversion_tags_t *tags, gdouble *loudness,
+                   GError **err)
 {
-    return g_str_has_suffix (filepath, ".mp3");
+#ifdef NATIVE_CONVERSION
+    /* fall back to the script if the native engine fails for any reason */
+    if (native_can_convert (format) &&
+        native_convert_to_mp3 (filepath, format, mp3path, tags, loudness, NULL)) {
+        return TRUE;
+    }
+#endif
+
+    return run_conversion_script (filepath, format, mp3path, tags, err);
 }
 
 /**
- * Convert a file to mp3 format.
- * Returns the path to the converted mp3 file.
+ * Convert a file to mp3 format, tagging it with the given tags.
+ * Returns the path to the converted mp3 file, which must be handed to
+ * release_mp3 once it is no longer needed. If the transcode cache is
+ * enabled, previous conversions of the same file are reused, in which
+ * case loudness isn't measured; see convert_to_mp3_at.
+ * Safe to call from several threads at once.
  */
 gchar *
-convert_to_mp3 (gchar *filepath, GError **err)
+convert_to_mp3 (gchar *filepath, audio_format_t format,
+                const conversion_tags_t *tags, gdouble *loudness, GError **err)
 {
-    gchar *mp3path;
-    gint status;
-    gchar *argv[] = { SCRIPTDIR "convert-2mp3.sh", filepath, NULL };
-
-    g_spawn_sync (NULL,
-                  argv,
-                  NULL,
-                  G_SPAWN_STDERR_TO_DEV_NULL,
-                  NULL,
-                  NULL,
-                  &mp3path,
-                  NULL,
-                  &status,
-                  err);
-
-    if (status) {
+    gint fd;
+    gchar *options, *key, *mp3path = NULL;
+
+    options = cache_options (tags);
+    key = transcode_cache_key (filepath, options);
+    g_free (options);
+
+    if (key && (mp3path = transcode_cache_lookup (key))) {
+        g_free (key);
+        return mp3path;
+    }
+
+    if (key) {
+        mp3path = transcode_cache_reserve (key, err);
+    } else if ((fd = g_file_open_tmp ("ipod-syncer-XXXXXX.mp3", &mp3path, err)) != -1) {
+        close (fd);
+    }
+
+    if (!mp3path) {
+        g_free (key);
+        return NULL;
+    }
+
+    if (!convert_to_mp3_at (filepath, format, mp3path, tags, loudness, err)) {
+        g_remove (mp3path);
         g_free (mp3path);
         mp3path = NULL;
+    } else if (key) {
+        mp3path = transcode_cache_commit (key, mp3path, err);
     }
 
-    return g_strchomp (mp3path);
+    g_free (key);
+    return mp3path;
+}
+
+/**
+ * Release a file returned by convert_to_mp3.
+ * Temporary files are removed, cached ones are kept for later.
+ */
+void
+release_mp3 (gchar *mp3path)
+{
+    if (!transcode_cache_release (mp3path)) {
+        g_remove (mp3path);
+    }
+
+    g_free (mp3path);
+
+    return;
 }
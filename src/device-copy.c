@@ -0,0 +1,324 @@
+/* Copyright 2012, Guilherme P. Gonçalves (guilherme.p.gonc@gmail.com)
+ *
+ * This file is part of ipod-syncer.
+ *
+ * ipod-syncer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ipod-syncer.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gpod/itdb.h>
+
+#ifdef __linux__
+    #include <sys/sendfile.h>
+#endif
+
+#include "errors.h"
+#include "journal.h"
+#include "device-copy.h"
+
+/* Size of the buffer for plain read/write copies. Large, since the
+ * device is usually a slow USB mass storage device, and aligned, so
+ * the kernel can avoid bouncing it.
+ */
+#define COPY_BUFFER_SIZE (1024 * 1024)
+#define COPY_BUFFER_ALIGNMENT 4096
+
+/* Converting workers reserve files in the iPod while the device writer
+ * copies others. Neither libgpod's choice of file names nor the journal
+ * are safe to use from several threads, so both go through this lock.
+ */
+static GMutex lock;
+
+static gboolean copy_fd (gint in, gint out, GError **err);
+static gboolean copy_file (const gchar *src, const gchar *dest, guint64 *copied, GError **err);
+static gchar *create_dest_file (Itdb_Track *track, const gchar *filename, journal_t *journal, GError **err);
+static gboolean finalize_track (Itdb_Track *track, const gchar *devpath, GError **err);
+
+/**
+ * Copy between two file descriptors, letting the kernel do the work
+ * whenever possible. Calls interrupted by a signal are retried.
+ */
+static gboolean
+copy_fd (gint in, gint out, GError **err)
+{
+    gssize len;
+    gchar *buf, *p;
+    gssize written;
+
+#ifdef HAVE_COPY_FILE_RANGE
+    while ((len = copy_file_range (in, NULL, out, NULL, COPY_BUFFER_SIZE, 0)) > 0 ||
+           (len < 0 && errno == EINTR));
+
+    if (len == 0) {
+        return TRUE;
+    } else if (errno != EXDEV && errno != EINVAL && errno != ENOSYS &&
+               errno != EOPNOTSUPP) {
+        SET_ERRNO_ERROR (err, "copy failed");
+        return FALSE;
+    }
+#endif
+
+#ifdef __linux__
+    /* both file positions are up to date, so just carry on */
+    while ((len = sendfile (out, in, NULL, COPY_BUFFER_SIZE)) > 0 ||
+           (len < 0 && errno == EINTR));
+
+    if (len == 0) {
+        return TRUE;
+    } else if (errno != EINVAL && errno != ENOSYS) {
+        SET_ERRNO_ERROR (err, "copy failed");
+        return FALSE;
+    }
+#endif
+
+    if (posix_memalign ((void **) &buf, COPY_BUFFER_ALIGNMENT, COPY_BUFFER_SIZE)) {
+        SET_ERRNO_ERROR (err, "can't allocate copy buffer");
+        return FALSE;
+    }
+
+    while ((len = read (in, buf, COPY_BUFFER_SIZE)) != 0) {
+        if (len < 0 && errno == EINTR) {
+            continue;
+        } else if (len < 0) {
+            break;
+        }
+
+        for (p = buf; len > 0; p += written, len -= written) {
+            while ((written = write (out, p, len)) < 0 && errno == EINTR);
+
+            if (written < 0) {
+                break;
+            }
+        }
+
+        if (len > 0) {
+            break;
+        }
+    }
+
+    if (len != 0) {
+        SET_ERRNO_ERROR (err, "copy failed");
+    }
+
+    free (buf);
+
+    return len == 0;
+}
+
+/**
+ * Copy a file, keeping both files out of the page cache.
+ * No fsync is done; see device_sync.
+ */
+static gboolean
+copy_file (const gchar *src, const gchar *dest, guint64 *copied, GError **err)
+{
+    gint in, out;
+    gboolean ret;
+    GStatBuf st;
+
+    if ((in = g_open (src, O_RDONLY, 0)) == -1) {
+        SET_ERRNO_ERROR (err, "can't open source file");
+        return FALSE;
+    }
+
+    if ((out = g_open (dest, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) {
+        SET_ERRNO_ERROR (err, "can't create file in the iPod");
+        close (in);
+        return FALSE;
+    }
+
+    posix_fadvise (in, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    ret = copy_fd (in, out, err);
+
+    if (ret && fstat (out, &st) == 0) {
+        *copied = st.st_size;
+    }
+
+#ifdef __linux__
+    /* write the file out now and wait for it, as only clean pages can be
+     * dropped below
+     */
+    sync_file_range (out, 0, 0, SYNC_FILE_RANGE_WAIT_BEFORE |
+                     SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+#endif
+
+    /* a huge sync shouldn't push everything else out of the page cache */
+    posix_fadvise (in, 0, 0, POSIX_FADV_DONTNEED);
+    posix_fadvise (out, 0, 0, POSIX_FADV_DONTNEED);
+
+    close (in);
+
+    if (close (out) != 0 && ret) {
+        SET_ERRNO_ERROR (err, "can't write file in the iPod");
+        ret = FALSE;
+    }
+
+    return ret;
+}
+
+/**
+ * Internal, pick a file in the iPod's music directories for a track,
+ * with the extension of filename, and create it empty, so no other track
+ * picks it. If a journal is given, the file is recorded in it first.
+ * Returns the path to the file.
+ */
+static gchar *
+create_dest_file (Itdb_Track *track, const gchar *filename,
+                  journal_t *journal, GError **err)
+{
+    gint fd;
+    gchar *devpath;
+    const gchar *mountpoint = itdb_get_mountpoint (track->itdb);
+
+    g_mutex_lock (&lock);
+
+    devpath = itdb_cp_get_dest_filename (track, mountpoint, filename, err);
+
+    if (devpath && journal && !journal_add_file (journal, devpath, err)) {
+        g_free (devpath);
+        devpath = NULL;
+    }
+
+    if (devpath && (fd = g_open (devpath, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) {
+        SET_ERRNO_ERROR (err, "can't create file in the iPod");
+        g_free (devpath);
+        devpath = NULL;
+    } else if (devpath) {
+        close (fd);
+    }
+
+    g_mutex_unlock (&lock);
+
+    return devpath;
+}
+
+/**
+ * Internal, register a track with its file in the iPod.
+ */
+static gboolean
+finalize_track (Itdb_Track *track, const gchar *devpath, GError **err)
+{
+    gboolean ret;
+
+    g_mutex_lock (&lock);
+    ret = itdb_cp_finalize (track, itdb_get_mountpoint (track->itdb), devpath, err) != NULL;
+    g_mutex_unlock (&lock);
+
+    return ret;
+}
+
+/**
+ * Create an empty file for a track in the iPod's music directories and
+ * register the track with it, so it can be written to directly. The
+ * file's extension is taken from filename.
+ * If anything goes wrong later, removing the track cleans it up.
+ * If a journal is given, the file is recorded in it before creating it.
+ * May be called while other threads copy tracks.
+ * Returns the path to the file.
+ */
+gchar *
+device_reserve_track (Itdb_Track *track, const gchar *filename,
+                      journal_t *journal, GError **err)
+{
+    gchar *devpath;
+
+    if (!(devpath = create_dest_file (track, filename, journal, err))) {
+        return NULL;
+    }
+
+    if (!finalize_track (track, devpath, err)) {
+        g_remove (devpath);
+        g_free (devpath);
+        return NULL;
+    }
+
+    return devpath;
+}
+
+/**
+ * Copy a track to the iPod and register it, like itdb_cp_track_to_ipod.
+ * The file's extension in the iPod is taken from filename.
+ * If a journal is given, the file is recorded in it before copying.
+ * The number of bytes copied is stored in copied.
+ */
+gboolean
+device_copy_track (Itdb_Track *track, const gchar *filepath,
+                   const gchar *filename, journal_t *journal,
+                   guint64 *copied, GError **err)
+{
+    gchar *devpath;
+
+    *copied = 0;
+
+    if (track->transferred) {
+        return TRUE;
+    }
+
+    if (!(devpath = create_dest_file (track, filename, journal, err))) {
+        return FALSE;
+    }
+
+    if (!copy_file (filepath, devpath, copied, err) ||
+        !finalize_track (track, devpath, err)) {
+
+        g_remove (devpath);
+        g_free (devpath);
+        return FALSE;
+    }
+
+    g_free (devpath);
+
+    return TRUE;
+}
+
+/**
+ * Flush everything written to the iPod so far.
+ * Copies aren't synced individually; this is called once, before the
+ * database referencing them is written.
+ */
+gboolean
+device_sync (Itdb_iTunesDB *itdb, GError **err)
+{
+#ifdef HAVE_SYNCFS
+    gint fd;
+    gboolean ret;
+
+    if ((fd = g_open (itdb_get_mountpoint (itdb), O_RDONLY, 0)) == -1) {
+        SET_ERRNO_ERROR (err, "can't open the iPod's mountpoint");
+        return FALSE;
+    }
+
+    if (!(ret = (syncfs (fd) == 0))) {
+        SET_ERRNO_ERROR (err, "can't flush writes to the iPod");
+    }
+
+    close (fd);
+
+    return ret;
+#else
+    sync ();
+
+    return TRUE;
+#endif
+}
@@ -0,0 +1,377 @@
+/* Copyright 2012, Guilherme P. Gonçalves (guilherme.p.gonc@gmail.com)
+ *
+ * This file is part of ipod-syncer.
+ *
+ * ipod-syncer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ipod-syncer.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "fingerprint.h"
+
+#define CACHE_FILENAME "fingerprints"
+
+/* Fingerprints identify recordings by their contents, so the same
+ * recording ripped to several paths can be recognized as such.
+ * A fingerprint is a checksum of the audio frames of a file: tags in
+ * front of and behind them (ID3v2, ID3v1 and APEv2 in mp3 files, the
+ * metadata blocks of flac files) are skipped, so copies that only differ
+ * in their tags share a fingerprint. Other formats are hashed whole.
+ *
+ * Hashing a large collection takes a while, so fingerprints are kept in
+ * the user's cache directory, keyed by path, and only recomputed when
+ * the size or mtime of the file change.
+ */
+typedef struct {
+    gchar *fingerprint;
+    goffset size;
+    gint64 mtime;
+} cache_entry_t;
+
+/* A file to fingerprint, handed to the workers. */
+typedef struct {
+    const gchar *path;
+    goffset size;
+    gint64 mtime;
+    gchar *fingerprint;
+} fingerprint_task_t;
+
+static GMutex lock;
+static GHashTable *cache;
+static gchar *cache_path;
+static gboolean dirty;
+
+static guint32 read_be32 (const guchar *p);
+static guint32 read_le32 (const guchar *p);
+static void audio_range (const guchar *data, gsize length, gsize *start, gsize *end);
+static gchar *fingerprint_file (const gchar *path);
+static void fingerprint_worker (gpointer data, gpointer udata);
+static void free_cache_entry (cache_entry_t *entry);
+static void load_cache (void);
+static void save_cache (void);
+
+static guint32
+read_be32 (const guchar *p)
+{
+    return (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static guint32
+read_le32 (const guchar *p)
+{
+    return (p[3] << 24) | (p[2] << 16) | (p[1] << 8) | p[0];
+}
+
+/**
+ * Internal, find the part of a file that holds its audio frames,
+ * skipping the tags known to surround them.
+ */
+static void
+audio_range (const guchar *data, gsize length, gsize *start, gsize *end)
+{
+    gsize block;
+    gboolean last = FALSE;
+
+    *start = 0;
+    *end = length;
+
+    if (length >= 10 && memcmp (data, "ID3", 3) == 0) {
+        /* ID3v2, with a synchsafe size not counting the header or footer */
+        block = 10 + ((data[6] & 0x7f) << 21 | (data[7] & 0x7f) << 14 |
+                      (data[8] & 0x7f) << 7 | (data[9] & 0x7f));
+        if (data[5] & 0x10) {
+            block += 10;
+        }
+
+        *start = MIN (block, length);
+    } else if (length >= 4 && memcmp (data, "fLaC", 4) == 0) {
+        /* metadata blocks, the last of which is flagged */
+        *start = 4;
+
+        while (!last && *start + 4 <= length) {
+            last = data[*start] & 0x80;
+            block = 4 + (read_be32 (data + *start) & 0xffffff);
+            *start = MIN (*start + block, length);
+        }
+    }
+
+    if (*end - *start >= 128 && memcmp (data + *end - 128, "TAG", 3) == 0) {
+        *end -= 128;
+    }
+
+    if (*end - *start >= 32 && memcmp (data + *end - 32, "APETAGEX", 8) == 0) {
+        /* APEv2 footer; the size includes it, but not the header, if any */
+        block = read_le32 (data + *end - 20);
+        if (read_le32 (data + *end - 12) & 0x80000000) {
+            block += 32;
+        }
+
+        *end -= MIN (block, *end - *start);
+    }
+
+    return;
+}
+
+/**
+ * Internal, compute the fingerprint of a file.
+ * Returns NULL if the file can't be read.
+ */
+static gchar *
+fingerprint_file (const gchar *path)
+{
+    GMappedFile *file;
+    const guchar *data;
+    gsize length, start, end;
+    gchar *fingerprint;
+
+    if (!(file = g_mapped_file_new (path, FALSE, NULL))) {
+        return NULL;
+    }
+
+    data = (const guchar *) g_mapped_file_get_contents (file);
+    length = g_mapped_file_get_length (file);
+
+    audio_range (data, length, &start, &end);
+
+    /* MD5 is plenty to tell recordings apart, and fast */
+    fingerprint = g_compute_checksum_for_data (G_CHECKSUM_MD5,
+                                               data + start, end - start);
+
+    g_mapped_file_unref (file);
+
+    return fingerprint;
+}
+
+/**
+ * Fingerprinting worker, runs in the thread pool.
+ */
+static void
+fingerprint_worker (gpointer data, gpointer udata)
+{
+    fingerprint_task_t *task = (fingerprint_task_t *) data;
+
+    task->fingerprint = fingerprint_file (task->path);
+
+    return;
+}
+
+static void
+free_cache_entry (cache_entry_t *entry)
+{
+    g_free (entry->fingerprint);
+    g_free (entry);
+
+    return;
+}
+
+/**
+ * Internal, read the fingerprints stored by earlier runs.
+ * Each line holds a fingerprint, the size and mtime of the file it was
+ * computed from, and its escaped path.
+ */
+static void
+load_cache (void)
+{
+    guint i;
+    gchar *contents, **lines, **fields;
+    cache_entry_t *entry;
+
+    if (!g_file_get_contents (cache_path, &contents, NULL, NULL)) {
+        return;
+    }
+
+    lines = g_strsplit (contents, "\n", -1);
+
+    for (i = 0; lines[i]; i++) {
+        fields = g_strsplit (lines[i], " ", 4);
+
+        if (g_strv_length (fields) == 4) {
+            entry = g_new0 (cache_entry_t, 1);
+            entry->fingerprint = g_strdup (fields[0]);
+            entry->size = g_ascii_strtoll (fields[1], NULL, 10);
+            entry->mtime = g_ascii_strtoll (fields[2], NULL, 10);
+
+            g_hash_table_replace (cache, g_strcompress (fields[3]), entry);
+        }
+
+        g_strfreev (fields);
+    }
+
+    g_strfreev (lines);
+    g_free (contents);
+
+    return;
+}
+
+/**
+ * Internal, store the fingerprints for later runs, see load_cache.
+ */
+static void
+save_cache (void)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+    cache_entry_t *entry;
+    GString *data;
+    gchar *dir, *escaped;
+
+    data = g_string_new (NULL);
+
+    g_hash_table_iter_init (&iter, cache);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        entry = (cache_entry_t *) value;
+        escaped = g_strescape ((const gchar *) key, NULL);
+
+        g_string_append_printf (data, "%s %" G_GINT64_FORMAT " %" G_GINT64_FORMAT " %s\n",
+                                entry->fingerprint, (gint64) entry->size,
+                                entry->mtime, escaped);
+        g_free (escaped);
+    }
+
+    dir = g_path_get_dirname (cache_path);
+    g_mkdir_with_parents (dir, 0755);
+    g_free (dir);
+
+    g_file_set_contents (cache_path, data->str, data->len, NULL);
+    g_string_free (data, TRUE);
+
+    return;
+}
+
+/**
+ * Load the fingerprints computed by earlier runs.
+ */
+void
+fingerprint_init (void)
+{
+    cache = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                   (GDestroyNotify) free_cache_entry);
+    cache_path = g_build_filename (g_get_user_cache_dir (), "ipod-syncer",
+                                   CACHE_FILENAME, NULL);
+    load_cache ();
+
+    return;
+}
+
+/**
+ * Store the fingerprints computed so far, and free them.
+ */
+void
+fingerprint_deinit (void)
+{
+    if (!cache) {
+        return;
+    }
+
+    if (dirty) {
+        save_cache ();
+    }
+
+    g_hash_table_destroy (cache);
+    g_free (cache_path);
+    cache = NULL;
+
+    return;
+}
+
+/**
+ * Get the fingerprints of a list of files, computing those not cached
+ * or whose file changed with num_workers threads.
+ * Returns a table from the paths to their fingerprints, both owned by
+ * the table. Files that can't be read are left out.
+ * New fingerprints are stored right away, as the service may run for
+ * long without exiting.
+ */
+GHashTable *
+fingerprint_files (GPtrArray *paths, gint num_workers)
+{
+    guint i;
+    GStatBuf st;
+    const gchar *path;
+    cache_entry_t *entry;
+    fingerprint_task_t *task;
+    GThreadPool *pool;
+    GPtrArray *tasks;
+    GHashTable *ret;
+
+    g_return_val_if_fail (cache, NULL);
+
+    ret = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+    tasks = g_ptr_array_new_with_free_func (g_free);
+    pool = g_thread_pool_new (fingerprint_worker, NULL, MAX (num_workers, 1),
+                              TRUE, NULL);
+
+    g_mutex_lock (&lock);
+
+    for (i = 0; i < paths->len; i++) {
+        path = g_ptr_array_index (paths, i);
+
+        if (g_hash_table_contains (ret, path) || g_stat (path, &st) != 0) {
+            continue;
+        }
+
+        entry = g_hash_table_lookup (cache, path);
+
+        if (entry && entry->size == st.st_size && entry->mtime == st.st_mtime) {
+            g_hash_table_insert (ret, g_strdup (path),
+                                 g_strdup (entry->fingerprint));
+            continue;
+        }
+
+        task = g_new0 (fingerprint_task_t, 1);
+        task->path = path;
+        task->size = st.st_size;
+        task->mtime = st.st_mtime;
+
+        /* placeholder, so repeated paths are only hashed once */
+        g_hash_table_insert (ret, g_strdup (path), NULL);
+
+        g_ptr_array_add (tasks, task);
+        g_thread_pool_push (pool, task, NULL);
+    }
+
+    /* wait for all of them */
+    g_thread_pool_free (pool, FALSE, TRUE);
+
+    for (i = 0; i < tasks->len; i++) {
+        task = g_ptr_array_index (tasks, i);
+
+        if (!task->fingerprint) {
+            g_hash_table_remove (ret, task->path);
+            continue;
+        }
+
+        entry = g_new0 (cache_entry_t, 1);
+        entry->fingerprint = g_strdup (task->fingerprint);
+        entry->size = task->size;
+        entry->mtime = task->mtime;
+
+        g_hash_table_replace (cache, g_strdup (task->path), entry);
+        g_hash_table_replace (ret, g_strdup (task->path), task->fingerprint);
+        dirty = TRUE;
+    }
+
+    if (dirty) {
+        save_cache ();
+        dirty = FALSE;
+    }
+
+    g_mutex_unlock (&lock);
+
+    g_ptr_array_free (tasks, TRUE);
+
+    return ret;
+}
@@ -0,0 +1,410 @@
+/* Copyright 2012, Guilherme P. Gonçalves (guilherme.p.gonc@gmail.com)
+ *
+ * This file is part of ipod-syncer.
+ *
+ * ipod-syncer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ipod-syncer.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <glib.h>
+#include <gpod/itdb.h>
+
+#include "format-probe.h"
+
+/* How far past the tags to look for the first mp3 frame */
+#define MP3_SCAN_LIMIT 4096
+
+/* Formats are told by the headers of the files, not their names, so
+ * mislabelled files are caught too: container magic for RIFF, AIFF,
+ * flac, ogg and MPEG-4 files, whose codec is read from the sample
+ * description of their first audio track, and a valid layer III frame
+ * header, after any ID3v2 tag, for mp3 files.
+ */
+
+static guint32 read_be32 (const guchar *p);
+static guint64 read_be64 (const guchar *p);
+static guint16 read_le16 (const guchar *p);
+static guint32 read_le32 (const guchar *p);
+static gsize id3v2_size (const guchar *data, gsize length);
+static gboolean is_mp3_frame (const guchar *p);
+static gboolean find_atom (const guchar *data, gsize start, gsize end, const gchar *type, gsize *child_start, gsize *child_end);
+static audio_format_t probe_mp4 (const guchar *data, gsize length);
+static audio_format_t probe_wav (const guchar *data, gsize length);
+static audio_format_t probe_data (const guchar *data, gsize length);
+static gboolean has_mp3_suffix (const gchar *filepath);
+
+static guint32
+read_be32 (const guchar *p)
+{
+    return (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static guint64
+read_be64 (const guchar *p)
+{
+    return ((guint64) read_be32 (p) << 32) | read_be32 (p + 4);
+}
+
+static guint16
+read_le16 (const guchar *p)
+{
+    return (p[1] << 8) | p[0];
+}
+
+static guint32
+read_le32 (const guchar *p)
+{
+    return (p[3] << 24) | (p[2] << 16) | (p[1] << 8) | p[0];
+}
+
+/**
+ * Internal, the size of the ID3v2 tag at the start of a file, if any.
+ */
+static gsize
+id3v2_size (const guchar *data, gsize length)
+{
+    gsize size;
+
+    if (length < 10 || memcmp (data, "ID3", 3) != 0) {
+        return 0;
+    }
+
+    /* synchsafe, not counting the header or footer */
+    size = 10 + ((data[6] & 0x7f) << 21 | (data[7] & 0x7f) << 14 |
+                 (data[8] & 0x7f) << 7 | (data[9] & 0x7f));
+    if (data[5] & 0x10) {
+        size += 10;
+    }
+
+    return MIN (size, length);
+}
+
+/**
+ * Internal, check whether four bytes are a valid MPEG audio layer III
+ * frame header.
+ */
+static gboolean
+is_mp3_frame (const guchar *p)
+{
+    return p[0] == 0xff && (p[1] & 0xe0) == 0xe0 &&
+           (p[1] & 0x18) != 0x08 &&  /* reserved version */
+           (p[1] & 0x06) == 0x02 &&  /* layer III */
+           (p[2] & 0xf0) != 0x00 && (p[2] & 0xf0) != 0xf0 &&
+           (p[2] & 0x0c) != 0x0c;
+}
+
+/**
+ * Internal, find the first atom of some type among the sibling atoms
+ * between start and end of an MPEG-4 file. Its contents, past the
+ * header, are stored in child_start and child_end.
+ */
+static gboolean
+find_atom (const guchar *data, gsize start, gsize end, const gchar *type,
+           gsize *child_start, gsize *child_end)
+{
+    guint64 size;
+    gsize header;
+
+    while (start + 8 <= end) {
+        size = read_be32 (data + start);
+        header = 8;
+
+        if (size == 1) {
+            /* 64-bit size following the type */
+            if (start + 16 > end) {
+                return FALSE;
+            }
+
+            size = read_be64 (data + start + 8);
+            header = 16;
+        } else if (size == 0) {
+            /* extends to the end of its parent */
+            size = end - start;
+        }
+
+        if (size < header || size > end - start) {
+            return FALSE;
+        }
+
+        if (memcmp (data + start + 4, type, 4) == 0) {
+            *child_start = start + header;
+            *child_end = start + size;
+            return TRUE;
+        }
+
+        start += size;
+    }
+
+    return FALSE;
+}
+
+/**
+ * Internal, tell the codec of an MPEG-4 file by the sample description
+ * of its first track holding AAC or Apple Lossless audio.
+ */
+static audio_format_t
+probe_mp4 (const guchar *data, gsize length)
+{
+    static const gchar *path[] = {"mdia", "minf", "stbl", "stsd"};
+    gsize moov, moov_end, start, end;
+    guint i;
+
+    if (!find_atom (data, 0, length, "moov", &moov, &moov_end)) {
+        return AUDIO_FORMAT_UNKNOWN;
+    }
+
+    while (find_atom (data, moov, moov_end, "trak", &start, &end)) {
+        /* the next track, if this isn't the one */
+        moov = end;
+
+        for (i = 0; i < G_N_ELEMENTS (path); i++) {
+            if (!find_atom (data, start, end, path[i], &start, &end)) {
+                break;
+            }
+        }
+
+        /* version, flags and entry count, then the first sample entry */
+        if (i < G_N_ELEMENTS (path) || end - start < 16) {
+            continue;
+        }
+
+        if (memcmp (data + start + 12, "mp4a", 4) == 0) {
+            return AUDIO_FORMAT_AAC;
+        } else if (memcmp (data + start + 12, "alac", 4) == 0) {
+            return AUDIO_FORMAT_ALAC;
+        }
+    }
+
+    return AUDIO_FORMAT_UNKNOWN;
+}
+
+/**
+ * Internal, check that a RIFF WAVE file holds plain 8 or 16-bit PCM,
+ * which is all the iPod plays.
+ */
+static audio_format_t
+probe_wav (const guchar *data, gsize length)
+{
+    gsize chunk = 12, size;
+    guint16 tag;
+
+    while (chunk + 8 <= length) {
+        size = read_le32 (data + chunk + 4);
+
+        if (memcmp (data + chunk, "fmt ", 4) == 0) {
+            if (size < 16 || chunk + 8 + size > length) {
+                break;
+            }
+
+            tag = read_le16 (data + chunk + 8);
+
+            /* WAVE_FORMAT_EXTENSIBLE keeps the real tag in its GUID */
+            if (tag == 0xfffe && size >= 40) {
+                tag = read_le16 (data + chunk + 32);
+            }
+
+            if (tag == 1 && (read_le16 (data + chunk + 22) == 8 ||
+                             read_le16 (data + chunk + 22) == 16)) {
+                return AUDIO_FORMAT_WAV;
+            }
+
+            break;
+        }
+
+        /* chunks are padded to an even size */
+        chunk += 8 + size + (size & 1);
+    }
+
+    return AUDIO_FORMAT_UNKNOWN;
+}
+
+/**
+ * Internal, tell the format of a file from its contents.
+ */
+static audio_format_t
+probe_data (const guchar *data, gsize length)
+{
+    gsize start, limit;
+
+    if (length >= 12 && memcmp (data, "RIFF", 4) == 0 &&
+        memcmp (data + 8, "WAVE", 4) == 0) {
+        return probe_wav (data, length);
+    } else if (length >= 12 && memcmp (data, "FORM", 4) == 0) {
+        /* compressed AIFF-C isn't playable */
+        return memcmp (data + 8, "AIFF", 4) == 0 ? AUDIO_FORMAT_AIFF
+                                                 : AUDIO_FORMAT_UNKNOWN;
+    } else if (length >= 8 && memcmp (data + 4, "ftyp", 4) == 0) {
+        return probe_mp4 (data, length);
+    } else if (length >= 35 && memcmp (data, "OggS", 4) == 0) {
+        return memcmp (data + 28, "\001vorbis", 7) == 0 ? AUDIO_FORMAT_VORBIS
+                                                         : AUDIO_FORMAT_UNKNOWN;
+    }
+
+    start = id3v2_size (data, length);
+
+    if (length - start >= 4 && memcmp (data + start, "fLaC", 4) == 0) {
+        return AUDIO_FORMAT_FLAC;
+    }
+
+    /* encoders may pad the tag, look a bit further for the first frame */
+    limit = MIN (length, start + MP3_SCAN_LIMIT);
+
+    for (; start + 4 <= limit; start++) {
+        if (is_mp3_frame (data + start)) {
+            return AUDIO_FORMAT_MP3;
+        }
+    }
+
+    return AUDIO_FORMAT_UNKNOWN;
+}
+
+/**
+ * Internal, check whether a file is named like an mp3 file.
+ */
+static gboolean
+has_mp3_suffix (const gchar *filepath)
+{
+    const gchar *extension;
+
+    return (extension = strrchr (filepath, '.')) &&
+           g_ascii_strcasecmp (extension, ".mp3") == 0;
+}
+
+/**
+ * Tell the format of an audio file by its contents.
+ * Files with no header it knows, but named .mp3, are taken to be mp3,
+ * as their first frame may lie past MP3_SCAN_LIMIT.
+ * Returns AUDIO_FORMAT_UNKNOWN if the file can't be read.
+ * Safe to call from several threads at once.
+ */
+audio_format_t
+format_probe (const gchar *filepath)
+{
+    GMappedFile *file;
+    audio_format_t format;
+
+    if (!(file = g_mapped_file_new (filepath, FALSE, NULL))) {
+        return AUDIO_FORMAT_UNKNOWN;
+    }
+
+    /* only the pages holding the headers are actually read */
+    format = probe_data ((const guchar *) g_mapped_file_get_contents (file),
+                         g_mapped_file_get_length (file));
+
+    g_mapped_file_unref (file);
+
+    if (format == AUDIO_FORMAT_UNKNOWN && has_mp3_suffix (filepath)) {
+        format = AUDIO_FORMAT_MP3;
+    }
+
+    return format;
+}
+
+/**
+ * Get a short name for a format, as used in logs.
+ */
+const gchar *
+format_name (audio_format_t format)
+{
+    switch (format) {
+        case AUDIO_FORMAT_UNKNOWN: break;
+        case AUDIO_FORMAT_MP3: return "mp3";
+        case AUDIO_FORMAT_AAC: return "aac";
+        case AUDIO_FORMAT_ALAC: return "alac";
+        case AUDIO_FORMAT_WAV: return "wav";
+        case AUDIO_FORMAT_AIFF: return "aiff";
+        case AUDIO_FORMAT_FLAC: return "flac";
+        case AUDIO_FORMAT_VORBIS: return "vorbis";
+    }
+
+    return "unknown";
+}
+
+/**
+ * Get the extension files of some format should have in the iPod,
+ * which is what it goes by to play them.
+ * Returns NULL for unknown formats.
+ */
+const gchar *
+format_extension (audio_format_t format)
+{
+    switch (format) {
+        case AUDIO_FORMAT_UNKNOWN: break;
+        case AUDIO_FORMAT_MP3: return "mp3";
+        case AUDIO_FORMAT_AAC: return "m4a";
+        case AUDIO_FORMAT_ALAC: return "m4a";
+        case AUDIO_FORMAT_WAV: return "wav";
+        case AUDIO_FORMAT_AIFF: return "aif";
+        case AUDIO_FORMAT_FLAC: return "flac";
+        case AUDIO_FORMAT_VORBIS: return "ogg";
+    }
+
+    return NULL;
+}
+
+/**
+ * Get the set of formats a device plays, as FORMAT_CAP bits, going by
+ * its model as told by libgpod. Unknown models are assumed to play mp3
+ * files only, which all of them do.
+ */
+guint
+format_device_caps (const Itdb_Device *device)
+{
+    const Itdb_IpodInfo *info = NULL;
+    guint caps = FORMAT_CAP (AUDIO_FORMAT_MP3);
+
+    if (device) {
+        info = itdb_device_get_ipod_info (device);
+    }
+
+    if (!info) {
+        return caps;
+    }
+
+    switch (info->ipod_generation) {
+        case ITDB_IPOD_GENERATION_UNKNOWN:
+            break;
+        case ITDB_IPOD_GENERATION_FIRST:
+        case ITDB_IPOD_GENERATION_SECOND:
+            caps |= FORMAT_CAP (AUDIO_FORMAT_WAV) | FORMAT_CAP (AUDIO_FORMAT_AIFF);
+            break;
+        case ITDB_IPOD_GENERATION_THIRD:
+        case ITDB_IPOD_GENERATION_SHUFFLE_2:
+            caps |= FORMAT_CAP (AUDIO_FORMAT_AAC) | FORMAT_CAP (AUDIO_FORMAT_WAV) |
+                    FORMAT_CAP (AUDIO_FORMAT_AIFF);
+            break;
+        case ITDB_IPOD_GENERATION_SHUFFLE_1:
+            caps |= FORMAT_CAP (AUDIO_FORMAT_AAC) | FORMAT_CAP (AUDIO_FORMAT_WAV);
+            break;
+        case ITDB_IPOD_GENERATION_MOBILE:
+            caps |= FORMAT_CAP (AUDIO_FORMAT_AAC);
+            break;
+        default:
+            /* everything from the fourth generation on */
+            caps |= FORMAT_CAP (AUDIO_FORMAT_AAC) | FORMAT_CAP (AUDIO_FORMAT_ALAC) |
+                    FORMAT_CAP (AUDIO_FORMAT_WAV) | FORMAT_CAP (AUDIO_FORMAT_AIFF);
+            break;
+    }
+
+    return caps;
+}
+
+/**
+ * Check whether a format is in a set of formats a device plays.
+ */
+gboolean
+format_is_playable (audio_format_t format, guint caps)
+{
+    return format != AUDIO_FORMAT_UNKNOWN && (caps & FORMAT_CAP (format)) != 0;
+}
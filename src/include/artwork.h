@@ -0,0 +1,28 @@
+/* Copyright 2012, Guilherme P. Gonçalves (guilherme.p.gonc@gmail.com)
+ *
+ * This file is part of ipod-syncer.
+ *
+ * ipod-syncer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ipod-syncer.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+
+typedef struct artwork_St artwork_t;
+
+artwork_t *artwork_new (const Itdb_Device *device);
+void artwork_set_device (artwork_t *artwork, const Itdb_Device *device);
+void artwork_free (artwork_t *artwork);
+gboolean artwork_contains (artwork_t *artwork, const gchar *hash);
+void artwork_store (artwork_t *artwork, const gchar *hash, const guchar *data, gsize len);
+gboolean artwork_set_thumbnails (artwork_t *artwork, Itdb_Track *track, const gchar *hash);
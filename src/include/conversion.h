@@ -17,6 +17,20 @@
  */
 
 #define SCRIPTDIR "scripts/"
+#define ENCODER_OPTS "--preset standard"
 
-gboolean is_mp3 (const gchar *filepath);
-gchar *convert_to_mp3 (gchar *filepath, GError **err);
+/* Average bitrate of tracks encoded with the standard preset, in kbps */
+#define ENCODER_AVERAGE_BITRATE 192
+
+/* Metadata to tag converted files with. All fields may be NULL. */
+typedef struct {
+    const gchar *title;
+    const gchar *artist;
+    const gchar *album;
+    const gchar *genre;
+    gint track_nr;
+} conversion_tags_t;
+
+gboolean convert_to_mp3_at (gchar *filepath, audio_format_t format, gchar *mp3path, const conversion_tags_t *tags, gdouble *loudness, GError **err);
+gchar *convert_to_mp3 (gchar *filepath, audio_format_t format, const conversion_tags_t *tags, gdouble *loudness, GError **err);
+void release_mp3 (gchar *mp3path);
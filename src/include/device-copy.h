@@ -0,0 +1,22 @@
+/* Copyright 2012, Guilherme P. Gonçalves (guilherme.p.gonc@gmail.com)
+ *
+ * This file is part of ipod-syncer.
+ *
+ * ipod-syncer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ipod-syncer.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+gchar *device_reserve_track (Itdb_Track *track, const gchar *filename, journal_t *journal, GError **err);
+gboolean device_copy_track (Itdb_Track *track, const gchar *filepath, const gchar *filename, journal_t *journal, guint64 *copied, GError **err);
+gboolean device_sync (Itdb_iTunesDB *itdb, GError **err);
@@ -0,0 +1,26 @@
+/* Copyright 2012, Guilherme P. Gonçalves (guilherme.p.gonc@gmail.com)
+ *
+ * This file is part of ipod-syncer.
+ *
+ * ipod-syncer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ipod-syncer.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/* Set a GError from errno, appending the system's description of it to
+ * message. The error's domain is the calling function.
+ * Needs errno.h and glib.h.
+ */
+#define SET_ERRNO_ERROR(err, message) \
+    g_set_error (err, g_quark_from_static_string (__func__), errno, \
+                 message ": %s", g_strerror (errno));
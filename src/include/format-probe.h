@@ -0,0 +1,43 @@
+/* Copyright 2012, Guilherme P. Gonçalves (guilherme.p.gonc@gmail.com)
+ *
+ * This file is part of ipod-syncer.
+ *
+ * ipod-syncer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ipod-syncer.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+
+/* Audio formats told apart by format_probe.
+ * AUDIO_FORMAT_AAC and AUDIO_FORMAT_ALAC are MPEG-4 files (m4a) holding
+ * those codecs; raw ADTS streams count as unknown.
+ */
+typedef enum {
+    AUDIO_FORMAT_UNKNOWN,
+    AUDIO_FORMAT_MP3,
+    AUDIO_FORMAT_AAC,
+    AUDIO_FORMAT_ALAC,
+    AUDIO_FORMAT_WAV,
+    AUDIO_FORMAT_AIFF,
+    AUDIO_FORMAT_FLAC,
+    AUDIO_FORMAT_VORBIS
+} audio_format_t;
+
+/* Sets of formats a device can play, as returned by format_device_caps */
+#define FORMAT_CAP(format) (1 << (format))
+
+audio_format_t format_probe (const gchar *filepath);
+const gchar *format_name (audio_format_t format);
+const gchar *format_extension (audio_format_t format);
+guint format_device_caps (const Itdb_Device *device);
+gboolean format_is_playable (audio_format_t format, guint caps);
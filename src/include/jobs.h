@@ -0,0 +1,60 @@
+/* Copyright 2012, Guilherme P. Gonçalves (guilherme.p.gonc@gmail.com)
+ *
+ * This file is part of ipod-syncer.
+ *
+ * ipod-syncer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ipod-syncer.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+typedef struct sync_job_St sync_job_t;
+typedef void (*job_runner_t) (sync_job_t *job);
+
+typedef enum {
+    JOB_QUEUED,
+    JOB_RUNNING,
+    JOB_DONE,
+    JOB_FAILED,
+    JOB_CANCELLED
+} job_state_t;
+
+/* A snapshot of a job's progress. The error and report must be free'd. */
+typedef struct {
+    guint id;
+    job_state_t state;
+    const gchar *stage;
+    guint tracks_total;
+    guint tracks_done;
+    guint64 bytes_written;
+    gchar *error;
+    gchar *report;
+} job_status_t;
+
+void jobs_init (job_runner_t runner);
+sync_job_t *job_new (GArray *ids, gboolean mirror, gboolean dry_run);
+void job_start (sync_job_t *job, gpointer data, GDestroyNotify destroy);
+void job_start_with_runner (sync_job_t *job, job_runner_t runner, gpointer data, GDestroyNotify destroy);
+guint job_get_id (sync_job_t *job);
+gboolean job_is_mirror (sync_job_t *job);
+gboolean job_is_dry_run (sync_job_t *job);
+gpointer job_get_data (sync_job_t *job);
+GArray *job_get_ids (sync_job_t *job);
+void job_set_stage (sync_job_t *job, const gchar *stage);
+void job_set_total (sync_job_t *job, guint total);
+void job_add_progress (sync_job_t *job, guint tracks, guint64 bytes);
+void job_set_report (sync_job_t *job, gchar *report);
+gboolean job_is_cancelled (sync_job_t *job);
+void job_finish (sync_job_t *job, const GError *err);
+gboolean job_cancel (guint id);
+gboolean job_get_status (guint id, job_status_t *status);
+const gchar *job_state_name (job_state_t state);
@@ -0,0 +1,28 @@
+/* Copyright 2012, Guilherme P. Gonçalves (guilherme.p.gonc@gmail.com)
+ *
+ * This file is part of ipod-syncer.
+ *
+ * ipod-syncer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ipod-syncer.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+typedef struct journal_St journal_t;
+
+journal_t *journal_open (Itdb_iTunesDB *itdb, GArray *ids, gboolean mirror, GError **err);
+gboolean journal_is_done (journal_t *journal, gint32 id);
+guint journal_get_done (journal_t *journal);
+gboolean journal_begin (journal_t *journal, GError **err);
+gboolean journal_add_file (journal_t *journal, const gchar *path, GError **err);
+gboolean journal_commit (journal_t *journal, const gint32 *ids, guint n, GError **err);
+void journal_close (journal_t *journal, gboolean finished);
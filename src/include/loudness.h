@@ -0,0 +1,34 @@
+/* Copyright 2012, Guilherme P. Gonçalves (guilherme.p.gonc@gmail.com)
+ *
+ * This file is part of ipod-syncer.
+ *
+ * ipod-syncer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ipod-syncer.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+
+/* Loudness of tracks that couldn't be measured */
+#define LOUDNESS_UNKNOWN G_MAXDOUBLE
+
+typedef struct loudness_meter_St loudness_meter_t;
+
+loudness_meter_t *loudness_meter_new (gint channels, gint rate);
+void loudness_meter_add (loudness_meter_t *meter, const gint16 *pcm, gint frames);
+gdouble loudness_meter_free (loudness_meter_t *meter);
+guint32 loudness_to_soundcheck (gdouble loudness);
+void loudness_init (void);
+void loudness_save (void);
+void loudness_deinit (void);
+gdouble loudness_lookup (const gchar *filepath);
+void loudness_store (const gchar *filepath, gdouble loudness);
@@ -0,0 +1,25 @@
+/* Copyright 2012, Guilherme P. Gonçalves (guilherme.p.gonc@gmail.com)
+ *
+ * This file is part of ipod-syncer.
+ *
+ * ipod-syncer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ipod-syncer.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+gboolean native_can_convert (audio_format_t format);
+gboolean native_convert_to_mp3 (const gchar *filepath, audio_format_t format,
+                                const gchar *mp3path, const conversion_tags_t *tags,
+                                gdouble *loudness, GError **err);
+gboolean native_measure_loudness (const gchar *filepath, audio_format_t format,
+                                  gdouble *loudness, GError **err);
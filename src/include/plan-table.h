@@ -0,0 +1,45 @@
+/* Copyright 2012, Guilherme P. Gonçalves (guilherme.p.gonc@gmail.com)
+ *
+ * This file is part of ipod-syncer.
+ *
+ * ipod-syncer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ipod-syncer.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/* The properties of the tracks of a sync that planning needs, one row per
+ * medialib id, stored in columns. Strings are interned in the table,
+ * so each distinct title, artist or album is only stored once.
+ * Rows without a known source file have a NULL path.
+ * The format of a row's file is only filled in once probed, as flagged
+ * in probed, so that each file is read once per sync.
+ */
+typedef struct {
+    guint len;
+    gint32 *ids;
+    const gchar **paths;
+    const gchar **titles;
+    const gchar **artists;
+    const gchar **albums;
+    gint32 *track_nrs;
+    gint32 *durations;
+    gint32 *sizes;
+    audio_format_t *formats;
+    guint8 *probed;
+    GStringChunk *strings;
+} plan_table_t;
+
+plan_table_t *plan_table_new (guint len);
+void plan_table_free (plan_table_t *rows);
+void plan_table_set_row (plan_table_t *rows, guint row, gint32 id, const gchar *path, const gchar *title, const gchar *artist, const gchar *album, gint32 track_nr, gint32 duration, gint32 size);
+void plan_table_move_row (plan_table_t *rows, guint to, guint from);
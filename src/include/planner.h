@@ -0,0 +1,28 @@
+/* Copyright 2012, Guilherme P. Gonçalves (guilherme.p.gonc@gmail.com)
+ *
+ * This file is part of ipod-syncer.
+ *
+ * ipod-syncer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ipod-syncer.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+typedef struct planner_St planner_t;
+
+planner_t *planner_new (const gchar *rank_property);
+void planner_free (planner_t *planner);
+void planner_add (planner_t *planner, gint32 id, xmmsv_t *properties, gboolean needs_conversion);
+guint64 planner_get_bytes (planner_t *planner);
+GHashTable *planner_fit (planner_t *planner, guint64 available);
+guint64 planner_estimate_bytes (xmmsv_t *properties, gboolean needs_conversion);
+gboolean planner_free_space (const gchar *mountpoint, guint64 *available, GError **err);
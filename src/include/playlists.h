@@ -0,0 +1,33 @@
+/* Copyright 2012, Guilherme P. Gonçalves (guilherme.p.gonc@gmail.com)
+ *
+ * This file is part of ipod-syncer.
+ *
+ * ipod-syncer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ipod-syncer.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/* A playlist to mirror in the iPod: its name and the medialib ids of its
+ * tracks, in order. foreign is set by playlists_mirror if a playlist of
+ * the same name it didn't make is in the way.
+ */
+typedef struct {
+    gchar *name;
+    GArray *ids;
+    gboolean foreign;
+} playlist_source_t;
+
+playlist_source_t *playlist_source_new (const gchar *name, GArray *ids);
+void playlist_source_free (playlist_source_t *source);
+gboolean playlists_mirror (Itdb_iTunesDB *itdb, GPtrArray *sources, GHashTable *tracks, gboolean *changed, GError **err);
+gboolean playlists_record (Itdb_iTunesDB *itdb, GPtrArray *sources, GError **err);
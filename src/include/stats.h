@@ -0,0 +1,38 @@
+/* Copyright 2012, Guilherme P. Gonçalves (guilherme.p.gonc@gmail.com)
+ *
+ * This file is part of ipod-syncer.
+ *
+ * ipod-syncer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ipod-syncer.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+typedef enum {
+    STATS_QUERY,
+    STATS_FETCH,
+    STATS_IMPORT,
+    STATS_CONVERT,
+    STATS_COPY,
+    STATS_VOICEOVER,
+    STATS_WRITE,
+    STATS_NUM_STAGES
+} stats_stage_t;
+
+void stats_init (void);
+void stats_deinit (void);
+gint64 stats_now (void);
+void stats_record (stats_stage_t stage, gint64 since, guint64 bytes);
+void stats_record_batch (stats_stage_t stage, gint64 since, guint runs, guint64 bytes);
+void stats_save_rates (void);
+gdouble stats_estimate (stats_stage_t stage, guint runs, guint64 bytes);
+gchar *stats_to_json (void);
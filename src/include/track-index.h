@@ -0,0 +1,31 @@
+/* Copyright 2012, Guilherme P. Gonçalves (guilherme.p.gonc@gmail.com)
+ *
+ * This file is part of ipod-syncer.
+ *
+ * ipod-syncer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ipod-syncer.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+typedef struct track_index_St track_index_t;
+
+track_index_t *track_index_new (Itdb_iTunesDB *itdb);
+void track_index_free (track_index_t *index);
+void track_index_add (track_index_t *index, Itdb_Track *track);
+void track_index_remove (track_index_t *index, Itdb_Track *track);
+Itdb_Track *track_index_lookup (track_index_t *index, Itdb_Track *track, const gchar *filepath);
+Itdb_Track *track_index_lookup_metadata (track_index_t *index, const gchar *artist, const gchar *album, const gchar *title, gint track_nr, gint tracklen, gint size);
+Itdb_Track *track_index_lookup_source (track_index_t *index, const gchar *filepath);
+void track_index_set_fingerprint (track_index_t *index, Itdb_Track *track, const gchar *fingerprint);
+Itdb_Track *track_index_lookup_fingerprint (track_index_t *index, const gchar *fingerprint);
+const gchar *track_index_get_source (Itdb_Track *track);
+void track_index_set_source (Itdb_Track *track, const gchar *filepath);
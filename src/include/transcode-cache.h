@@ -0,0 +1,26 @@
+/* Copyright 2012, Guilherme P. Gonçalves (guilherme.p.gonc@gmail.com)
+ *
+ * This file is part of ipod-syncer.
+ *
+ * ipod-syncer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ipod-syncer.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+gboolean transcode_cache_init (guint64 max_size);
+void transcode_cache_deinit (void);
+gchar *transcode_cache_key (const gchar *filepath, const gchar *options);
+gchar *transcode_cache_lookup (const gchar *key);
+gchar *transcode_cache_reserve (const gchar *key, GError **err);
+gchar *transcode_cache_commit (const gchar *key, gchar *tmppath, GError **err);
+gboolean transcode_cache_release (const gchar *path);
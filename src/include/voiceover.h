@@ -16,7 +16,10 @@
  * along with ipod-syncer.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-gboolean voiceover_init (const gchar *mountpoint);
+#define VOICEOVER_HELPER_OPTION "voiceover-helper"
+
+gboolean voiceover_init (const gchar *mountpoint, const gchar *self, guint num_workers);
 void voiceover_deinit (void);
-gboolean make_voiceover (Itdb_Track *track);
+guint make_voiceovers (GPtrArray *tracks);
 gboolean remove_voiceover (Itdb_Track *track);
+gint voiceover_helper_main (void);
@@ -0,0 +1,31 @@
+/* Copyright 2012, Guilherme P. Gonçalves (guilherme.p.gonc@gmail.com)
+ *
+ * This file is part of ipod-syncer.
+ *
+ * ipod-syncer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ipod-syncer.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+typedef struct watch_St watch_t;
+
+/* Called with the ids of the entries changed in a batch, which it must
+ * free. Another batch isn't flushed until watch_done is called.
+ */
+typedef void (*watch_flush_t) (GArray *changed, gpointer udata);
+
+watch_t *watch_new (guint window, watch_flush_t flush, gpointer udata);
+void watch_free (watch_t *watch);
+void watch_entry_changed (watch_t *watch, gint32 id);
+void watch_refresh (watch_t *watch);
+void watch_done (watch_t *watch);
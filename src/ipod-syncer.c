@@ -17,6 +17,7 @@
  */
 
 #include <ctype.h>
+#include <string.h>
 #include <glib.h>
 #include <glib/gprintf.h>
 #include <glib/gstdio.h>
@@ -28,9 +29,45 @@
     #include "voiceover.h"
 #endif
 
+#ifdef ARTWORK
+    #include "artwork.h"
+#endif
+
+#include "format-probe.h"
 #include "conversion.h"
+#include "track-index.h"
+#include "transcode-cache.h"
+#include "journal.h"
+#include "device-copy.h"
+#include "jobs.h"
+#include "stats.h"
+#include "planner.h"
+#include "fingerprint.h"
+#include "playlists.h"
+#include "watch.h"
+#include "session.h"
+#include "plan-table.h"
+#include "loudness.h"
+
+#ifdef NATIVE_CONVERSION
+    #include "native-conversion.h"
+#endif
 
 #define DEFAULT_MOUNTPOINT "/media/IPOD"
+#define DEFAULT_CACHE_SIZE 1024 /* MB */
+#define DEFAULT_WATCH_WINDOW 2000 /* ms */
+
+/* How many tracks per transcoding worker may be converted ahead
+ * of the one currently being copied to the device.
+ */
+#define PIPELINE_LOOKAHEAD 2
+
+/* Space to leave free in the iPod for the database and voiceovers */
+#define DEVICE_RESERVE (16 * 1024 * 1024)
+
+/* Flags for the sync service methods, passed as their udata */
+#define SYNC_MIRROR (1 << 0)
+#define SYNC_DRY_RUN (1 << 1)
 
 /* Rudimentary logging */
 #define LOG_MESSAGE(...) \
@@ -44,24 +81,193 @@
 #define SET_ERROR(err, message) \
     g_set_error_literal (err, g_quark_from_static_string (__func__), 0, message);
 
+/* A track on its way to the iPod.
+ * The source path is owned by the pending track, and so is the
+ * converted mp3 file, if any. When converting straight onto the device,
+ * devpath is the track's final location in the iPod instead, reserved
+ * right before converting. Files created in the iPod for the track are
+ * recorded in journal, if any.
+ */
+typedef struct {
+    Itdb_Track *track;
+    gchar *filepath;
+    gchar *mp3path;
+    gchar *devpath;
+    GError *err;
+    audio_format_t format;
+    gboolean needs_conversion;
+    gdouble loudness;
+    gboolean converted;
+    journal_t *journal;
+} pending_track_t;
+
+/* A job waiting for the properties of its ids. */
+typedef struct {
+    sync_job_t *job;
+    gint64 since;
+} fetch_context_t;
+
+/* Called once the artwork of the tracks in a properties table is there */
+typedef void (*artwork_ready_t) (GHashTable *table, gpointer udata);
+
+/* A properties table waiting for the artwork of its tracks. */
+typedef struct {
+    GHashTable *table;
+    guint remaining;
+    artwork_ready_t ready;
+    gpointer udata;
+} artwork_fetch_t;
+
+/* An image requested for an artwork_fetch_t. */
+typedef struct {
+    artwork_fetch_t *fetch;
+    gchar *hash;
+} artwork_request_t;
+
+/* What a sync would do, as worked out by plan_sync.
+ * Sizes are estimates, in bytes, and seconds is negative when there
+ * aren't enough past syncs to estimate the time from.
+ */
+typedef struct {
+    guint tracks;
+    guint present;
+    guint copy;
+    guint transcode;
+    guint voiceover;
+    guint duplicate;
+    guint remove;
+    guint64 bytes;
+    guint64 transcode_bytes;
+    guint64 available;
+    gboolean fits;
+    gdouble seconds;
+} sync_plan_t;
+
+/* A batch of medialib changes in watch mode, see run_watch_job.
+ * stale holds the source paths of the tracks to remove from the iPod,
+ * and the properties of the ids to add or update are in table.
+ */
+typedef struct {
+    GArray *changed;
+    GPtrArray *stale;
+    GArray *added;
+    GArray *updated;
+    GHashTable *table;
+} watch_batch_t;
+
+/* What a failed watch batch leaves to the next one: the ids to sync
+ * again and the source paths of the tracks still to remove.
+ */
+typedef struct {
+    GArray *ids;
+    GPtrArray *stale;
+} watch_retry_t;
+
+/* State shared between the transcoding workers and the device writer. */
+typedef struct {
+    GMutex lock;
+    GCond cond;
+    gint cancelled;
+} pipeline_t;
+
 static GMainLoop *mainloop;
 static gboolean verbose;
+static gint transcode_workers;
+static gboolean direct;
+static gint chunk_size;
+static gchar *fill_property;
+static gboolean dedup;
+static gboolean mp3_only;
+static gboolean soundcheck;
+static guint device_formats;
+static GHashTable *source_fingerprints;
 static Itdb_iTunesDB *itdb;
+static guint database_writes;
+static track_index_t *device_index;
 static xmmsc_connection_t *connection;
 
+/* Watch mode, only touched by the main loop */
+static guint watch_window = DEFAULT_WATCH_WINDOW;
+static watch_t *watcher;
+static xmmsv_coll_t *watch_coll;
+static GHashTable *watched;
+static GPtrArray *watch_stale;
+
 #ifdef VOICEOVER
 static gboolean voiceover;
 #endif
 
+#ifdef ARTWORK
+static artwork_t *artwork;
+#endif
+
 static bool connect_with_autostart (void);
 static xmmsv_t *xmmsv_error_from_GError (const gchar *format, GError **err);
-static gboolean import_track_properties (Itdb_Track *track, gint32 id, GError **err);
+static xmmsc_result_t *query_track_properties (GArray *ids);
+static GHashTable *table_from_properties (xmmsv_t *infos, GError **err);
+static GHashTable *fetch_track_properties (GArray *ids, GError **err);
+static int job_properties_cb (xmmsv_t *val, void *udata);
+static void job_artwork_ready (GHashTable *table, gpointer udata);
+static GPtrArray *missing_artwork (GHashTable *table);
+static void fetch_artwork (GHashTable *table);
+static void fetch_artwork_async (GHashTable *table, artwork_ready_t ready, gpointer udata);
+static void free_artwork_request (artwork_request_t *request);
+static int artwork_data_cb (xmmsv_t *val, void *udata);
+static gboolean import_track_properties (Itdb_Track *track, xmmsv_t *properties, GError **err);
 static gchar *filepath_from_medialib_info (xmmsv_t *info, GError **err);
+static GList *unlink_tracks (GList *list, GHashTable *tracks);
+static void remove_tracks (GHashTable *tracks, GPtrArray *files);
+static gint compare_paths (const gchar **a, const gchar **b);
+static void delete_files (GPtrArray *files);
 static void remove_track (Itdb_Track *track);
 static gboolean clear_tracks (GError **err);
-static Itdb_Track *sync_track (gint32 id, GError **err);
+static gboolean write_database (GError **err);
+static gboolean refresh_database (GError **err);
+static gboolean must_convert (plan_table_t *rows, guint row, audio_format_t *format);
+static gboolean prepare_track (xmmsv_t *properties, plan_table_t *rows, guint row, journal_t *journal, Itdb_Track **track, pending_track_t **pending, GError **err);
+static void free_pending_track (pending_track_t *pending);
+static void convert_worker (gpointer data, gpointer udata);
+static gboolean sync_track (pending_track_t *pending, guint64 *written, GError **err);
+static gboolean sync_tracks (GPtrArray *pending, sync_job_t *job, GError **err);
+static GArray *parse_ids (xmmsv_t *args, GError **err);
+#ifdef VOICEOVER
+static void make_track_voiceovers (GHashTable *tracks);
+#endif
+static void fingerprint_sources (GArray *ids, GHashTable *table);
+static const gchar *source_fingerprint (const gchar *filepath);
+static gboolean sync_chunk (GArray *ids, guint start, guint end, GHashTable *table, plan_table_t *rows, GHashTable *wanted, gboolean remove_stale, sync_job_t *job, journal_t *journal, GError **err);
+static plan_table_t *build_plan_table (const gint32 *ids, guint len, GHashTable *table);
+static Itdb_Track *row_in_device (plan_table_t *rows, guint row, gboolean *needs_conversion, const gchar **fingerprint);
+static gboolean device_available (guint64 *available, GError **err);
+static gboolean plan_ids (GArray *ids, GHashTable *table, plan_table_t *rows, GError **err);
+static gdouble estimate_seconds (const sync_plan_t *plan);
+static gboolean plan_sync (GArray *ids, GHashTable *table, gboolean mirror, sync_plan_t *plan, GError **err);
+static gchar *plan_to_json (const sync_plan_t *plan);
+static gboolean sync_ids (GArray *ids, GHashTable *table, plan_table_t *rows, gboolean mirror, sync_job_t *job, GError **err);
+static void run_job (sync_job_t *job);
 static xmmsv_t *sync_method (xmmsv_t *args, xmmsv_t *kwargs, void *udata);
-static bool run_query (const gchar *query);
+static xmmsv_t *status_method (xmmsv_t *args, xmmsv_t *kwargs, void *udata);
+static xmmsv_t *cancel_method (xmmsv_t *args, xmmsv_t *kwargs, void *udata);
+static xmmsv_t *stats_method (xmmsv_t *args, xmmsv_t *kwargs, void *udata);
+static gboolean parse_job_id (xmmsv_t *args, guint *id, GError **err);
+static GArray *query_ids (const gchar *query, GError **err);
+static GArray *fetch_collection_ids (const gchar *name, const gchar *ns, GError **err);
+static gboolean fetch_namespace (const gchar *ns, GPtrArray *sources, GError **err);
+static GPtrArray *fetch_playlists (GArray *ids, GError **err);
+static gboolean mirror_playlists (GPtrArray *sources, plan_table_t *rows, GError **err);
+static bool run_query (const gchar *query, gboolean playlists, gboolean mirror, gboolean dry_run);
+static gboolean update_track (Itdb_Track *track, xmmsv_t *properties);
+static void free_watch_batch (watch_batch_t *batch);
+static void run_watch_job (sync_job_t *job);
+static gboolean watch_batch_done (gpointer udata);
+static void submit_watch_batch (watch_batch_t *batch);
+static int watch_properties_cb (xmmsv_t *val, void *udata);
+static void watch_artwork_ready (GHashTable *table, gpointer udata);
+static int watch_ids_cb (xmmsv_t *val, void *udata);
+static void watch_flush (GArray *changed, gpointer udata);
+static int entry_changed_cb (xmmsv_t *val, void *udata);
+static int refresh_cb (xmmsv_t *val, void *udata);
+static gboolean setup_watch (const gchar *query, GError **err);
 static void setup_service ();
 static gboolean confirm (const gchar *prompt);
 
@@ -106,31 +312,351 @@ xmmsv_error_from_GError (const gchar *format, GError **err)
 }
 
 /**
- * Import track properties from the medialib into an Itdb_Track.
- * The file's path is assigned to the track's userdata field.
+ * Query the properties of a list of medialib ids, in a single query.
  */
-static gboolean
-import_track_properties (Itdb_Track *track, gint32 id, GError **err)
+static xmmsc_result_t *
+query_track_properties (GArray *ids)
 {
+    guint i;
     xmmsc_result_t *res;
-    xmmsv_t *properties;
+    xmmsv_coll_t *coll;
+    xmmsv_t *fetch;
+
+    const gchar *keys[] = {
+        "id", "url", "title", "album", "artist", "genre",
+        "size", "bitrate", "duration", "tracknr", NULL
+    };
+
+    coll = xmmsv_coll_new (XMMS_COLLECTION_TYPE_IDLIST);
+    for (i = 0; i < ids->len; i++) {
+        xmmsv_coll_idlist_append (coll, g_array_index (ids, gint32, i));
+    }
+
+    fetch = xmmsv_new_list ();
+    for (i = 0; keys[i]; i++) {
+        xmmsv_list_append_string (fetch, keys[i]);
+    }
+
+    /* needed to rank tracks when filling the iPod */
+    if (fill_property) {
+        xmmsv_list_append_string (fetch, fill_property + (fill_property[0] == '-'));
+    }
+
+#ifdef ARTWORK
+    if (artwork) {
+        xmmsv_list_append_string (fetch, "picture_front");
+    }
+#endif
+
+    res = xmmsc_coll_query_infos (connection, coll, NULL, 0, 0, fetch, NULL);
+
+    xmmsv_unref (fetch);
+    xmmsv_coll_unref (coll);
+
+    return res;
+}
+
+/**
+ * Build a table mapping medialib ids to their (flattened) properties
+ * dicts from the result of query_track_properties.
+ * Returns NULL upon error.
+ */
+static GHashTable *
+table_from_properties (xmmsv_t *infos, GError **err)
+{
+    gint32 id;
+    const gchar *errstr;
+    GHashTable *table;
+    xmmsv_t *info;
+    xmmsv_list_iter_t *it;
+
+    if (xmmsv_get_error (infos, &errstr)) {
+        g_set_error (err, g_quark_from_static_string (__func__), 0,
+                     "failed to query track info: %s", errstr);
+        return NULL;
+    }
 
-    res = xmmsc_medialib_get_info (connection, id);
+    table = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+                                   NULL, (GDestroyNotify) xmmsv_unref);
+
+    xmmsv_get_list_iter (infos, &it);
+    for (; xmmsv_list_iter_valid (it); xmmsv_list_iter_next (it)) {
+        xmmsv_list_iter_entry (it, &info);
+
+        if (xmmsv_dict_entry_get_int (info, "id", &id)) {
+            g_hash_table_insert (table, GINT_TO_POINTER (id),
+                                 xmmsv_ref (info));
+        }
+    }
+
+    return table;
+}
+
+/**
+ * Fetch the properties of a list of medialib ids in a single query,
+ * blocking until they arrive.
+ * Returns a table as built by table_from_properties.
+ */
+static GHashTable *
+fetch_track_properties (GArray *ids, GError **err)
+{
+    GHashTable *table;
+    gint64 since;
+    xmmsc_result_t *res;
+
+    since = stats_now ();
+
+    res = query_track_properties (ids);
     xmmsc_result_wait (res);
 
-    if (xmmsv_is_error (xmmsc_result_get_value (res))) {
-        SET_ERROR (err, "failed to query track info");
-        return false;
+    table = table_from_properties (xmmsc_result_get_value (res), err);
+
+    if (table) {
+        stats_record (STATS_FETCH, since, 0);
+        LOG_MESSAGE ("Fetched properties for %u tracks in %.3f seconds\n",
+                     g_hash_table_size (table),
+                     (stats_now () - since) / (gdouble) G_USEC_PER_SEC);
+    }
+
+    xmmsc_result_unref (res);
+
+    return table;
+}
+
+/**
+ * Called from the main loop once the properties for a job's ids arrive,
+ * with the fetch_context_t the fetch was started with.
+ * Queues the job to be run by the job thread.
+ */
+static int
+job_properties_cb (xmmsv_t *val, void *udata)
+{
+    GHashTable *table;
+    GError *err = NULL;
+    fetch_context_t *ctx = (fetch_context_t *) udata;
+    sync_job_t *job = ctx->job;
+
+    if (!(table = table_from_properties (val, &err))) {
+        job_finish (job, err);
+        g_error_free (err);
+        return FALSE;
+    }
+
+    stats_record (STATS_FETCH, ctx->since, 0);
+
+    LOG_MESSAGE ("Fetched properties for %u tracks for job %u\n",
+                 g_hash_table_size (table), job_get_id (job));
+
+    /* plans don't need artwork */
+    if (job_is_dry_run (job)) {
+        job_artwork_ready (table, job);
+    } else {
+        fetch_artwork_async (table, job_artwork_ready, job);
+    }
+
+    return FALSE;
+}
+
+/**
+ * Queues a job to be run by the job thread, once the artwork of its
+ * tracks is there.
+ */
+static void
+job_artwork_ready (GHashTable *table, gpointer udata)
+{
+    job_start ((sync_job_t *) udata, table, (GDestroyNotify) g_hash_table_destroy);
+
+    return;
+}
+
+/**
+ * Internal, list the images used by the tracks in a properties table
+ * that aren't in the artwork store yet, each once.
+ */
+static GPtrArray *
+missing_artwork (GHashTable *table)
+{
+    GPtrArray *missing;
+#ifdef ARTWORK
+    GHashTableIter iter;
+    gpointer value;
+    const gchar *hash;
+    GHashTable *seen;
+#endif
+
+    missing = g_ptr_array_new_with_free_func (g_free);
+
+#ifdef ARTWORK
+    if (!artwork || !table) {
+        return missing;
+    }
+
+    seen = g_hash_table_new (g_str_hash, g_str_equal);
+
+    g_hash_table_iter_init (&iter, table);
+    while (g_hash_table_iter_next (&iter, NULL, &value)) {
+        if (xmmsv_dict_entry_get_string ((xmmsv_t *) value, "picture_front", &hash) &&
+            !g_hash_table_contains (seen, hash)) {
+
+            g_hash_table_add (seen, (gpointer) hash);
+
+            if (!artwork_contains (artwork, hash)) {
+                g_ptr_array_add (missing, g_strdup (hash));
+            }
+        }
+    }
+
+    g_hash_table_destroy (seen);
+#endif
+
+    return missing;
+}
+
+/**
+ * Internal, fetch the images used by the tracks in a properties table
+ * that aren't in the artwork store yet, blocking until they arrive.
+ * Missing artwork isn't fatal to the sync.
+ */
+static void
+fetch_artwork (GHashTable *table)
+{
+    guint i;
+    gint64 since;
+    GPtrArray *missing, *results;
+    artwork_request_t *request;
+
+    missing = missing_artwork (table);
+    results = g_ptr_array_new ();
+    since = stats_now ();
+
+    /* ask for all of them before waiting for any */
+    for (i = 0; i < missing->len; i++) {
+        g_ptr_array_add (results, xmmsc_bindata_retrieve (
+                             connection, g_ptr_array_index (missing, i)));
+    }
+
+    for (i = 0; i < missing->len; i++) {
+        xmmsc_result_wait (g_ptr_array_index (results, i));
+
+        request = g_new0 (artwork_request_t, 1);
+        request->hash = g_strdup (g_ptr_array_index (missing, i));
+
+        artwork_data_cb (xmmsc_result_get_value (g_ptr_array_index (results, i)),
+                         request);
+
+        free_artwork_request (request);
+        xmmsc_result_unref (g_ptr_array_index (results, i));
+    }
+
+    if (missing->len > 0) {
+        LOG_MESSAGE ("Fetched %u images in %.3f seconds\n", missing->len,
+                     (stats_now () - since) / (gdouble) G_USEC_PER_SEC);
+    }
+
+    g_ptr_array_free (results, TRUE);
+    g_ptr_array_free (missing, TRUE);
+
+    return;
+}
+
+/**
+ * Internal, fetch the images used by the tracks in a properties table
+ * that aren't in the artwork store yet from the main loop, and call
+ * ready once all of them are there.
+ */
+static void
+fetch_artwork_async (GHashTable *table, artwork_ready_t ready, gpointer udata)
+{
+    guint i;
+    GPtrArray *missing;
+    artwork_fetch_t *fetch;
+    artwork_request_t *request;
+    xmmsc_result_t *res;
+
+    missing = missing_artwork (table);
+
+    if (missing->len == 0) {
+        g_ptr_array_free (missing, TRUE);
+        ready (table, udata);
+        return;
+    }
+
+    fetch = g_new0 (artwork_fetch_t, 1);
+    fetch->table = table;
+    fetch->remaining = missing->len;
+    fetch->ready = ready;
+    fetch->udata = udata;
+
+    for (i = 0; i < missing->len; i++) {
+        request = g_new0 (artwork_request_t, 1);
+        request->fetch = fetch;
+        request->hash = g_strdup (g_ptr_array_index (missing, i));
+
+        res = xmmsc_bindata_retrieve (connection, request->hash);
+        xmmsc_result_notifier_set_full (res, artwork_data_cb, request,
+                                        (xmmsc_user_data_free_func_t) free_artwork_request);
+        xmmsc_result_unref (res);
+    }
+
+    g_ptr_array_free (missing, TRUE);
+
+    return;
+}
+
+static void
+free_artwork_request (artwork_request_t *request)
+{
+    g_free (request->hash);
+    g_free (request);
+
+    return;
+}
+
+/**
+ * Called with the data of an image requested by fetch_artwork or
+ * fetch_artwork_async, with the artwork_request_t for it.
+ * Stores the image, and hands the table on once it was the last one
+ * missing.
+ */
+static int
+artwork_data_cb (xmmsv_t *val, void *udata)
+{
+    artwork_request_t *request = (artwork_request_t *) udata;
+    artwork_fetch_t *fetch = request->fetch;
+#ifdef ARTWORK
+    const unsigned char *data;
+    unsigned int len;
+
+    if (xmmsv_get_bin (val, &data, &len)) {
+        artwork_store (artwork, request->hash, data, len);
+    } else {
+        LOG_MESSAGE ("Failed to fetch image %s\n", request->hash);
+        artwork_store (artwork, request->hash, NULL, 0);
+    }
+#endif
+
+    if (fetch && --fetch->remaining == 0) {
+        fetch->ready (fetch->table, fetch->udata);
+        g_free (fetch);
     }
 
-    properties = xmmsv_propdict_to_dict (xmmsc_result_get_value (res), NULL);
+    return FALSE;
+}
 
+/**
+ * Import track properties from a medialib properties dict, as
+ * returned by fetch_track_properties, into an Itdb_Track.
+ * The file's path is assigned to the track's userdata field.
+ */
+static gboolean
+import_track_properties (Itdb_Track *track, xmmsv_t *properties, GError **err)
+{
     /* Convenience macros -- extract keys from the properties dict
      * and set the corresponding field in the track object.
      */
     #define TRANSLATE_STRING_PROPERTY(name, key) \
         do { \
-            const gchar *prop; \
+            const gchar *prop = NULL; \
             xmmsv_dict_entry_get_string (properties, key, &prop); \
             track->name = g_strdup (prop); \
         } while (0)
@@ -139,7 +665,7 @@ import_track_properties (Itdb_Track *track, gint32 id, GError **err)
 
     #define TRANSLATE_INT_PROPERTY(name, key) \
         do { \
-            int32_t value; \
+            int32_t value = 0; \
             xmmsv_dict_entry_get_int (properties, key, &value); \
             track->name = value; \
         } while (0);
@@ -159,9 +685,6 @@ import_track_properties (Itdb_Track *track, gint32 id, GError **err)
 
     track->userdata = (gpointer) filepath_from_medialib_info (properties, err);
 
-    xmmsc_result_unref (res);
-    xmmsv_unref (properties);
-
     /* we need at least the path to proceed */
     if (!track->userdata) {
         g_prefix_error (err, "can't determine track path: ");
@@ -197,206 +720,2368 @@ filepath_from_medialib_info (xmmsv_t *info, GError **err)
 }
 
 /**
- * Remove a track from the iPod.
+ * Internal, unlink the tracks in a set from a list of tracks, in place.
+ * Returns the new head of the list.
+ */
+static GList *
+unlink_tracks (GList *list, GHashTable *tracks)
+{
+    GList *n, *next;
+
+    for (n = list; n; n = next) {
+        next = g_list_next (n);
+
+        if (g_hash_table_contains (tracks, n->data)) {
+            list = g_list_delete_link (list, n);
+        }
+    }
+
+    return list;
+}
+
+static gint
+compare_paths (const gchar **a, const gchar **b)
+{
+    return g_strcmp0 (*a, *b);
+}
+
+/**
+ * Remove a set of tracks from the iPod's database, given as the keys of a
+ * hash table. Every playlist and the database's track list are rebuilt in
+ * a single pass.
+ * The paths to the tracks' files are appended to files rather than
+ * deleted, as the database in the iPod may still reference them: see
+ * delete_files.
  * It is the caller's responsibility to write the database back
  * to the device after calling this function.
  */
 static void
-remove_track (Itdb_Track *track)
+remove_tracks (GHashTable *tracks, GPtrArray *files)
 {
     GList *n;
+    GHashTableIter it;
+    Itdb_Playlist *playlist;
+    Itdb_Track *track;
     gchar *filepath;
 
-    LOG_MESSAGE("Deleting track %s\n", track->title);
+    if (g_hash_table_size (tracks) == 0) {
+        return;
+    }
+
+    LOG_MESSAGE ("Deleting %u tracks\n", g_hash_table_size (tracks));
 
-    /* remove track from all playlists */
     for (n = itdb->playlists; n; n = g_list_next (n)) {
-        itdb_playlist_remove_track ((Itdb_Playlist *) n->data, track);
+        playlist = (Itdb_Playlist *) n->data;
+        playlist->members = unlink_tracks (playlist->members, tracks);
+        playlist->num = g_list_length (playlist->members);
     }
 
-    filepath = itdb_filename_on_ipod (track);
-    if (filepath) {
-        g_remove (filepath);
-        g_free (filepath);
-    }
+    itdb->tracks = unlink_tracks (itdb->tracks, tracks);
+
+    g_hash_table_iter_init (&it, tracks);
+    while (g_hash_table_iter_next (&it, (gpointer *) &track, NULL)) {
+        LOG_MESSAGE ("Deleting track %s\n", track->title);
+
+        if ((filepath = itdb_filename_on_ipod (track))) {
+            g_ptr_array_add (files, filepath);
+        }
 
 #ifdef VOICEOVER
-    if (voiceover) {
-        remove_voiceover (track);
-    }
+        if (voiceover) {
+            remove_voiceover (track);
+        }
 #endif
 
-    itdb_track_remove (track);
+        track_index_remove (device_index, track);
+        itdb_track_free (track);
+    }
 
     return;
 }
 
 /**
- * Remove all tracks from the iPod.
- * Playlists are kept, even if empty.
+ * Delete the files of tracks taken out of the database by remove_tracks,
+ * once the database without them was written to the iPod, or right away
+ * if it never referenced them. The array is emptied.
  */
-static gboolean
-clear_tracks (GError **err)
+static void
+delete_files (GPtrArray *files)
 {
-    GList *n, *next;
+    guint i;
 
-    for (n = itdb->tracks; n; n = next) {
-        next = g_list_next (n);
-        remove_track (n->data);
+    /* delete directory by directory */
+    g_ptr_array_sort (files, (GCompareFunc) compare_paths);
+
+    for (i = 0; i < files->len; i++) {
+        g_remove (g_ptr_array_index (files, i));
     }
 
-    return itdb_write (itdb, err);
+    g_ptr_array_set_size (files, 0);
+
+    return;
 }
 
 /**
- * Internal, sync a track given by its medialib id to the iPod.
- * Returns the newly created Itdb_Track, or NULL upon error.
- * It is the caller's responsibility to write the database back to the device.
+ * Remove a track that was never written to the iPod's database, deleting
+ * its file, if any, right away.
  */
-static Itdb_Track *
-sync_track (gint32 id, GError **err)
+static void
+remove_track (Itdb_Track *track)
 {
-    Itdb_Track *track;
-    Itdb_Playlist *mpl;
+    GHashTable *tracks;
+    GPtrArray *files;
 
-    gchar *filepath, *mp3path = NULL;
-    GError *tmp_err = NULL;
+    tracks = g_hash_table_new (g_direct_hash, g_direct_equal);
+    files = g_ptr_array_new_with_free_func (g_free);
+    g_hash_table_add (tracks, track);
 
-    track = itdb_track_new ();
-    mpl = itdb_playlist_mpl (itdb);
+    remove_tracks (tracks, files);
+    delete_files (files);
 
-    itdb_track_add (itdb, track, -1);
-    itdb_playlist_add_track (mpl, track, -1);
+    g_ptr_array_free (files, TRUE);
+    g_hash_table_destroy (tracks);
 
-    if (!import_track_properties (track, id, err)) {
-        return NULL;
-    }
+    return;
+}
 
-    LOG_MESSAGE ("Syncing track %s by %s\n", track->title, track->artist);
+/**
+ * Remove all tracks from the iPod.
+ * Playlists are kept, even if empty.
+ */
+static gboolean
+clear_tracks (GError **err)
+{
+    GList *n;
+    GHashTable *tracks;
+    GPtrArray *files;
+    gboolean ret;
 
-    filepath = (gchar *) track->userdata;
-    g_assert (filepath);
+    tracks = g_hash_table_new (g_direct_hash, g_direct_equal);
+    files = g_ptr_array_new_with_free_func (g_free);
 
-    if (!is_mp3 (filepath)) {
-        LOG_MESSAGE ("  converting track to mp3\n");
+    for (n = itdb->tracks; n; n = g_list_next (n)) {
+        g_hash_table_add (tracks, n->data);
+    }
 
-        mp3path = convert_to_mp3 (filepath, &tmp_err);
+    remove_tracks (tracks, files);
+    g_hash_table_destroy (tracks);
 
-        /* does nothing if tmp_err is NULL */
-        g_prefix_error (&tmp_err, "conversion to mp3 failed. Reason: ");
+    if ((ret = write_database (err))) {
+        delete_files (files);
+    } else {
+        session_invalidate ();
+    }
 
-        g_free (filepath);
-        filepath = mp3path;
+    g_ptr_array_free (files, TRUE);
+
+    return ret;
+}
+
+/**
+ * Internal, flush the copies to the iPod and write the database.
+ */
+static gboolean
+write_database (GError **err)
+{
+    if (!device_sync (itdb, err) || !itdb_write (itdb, err)) {
+        return FALSE;
     }
 
-    if (!tmp_err) {
-        g_assert (filepath && track);
-        itdb_cp_track_to_ipod (track, filepath, &tmp_err);
+    session_mark_written ();
+    database_writes++;
 
-#ifdef VOICEOVER
-        if (!tmp_err && voiceover) {
-            LOG_MESSAGE ("  creating voiceover track\n");
+    return TRUE;
+}
 
-            make_voiceover (track);
-        }
-#endif
+/**
+ * Internal, make sure the database in memory matches the iPod's before
+ * a job, parsing it again only if the iPod was remounted or someone else
+ * changed the database since we last read or wrote it.
+ */
+static gboolean
+refresh_database (GError **err)
+{
+    Itdb_iTunesDB *fresh;
+
+    if (!session_is_stale ()) {
+        return TRUE;
     }
 
-    if (tmp_err) {
-        remove_track (track);
-        track = NULL;
-        g_propagate_error (err, tmp_err);
+    LOG_MESSAGE ("The iPod's database changed, reloading it\n");
+
+    if (!(fresh = session_reload (err))) {
+        g_prefix_error (err, "can't reload the iPod's database: ");
+        return FALSE;
     }
 
-    if (mp3path) {
-        g_assert (filepath == mp3path);
-        LOG_MESSAGE ("  removing temporary mp3 file\n");
-        g_remove (mp3path);
+    track_index_free (device_index);
+    itdb_free (itdb);
+
+    itdb = fresh;
+    device_index = track_index_new (itdb);
+
+    /* it may be another iPod altogether */
+    if (!mp3_only) {
+        device_formats = format_device_caps (itdb->device);
     }
 
-    g_free (filepath);
+#ifdef ARTWORK
+    if (artwork) {
+        artwork_set_device (artwork, itdb->device);
+    }
+#endif
 
-    return track;
+    return TRUE;
 }
 
 /**
- * Sync medialib ids to the iPod.
- * Exported for other clients.
- * This function is atomic: either all or none of the tracks are synced.
+ * Internal, check whether the file for a row of a plan table has to be
+ * converted to mp3 for the iPod, by checking its format, which is stored
+ * in format, against the formats the iPod plays. The file is probed the
+ * first time, and its format kept in the row for later checks.
  */
-static xmmsv_t *
-sync_method (xmmsv_t *args, xmmsv_t *kwargs, void *udata)
+static gboolean
+must_convert (plan_table_t *rows, guint row, audio_format_t *format)
 {
-    Itdb_Track *t;
-    xmmsv_t *idv;
-    gint32 id;
-    xmmsv_list_iter_t *it;
-    GError *err = NULL;
-    GList *n, *tracks = NULL;
+    if (!rows->probed[row]) {
+        rows->formats[row] = format_probe (rows->paths[row]);
+        rows->probed[row] = TRUE;
+    }
+
+    *format = rows->formats[row];
+
+    return !format_is_playable (*format, device_formats);
+}
+
+/**
+ * Internal, create an Itdb_Track from a track's medialib properties and
+ * add it to the database, without copying anything to the device yet.
+ * row is the track's row in rows, the plan table of the sync.
+ * The track is returned in *track, and the pending track to be fed to
+ * sync_tracks in *pending. If the track is already in the iPod, or
+ * another copy of its recording is (see fingerprint_sources), *track
+ * is the existing one and *pending is set to NULL.
+ * Files created in the iPod for the track are recorded in journal, if any.
+ * Returns false upon error.
+ */
+static gboolean
+prepare_track (xmmsv_t *properties, plan_table_t *rows, guint row,
+               journal_t *journal, Itdb_Track **found, pending_track_t **pending, GError **err)
+{
+    Itdb_Track *track;
+    gchar *filepath;
+    const gchar *fingerprint;
+    gboolean needs_conversion;
+    audio_format_t format;
+#ifdef ARTWORK
+    const gchar *hash;
+#endif
+
+    *pending = NULL;
+    *found = NULL;
+    track = itdb_track_new ();
+
+    if (!import_track_properties (track, properties, err)) {
+        itdb_track_free (track);
+        return FALSE;
+    }
+
+    filepath = (gchar *) track->userdata;
+    track->userdata = NULL;
+
+    fingerprint = source_fingerprint (filepath);
+
+    if ((*found = track_index_lookup (device_index, track, filepath)) ||
+        (fingerprint &&
+         (*found = track_index_lookup_fingerprint (device_index, fingerprint)))) {
+        LOG_MESSAGE ("Track %s by %s is already in the iPod, skipping\n",
+                     track->title, track->artist);
+
+        itdb_track_free (track);
+        g_free (filepath);
+        return TRUE;
+    }
+
+    track_index_set_source (track, filepath);
+
+#ifdef ARTWORK
+    if (artwork && xmmsv_dict_entry_get_string (properties, "picture_front", &hash)) {
+        artwork_set_thumbnails (artwork, track, hash);
+    }
+#endif
+
+    needs_conversion = must_convert (rows, row, &format);
+
+    if (!needs_conversion) {
+        LOG_MESSAGE ("  %s plays in the iPod as it is, no need to convert it\n",
+                     format_name (format));
+    }
+
+    itdb_track_add (itdb, track, -1);
+    itdb_playlist_add_track (itdb_playlist_mpl (itdb), track, -1);
+    track_index_add (device_index, track);
+
+    /* later copies of the same recording map to this track */
+    if (fingerprint) {
+        track_index_set_fingerprint (device_index, track, fingerprint);
+    }
+
+    *found = track;
+    *pending = g_new0 (pending_track_t, 1);
+    (*pending)->track = track;
+    (*pending)->filepath = filepath;
+    (*pending)->format = format;
+    (*pending)->journal = journal;
+    (*pending)->needs_conversion = needs_conversion;
+#ifdef NATIVE_CONVERSION
+    (*pending)->loudness = soundcheck ? loudness_lookup (filepath)
+                                      : LOUDNESS_UNKNOWN;
+#else
+    (*pending)->loudness = LOUDNESS_UNKNOWN;
+#endif
+
+    /* files the iPod plays go straight to the device writer, unless
+     * their loudness is yet to be measured
+     */
+    (*pending)->converted = !needs_conversion &&
+        !(soundcheck && (*pending)->loudness == LOUDNESS_UNKNOWN);
+
+    return TRUE;
+}
+
+/**
+ * Free a pending track, releasing its converted mp3 file if needed.
+ * The Itdb_Track itself is left untouched.
+ */
+static void
+free_pending_track (pending_track_t *pending)
+{
+    if (pending->mp3path) {
+        release_mp3 (pending->mp3path);
+    }
+
+    if (pending->err) {
+        g_error_free (pending->err);
+    }
+
+    g_free (pending->filepath);
+    g_free (pending->devpath);
+    g_free (pending);
+
+    return;
+}
+
+/**
+ * Transcoding worker, runs in the thread pool.
+ * Converts a pending track to mp3, measuring its loudness on the way for
+ * soundcheck, and wakes up the device writer. Tracks copied as they are
+ * only have their loudness measured.
+ */
+static void
+convert_worker (gpointer data, gpointer udata)
+{
+    pending_track_t *pending = (pending_track_t *) data;
+    pipeline_t *pipeline = (pipeline_t *) udata;
+    Itdb_Track *track = pending->track;
+    conversion_tags_t tags;
+    const gchar *mp3path;
+    gboolean measure;
+    GStatBuf st;
+    gint64 since;
+
+    measure = soundcheck && pending->loudness == LOUDNESS_UNKNOWN;
+
+    /* the file in the iPod is only created once there is something to
+     * write to it, so a failed sync leaves fewer of them to clean up
+     */
+    if (!g_atomic_int_get (&pipeline->cancelled) && pending->needs_conversion &&
+        direct) {
+        pending->devpath = device_reserve_track (track, "track.mp3",
+                                                 pending->journal,
+                                                 &pending->err);
+    }
+
+    if (!g_atomic_int_get (&pipeline->cancelled) && pending->needs_conversion &&
+        !pending->err) {
+        LOG_MESSAGE ("  converting %s to mp3\n", track->title);
+
+        since = stats_now ();
+
+        tags.title = track->title;
+        tags.artist = track->artist;
+        tags.album = track->album;
+        tags.genre = track->genre;
+        tags.track_nr = track->track_nr;
+
+        if (pending->devpath) {
+            convert_to_mp3_at (pending->filepath, pending->format,
+                               pending->devpath, &tags,
+                               measure ? &pending->loudness : NULL,
+                               &pending->err);
+        } else {
+            pending->mp3path = convert_to_mp3 (pending->filepath, pending->format,
+                                               &tags,
+                                               measure ? &pending->loudness : NULL,
+                                               &pending->err);
+        }
+
+        mp3path = pending->devpath ? pending->devpath : pending->mp3path;
+        if (!pending->err && g_stat (mp3path, &st) == 0) {
+            stats_record (STATS_CONVERT, since, st.st_size);
+        }
+
+        /* does nothing if err is NULL */
+        g_prefix_error (&pending->err, "conversion to mp3 failed. Reason: ");
+    }
+
+#ifdef NATIVE_CONVERSION
+    /* copied as it is, converted by the script or found in the cache */
+    if (measure && !g_atomic_int_get (&pipeline->cancelled) && !pending->err) {
+        if (pending->loudness == LOUDNESS_UNKNOWN) {
+            LOG_MESSAGE ("  measuring the loudness of %s\n", track->title);
+            native_measure_loudness (pending->filepath, pending->format,
+                                     &pending->loudness, NULL);
+        }
+
+        loudness_store (pending->filepath, pending->loudness);
+    }
+#endif
+
+    g_mutex_lock (&pipeline->lock);
+    pending->converted = TRUE;
+    g_cond_broadcast (&pipeline->cond);
+    g_mutex_unlock (&pipeline->lock);
+
+    return;
+}
+
+/**
+ * Internal, copy a converted pending track to the iPod.
+ * It is the caller's responsibility to write the database back to the device.
+ */
+static gboolean
+sync_track (pending_track_t *pending, guint64 *written, GError **err)
+{
+    Itdb_Track *track = pending->track;
+    const gchar *filepath;
+    gchar *filename;
+    gboolean ret;
+    GStatBuf st;
+    gint64 since;
+    gdouble elapsed;
+    guint64 copied;
+
+    if (pending->err) {
+        g_propagate_error (err, pending->err);
+        pending->err = NULL;
+        return FALSE;
+    }
+
+    LOG_MESSAGE ("Syncing track %s by %s\n", track->title, track->artist);
+
+#ifdef NATIVE_CONVERSION
+    if (pending->loudness != LOUDNESS_UNKNOWN) {
+        track->soundcheck = loudness_to_soundcheck (pending->loudness);
+    }
+#endif
+
+    if (pending->devpath) {
+        /* already converted onto the device, just record its size */
+        if (g_stat (pending->devpath, &st) != 0) {
+            SET_ERROR (err, "converted track vanished from the device");
+            return FALSE;
+        }
+
+        track->size = st.st_size;
+        track_index_add (device_index, track);
+        *written = st.st_size;
+    } else {
+        filepath = pending->mp3path ? pending->mp3path : pending->filepath;
+        g_assert (filepath);
+
+        /* the iPod goes by the extension, whatever the source is named */
+        filename = g_strconcat ("track.", pending->mp3path ? "mp3" :
+                                format_extension (pending->format), NULL);
+
+        since = stats_now ();
+        ret = device_copy_track (track, filepath, filename,
+                                 pending->journal, &copied, err);
+        g_free (filename);
+
+        if (!ret) {
+            return FALSE;
+        }
+
+        stats_record (STATS_COPY, since, copied);
+        elapsed = (stats_now () - since) / (gdouble) G_USEC_PER_SEC;
+
+        LOG_MESSAGE ("  copied %.1f MB at %.1f MB/s\n", copied / 1e6,
+                     elapsed > 0 ? copied / 1e6 / elapsed : 0.0);
+
+        *written = copied;
+    }
+
+    return TRUE;
+}
+
+/**
+ * Internal, run pending tracks through the sync pipeline.
+ * Up to transcode_workers tracks are converted in parallel, while a
+ * single writer copies them to the device in order.
+ * Upon error or cancellation of the job, the remaining conversions are
+ * cancelled, but no tracks are removed; that is left to the caller.
+ */
+static gboolean
+sync_tracks (GPtrArray *pending, sync_job_t *job, GError **err)
+{
+    guint i, next = 0, lookahead;
+    guint64 written;
+    gboolean ret = TRUE;
+    pending_track_t *p;
+    GThreadPool *pool;
+    pipeline_t pipeline = {{0}};
+
+    g_mutex_init (&pipeline.lock);
+    g_cond_init (&pipeline.cond);
+
+    pool = g_thread_pool_new (convert_worker, &pipeline,
+                              transcode_workers, FALSE, err);
+    if (!pool) {
+        ret = FALSE;
+        goto out;
+    }
+
+    lookahead = transcode_workers * PIPELINE_LOOKAHEAD;
+
+    for (i = 0; ret && i < pending->len; i++) {
+        /* keep the workers busy, but don't fill up the disk */
+        for (; next < pending->len && next - i < lookahead; next++) {
+            p = g_ptr_array_index (pending, next);
+            if (!p->converted) {
+                g_thread_pool_push (pool, p, NULL);
+            }
+        }
+
+        p = g_ptr_array_index (pending, i);
+
+        g_mutex_lock (&pipeline.lock);
+        while (!p->converted) {
+            g_cond_wait (&pipeline.cond, &pipeline.lock);
+        }
+        g_mutex_unlock (&pipeline.lock);
+
+        if (job_is_cancelled (job)) {
+            SET_ERROR (err, "cancelled");
+            ret = FALSE;
+            break;
+        }
+
+        if ((ret = sync_track (p, &written, err))) {
+            job_add_progress (job, 1, written);
+        }
+
+        /* the temporary mp3 is no longer needed */
+        free_pending_track (p);
+        g_ptr_array_index (pending, i) = NULL;
+    }
+
+    g_atomic_int_set (&pipeline.cancelled, TRUE);
+    g_thread_pool_free (pool, TRUE, TRUE);
+
+out:
+    g_mutex_clear (&pipeline.lock);
+    g_cond_clear (&pipeline.cond);
+
+    return ret;
+}
+
+/**
+ * Internal, parse a list of medialib ids.
+ * Returns the ids, or NULL upon error.
+ */
+static GArray *
+parse_ids (xmmsv_t *args, GError **err)
+{
+    gint32 id;
+    xmmsv_t *idv;
+    xmmsv_list_iter_t *it;
+    GArray *ids;
+
+    ids = g_array_new (FALSE, FALSE, sizeof (gint32));
+
+    xmmsv_get_list_iter (args, &it);
+    while (xmmsv_list_iter_valid (it)) {
+        xmmsv_list_iter_entry (it, &idv);
+
+        if (!xmmsv_get_int (idv, &id)) {
+            SET_ERROR (err, "can't parse track id");
+            break;
+        } else if (id <= 0) {
+            SET_ERROR (err, "invalid track id");
+            break;
+        }
+
+        g_array_append_val (ids, id);
+        xmmsv_list_iter_next (it);
+    }
+
+    if (xmmsv_list_iter_valid (it)) {
+        g_array_free (ids, TRUE);
+        ids = NULL;
+    }
+
+    return ids;
+}
+
+#ifdef VOICEOVER
+/**
+ * Internal, create voiceover tracks for a set of tracks, given as the keys
+ * of a hash table. A missing voiceover isn't fatal to the sync.
+ */
+static void
+make_track_voiceovers (GHashTable *tracks)
+{
+    guint failed;
+    GHashTableIter it;
+    gpointer track;
+    GPtrArray *list;
+
+    list = g_ptr_array_sized_new (g_hash_table_size (tracks));
+
+    g_hash_table_iter_init (&it, tracks);
+    while (g_hash_table_iter_next (&it, &track, NULL)) {
+        g_ptr_array_add (list, track);
+    }
+
+    LOG_MESSAGE ("Creating voiceover tracks for %u tracks\n", list->len);
+
+    if ((failed = make_voiceovers (list)) > 0) {
+        LOG_ERROR ("Failed to create %u voiceover tracks\n", failed);
+    }
+
+    g_ptr_array_free (list, TRUE);
+
+    return;
+}
+#endif
+
+/**
+ * Internal, fingerprint the source files of medialib ids, and those of
+ * the tracks in the iPod, so that copies of a recording under different
+ * paths are only synced once. Only done with the dedup option.
+ * The ids' properties are looked up in table, as built by
+ * table_from_properties. Tracks not synced by us have no known source
+ * file, so they can only be matched by their metadata.
+ */
+static void
+fingerprint_sources (GArray *ids, GHashTable *table)
+{
+    guint i;
+    GList *n;
+    GPtrArray *paths;
+    xmmsv_t *properties;
+    gchar *filepath;
+    const gchar *source, *fingerprint;
+
+    if (!dedup) {
+        return;
+    }
+
+    paths = g_ptr_array_new_with_free_func (g_free);
+
+    for (i = 0; i < ids->len; i++) {
+        properties = g_hash_table_lookup (table, GINT_TO_POINTER (
+                                              g_array_index (ids, gint32, i)));
+        if (properties &&
+            (filepath = filepath_from_medialib_info (properties, NULL))) {
+            g_ptr_array_add (paths, filepath);
+        }
+    }
+
+    for (n = itdb->tracks; n; n = g_list_next (n)) {
+        if ((source = track_index_get_source (n->data))) {
+            g_ptr_array_add (paths, g_strdup (source));
+        }
+    }
+
+    LOG_MESSAGE ("Fingerprinting %u source files\n", paths->len);
+
+    if (source_fingerprints) {
+        g_hash_table_destroy (source_fingerprints);
+    }
+
+    source_fingerprints = fingerprint_files (paths, transcode_workers);
+
+    for (n = itdb->tracks; n; n = g_list_next (n)) {
+        if ((source = track_index_get_source (n->data)) &&
+            (fingerprint = source_fingerprint (source))) {
+            track_index_set_fingerprint (device_index, n->data, fingerprint);
+        }
+    }
+
+    g_ptr_array_free (paths, TRUE);
+
+    return;
+}
+
+/**
+ * Internal, get the fingerprint of a source file, as computed by the
+ * last fingerprint_sources, or NULL if it's not known.
+ */
+static const gchar *
+source_fingerprint (const gchar *filepath)
+{
+    if (!source_fingerprints) {
+        return NULL;
+    }
+
+    return g_hash_table_lookup (source_fingerprints, filepath);
+}
+
+/**
+ * Internal, sync a chunk of medialib ids, ids[start] to ids[end - 1], to
+ * the iPod and write the database. rows is the plan table for all of the
+ * ids, see sync_ids.
+ * The tracks for the ids are added to wanted, and if remove_stale is set,
+ * tracks in the iPod that aren't in wanted are removed in the same write.
+ * Either all or none of the tracks in the chunk are copied.
+ */
+static gboolean
+sync_chunk (GArray *ids, guint start, guint end, GHashTable *table,
+            plan_table_t *rows, GHashTable *wanted, gboolean remove_stale,
+            sync_job_t *job, journal_t *journal, GError **err)
+{
+    pending_track_t *p;
+    Itdb_Track *t;
+    xmmsv_t *properties;
+    gint32 id;
+    guint i;
+    gboolean needs_conversion;
+    const gchar *fingerprint;
+    GError *tmp_err = NULL;
+    GList *n;
+    GHashTable *added, *stale;
+    GPtrArray *pending, *files;
+    gint64 since;
+#ifdef ARTWORK
+    const gchar *hash;
+#endif
+
+    pending = g_ptr_array_new ();
+    files = g_ptr_array_new_with_free_func (g_free);
+    added = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+    job_set_stage (job, "preparing");
+
+    if (journal) {
+        journal_begin (journal, &tmp_err);
+    }
+
+    for (i = start; !tmp_err && i < end; i++) {
+        id = g_array_index (ids, gint32, i);
+
+        if (journal && !remove_stale && journal_is_done (journal, id)) {
+            /* committed by an earlier run, but a mirror still needs
+             * to know its track is wanted
+             */
+            if ((t = row_in_device (rows, i, &needs_conversion, &fingerprint))) {
+                g_hash_table_insert (wanted, t, t);
+            }
+
+            job_add_progress (job, 1, 0);
+        } else if (!(properties = g_hash_table_lookup (table, GINT_TO_POINTER (id)))) {
+            SET_ERROR (&tmp_err, "failed to query track info");
+        } else if ((since = stats_now ()),
+                   (t = row_in_device (rows, i, &needs_conversion, &fingerprint))) {
+            /* no need to build a track for it */
+            LOG_MESSAGE ("Track %s by %s is already in the iPod, skipping\n",
+                         rows->titles[i], rows->artists[i]);
+
+#ifdef ARTWORK
+            /* synced before its artwork was, or without it */
+            if (artwork && !itdb_track_has_thumbnails (t) &&
+                xmmsv_dict_entry_get_string (properties, "picture_front", &hash)) {
+                artwork_set_thumbnails (artwork, t, hash);
+            }
+#endif
+
+            stats_record (STATS_IMPORT, since, 0);
+            g_hash_table_insert (wanted, t, t);
+            job_add_progress (job, 1, 0);
+        } else if (prepare_track (properties, rows, i, journal, &t, &p, &tmp_err)) {
+            stats_record (STATS_IMPORT, since, 0);
+            g_hash_table_insert (wanted, t, t);
+
+            if (p) {
+                g_ptr_array_add (pending, p);
+                g_hash_table_add (added, p->track);
+            } else {
+                job_add_progress (job, 1, 0);
+            }
+        }
+    }
+
+    if (!tmp_err) {
+        job_set_stage (job, "copying");
+        sync_tracks (pending, job, &tmp_err);
+    }
+
+#ifdef VOICEOVER
+    if (!tmp_err && voiceover && g_hash_table_size (added) > 0) {
+        job_set_stage (job, "voiceover");
+
+        since = stats_now ();
+        make_track_voiceovers (added);
+        stats_record_batch (STATS_VOICEOVER, since,
+                            g_hash_table_size (added), 0);
+    }
+#endif
+
+    /* tracks the pipeline didn't get to */
+    for (i = 0; i < pending->len; i++) {
+        if ((p = g_ptr_array_index (pending, i))) {
+            free_pending_track (p);
+        }
+    }
+
+    g_ptr_array_free (pending, TRUE);
+
+    if (!tmp_err && remove_stale) {
+        job_set_stage (job, "removing");
+        stale = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+        for (n = itdb->tracks; n; n = g_list_next (n)) {
+            if (!g_hash_table_contains (wanted, n->data)) {
+                g_hash_table_add (stale, n->data);
+            }
+        }
+
+        LOG_MESSAGE ("Removing %u tracks not in the collection\n",
+                     g_hash_table_size (stale));
+
+        remove_tracks (stale, files);
+        g_hash_table_destroy (stale);
+    }
+
+    if (!tmp_err) {
+        job_set_stage (job, "writing");
+        since = stats_now ();
+    }
+
+    if (!tmp_err && write_database (&tmp_err)) {
+        stats_record (STATS_WRITE, since, 0);
+        g_hash_table_destroy (added);
+
+        /* the stale tracks are out of the iPod's database now */
+        delete_files (files);
+        g_ptr_array_free (files, TRUE);
+
+        /* the chunk is safe even if recording it fails */
+        if (journal && !journal_commit (journal, &g_array_index (ids, gint32, start),
+                                        end - start, &tmp_err)) {
+            LOG_ERROR ("Failed to update the journal: %s\n", tmp_err->message);
+            g_clear_error (&tmp_err);
+        }
+
+        return TRUE;
+    }
+
+    /* Something went wrong -- remove all tracks we copied, but keep the
+     * files of the stale ones, which the iPod's database still references;
+     * it is reloaded before the next job to bring them back.
+     */
+    g_ptr_array_set_size (files, 0);
+    remove_tracks (added, files);
+    delete_files (files);
+    session_invalidate ();
+
+    g_ptr_array_free (files, TRUE);
+    g_hash_table_destroy (added);
+    g_propagate_error (err, tmp_err);
+
+    return FALSE;
+}
+
+/**
+ * Internal, build a plan table, see plan-table.h, for len medialib ids,
+ * whose properties are looked up in table, as built by
+ * table_from_properties.
+ */
+static plan_table_t *
+build_plan_table (const gint32 *ids, guint len, GHashTable *table)
+{
+    guint i;
+    gint32 track_nr, duration, size;
+    const gchar *title, *artist, *album;
+    gchar *filepath;
+    xmmsv_t *properties;
+    plan_table_t *rows;
+
+    rows = plan_table_new (len);
+
+    for (i = 0; i < len; i++) {
+        if (!(properties = g_hash_table_lookup (table, GINT_TO_POINTER (ids[i])))) {
+            plan_table_set_row (rows, i, ids[i], NULL, NULL, NULL, NULL, 0, 0, 0);
+            continue;
+        }
+
+        title = artist = album = NULL;
+        track_nr = duration = size = 0;
+
+        xmmsv_dict_entry_get_string (properties, "title", &title);
+        xmmsv_dict_entry_get_string (properties, "artist", &artist);
+        xmmsv_dict_entry_get_string (properties, "album", &album);
+        xmmsv_dict_entry_get_int (properties, "tracknr", &track_nr);
+        xmmsv_dict_entry_get_int (properties, "duration", &duration);
+        xmmsv_dict_entry_get_int (properties, "size", &size);
+
+        filepath = filepath_from_medialib_info (properties, NULL);
+
+        plan_table_set_row (rows, i, ids[i], filepath, title, artist, album,
+                            track_nr, duration, size);
+        g_free (filepath);
+    }
+
+    return rows;
+}
+
+/**
+ * Internal, find the track in the iPod for a row of a plan table, if it
+ * or another copy of its recording is there already. If not,
+ * needs_conversion tells whether it needs converting to mp3, and
+ * fingerprint is the fingerprint of its source file, if known, to tell
+ * copies of the recording apart in the same sync.
+ */
+static Itdb_Track *
+row_in_device (plan_table_t *rows, guint row, gboolean *needs_conversion,
+               const gchar **fingerprint)
+{
+    Itdb_Track *found;
+    audio_format_t format;
+    const gchar *filepath = rows->paths[row];
+
+    *needs_conversion = FALSE;
+    *fingerprint = NULL;
+
+    if (!filepath) {
+        return NULL;
+    }
+
+    *fingerprint = source_fingerprint (filepath);
+
+    if (!(found = track_index_lookup_source (device_index, filepath))) {
+        found = track_index_lookup_metadata (device_index, rows->artists[row],
+                                             rows->albums[row], rows->titles[row],
+                                             rows->track_nrs[row],
+                                             rows->durations[row],
+                                             rows->sizes[row]);
+    }
+
+    if (!found && *fingerprint) {
+        found = track_index_lookup_fingerprint (device_index, *fingerprint);
+    }
+
+    /* only probe the files that would be synced */
+    if (!found) {
+        *needs_conversion = must_convert (rows, row, &format);
+    }
+
+    return found;
+}
+
+/**
+ * Internal, get the space left in the iPod for tracks, keeping
+ * DEVICE_RESERVE free.
+ */
+static gboolean
+device_available (guint64 *available, GError **err)
+{
+    if (!planner_free_space (itdb_get_mountpoint (itdb), available, err)) {
+        return FALSE;
+    }
+
+    *available = *available > DEVICE_RESERVE ? *available - DEVICE_RESERVE : 0;
+    return TRUE;
+}
+
+/**
+ * Internal, check that the tracks for a list of medialib ids fit in the
+ * iPod, before copying anything.
+ * If they don't, and fill_property is set, the ids that don't fit are
+ * removed from the list, keeping the best ranked ones; otherwise it's an
+ * error. Space taken by tracks a mirror sync will remove isn't counted,
+ * as they're only removed after the copies.
+ * Copies of a recording already planned take no space of their own, and
+ * are left out along with the first copy. rows is the plan table for the
+ * ids, and is kept in step with them.
+ */
+static gboolean
+plan_ids (GArray *ids, GHashTable *table, plan_table_t *rows, GError **err)
+{
+    guint i, j;
+    gint32 id;
+    gpointer original;
+    guint64 needed, available;
+    gboolean ret = TRUE, needs_conversion;
+    const gchar *fingerprint;
+    xmmsv_t *properties;
+    planner_t *planner;
+    GHashTable *dropped, *first, *copies;
+
+    planner = planner_new (fill_property);
+    first = g_hash_table_new (g_str_hash, g_str_equal);
+    copies = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+    for (i = 0; i < ids->len; i++) {
+        id = rows->ids[i];
+        properties = g_hash_table_lookup (table, GINT_TO_POINTER (id));
+
+        if (!properties || row_in_device (rows, i, &needs_conversion, &fingerprint)) {
+            continue;
+        }
+
+        if (fingerprint && (original = g_hash_table_lookup (first, fingerprint))) {
+            g_hash_table_insert (copies, GINT_TO_POINTER (id), original);
+            continue;
+        }
+
+        if (fingerprint) {
+            g_hash_table_insert (first, (gpointer) fingerprint, GINT_TO_POINTER (id));
+        }
+
+        planner_add (planner, id, properties, needs_conversion);
+    }
+
+    /* the fingerprints are owned by source_fingerprints, not the rows */
+    g_hash_table_destroy (first);
+
+    if (!device_available (&available, err)) {
+        g_hash_table_destroy (copies);
+        planner_free (planner);
+        return FALSE;
+    }
+
+    needed = planner_get_bytes (planner);
+
+    LOG_MESSAGE ("About %.1f MB to copy, %.1f MB available\n",
+                 needed / 1e6, available / 1e6);
+
+    if (needed <= available) {
+        /* everything fits */
+    } else if (!fill_property) {
+        g_set_error (err, g_quark_from_static_string (__func__), 0,
+                     "not enough space in the iPod: about %.1f MB needed, "
+                     "%.1f MB available", needed / 1e6, available / 1e6);
+        ret = FALSE;
+    } else {
+        dropped = planner_fit (planner, available);
+
+        LOG_MESSAGE ("Leaving out %u tracks that don't fit\n",
+                     g_hash_table_size (dropped));
+
+        for (i = 0, j = 0; i < ids->len; i++) {
+            id = g_array_index (ids, gint32, i);
+            original = g_hash_table_lookup (copies, GINT_TO_POINTER (id));
+
+            if (!g_hash_table_contains (dropped, GINT_TO_POINTER (id)) &&
+                !(original && g_hash_table_contains (dropped, original))) {
+                plan_table_move_row (rows, j, i);
+                g_array_index (ids, gint32, j++) = id;
+            }
+        }
+
+        g_array_set_size (ids, j);
+        rows->len = j;
+        g_hash_table_destroy (dropped);
+    }
+
+    g_hash_table_destroy (copies);
+    planner_free (planner);
+
+    return ret;
+}
+
+/**
+ * Internal, estimate how long a sync would take from the throughput of
+ * past syncs, see stats_estimate. Converting and copying overlap, so only
+ * the slower of the two counts. Returns -1 if some stage involved has
+ * never been timed.
+ */
+static gdouble
+estimate_seconds (const sync_plan_t *plan)
+{
+    guint chunks, copies;
+    guint64 copy_bytes;
+    gdouble import, convert = 0, copy = 0, voice = 0, write;
+
+    chunks = chunk_size > 0 ? (plan->tracks + chunk_size - 1) / chunk_size : 1;
+    copies = direct ? plan->copy : plan->copy + plan->transcode;
+    copy_bytes = direct ? plan->bytes - plan->transcode_bytes : plan->bytes;
+
+    import = stats_estimate (STATS_IMPORT, plan->tracks, 0);
+    write = stats_estimate (STATS_WRITE, MAX (chunks, 1), 0);
+
+    if (plan->transcode > 0) {
+        convert = stats_estimate (STATS_CONVERT, plan->transcode,
+                                  plan->transcode_bytes) / transcode_workers;
+    }
+
+    if (copies > 0) {
+        copy = stats_estimate (STATS_COPY, copies, copy_bytes);
+    }
+
+    if (plan->voiceover > 0) {
+        voice = stats_estimate (STATS_VOICEOVER, plan->voiceover, 0);
+    }
+
+    if (import < 0 || convert < 0 || copy < 0 || voice < 0 || write < 0) {
+        return -1;
+    }
+
+    return import + MAX (convert, copy) + voice + write;
+}
+
+/**
+ * Internal, work out what syncing medialib ids would do, without
+ * touching the iPod: which tracks are there already, which would be
+ * copied or converted, how many bytes that takes and how long.
+ * Copies of a recording already planned count as duplicates.
+ * In mirror mode, also count the tracks that would be removed.
+ * The ids' properties are looked up in table, as for sync_ids.
+ */
+static gboolean
+plan_sync (GArray *ids, GHashTable *table, gboolean mirror,
+           sync_plan_t *plan, GError **err)
+{
+    guint i;
+    guint64 bytes;
+    gboolean needs_conversion;
+    const gchar *fingerprint;
+    xmmsv_t *properties;
+    Itdb_Track *track;
+    plan_table_t *rows;
+    GHashTable *wanted, *planned;
+    GList *n;
+
+    memset (plan, 0, sizeof (sync_plan_t));
+    wanted = g_hash_table_new (g_direct_hash, g_direct_equal);
+    planned = g_hash_table_new (g_str_hash, g_str_equal);
+
+    fingerprint_sources (ids, table);
+    rows = build_plan_table ((const gint32 *) ids->data, ids->len, table);
+
+    for (i = 0; i < ids->len; i++) {
+        properties = g_hash_table_lookup (table, GINT_TO_POINTER (rows->ids[i]));
+        if (!properties) {
+            SET_ERROR (err, "failed to query track info");
+            g_hash_table_destroy (wanted);
+            g_hash_table_destroy (planned);
+            plan_table_free (rows);
+            return FALSE;
+        }
+
+        plan->tracks++;
+
+        if ((track = row_in_device (rows, i, &needs_conversion, &fingerprint))) {
+            g_hash_table_add (wanted, track);
+            plan->present++;
+            continue;
+        }
+
+        if (fingerprint) {
+            if (g_hash_table_contains (planned, fingerprint)) {
+                plan->duplicate++;
+                continue;
+            }
+
+            g_hash_table_add (planned, (gpointer) fingerprint);
+        }
+
+        bytes = planner_estimate_bytes (properties, needs_conversion);
+        plan->bytes += bytes;
+
+        if (needs_conversion) {
+            plan->transcode++;
+            plan->transcode_bytes += bytes;
+        } else {
+            plan->copy++;
+        }
+
+#ifdef VOICEOVER
+        if (voiceover) {
+            plan->voiceover++;
+        }
+#endif
+    }
+
+    if (mirror) {
+        for (n = itdb->tracks; n; n = g_list_next (n)) {
+            if (!g_hash_table_contains (wanted, n->data)) {
+                plan->remove++;
+            }
+        }
+    }
+
+    g_hash_table_destroy (wanted);
+    g_hash_table_destroy (planned);
+    plan_table_free (rows);
+
+    if (!device_available (&plan->available, err)) {
+        return FALSE;
+    }
+
+    plan->fits = plan->bytes <= plan->available;
+    plan->seconds = estimate_seconds (plan);
+
+    return TRUE;
+}
+
+/**
+ * Internal, format a sync plan as a JSON object.
+ */
+static gchar *
+plan_to_json (const sync_plan_t *plan)
+{
+    GString *json;
+    gchar buf[G_ASCII_DTOSTR_BUF_SIZE];
+
+    json = g_string_new ("{");
+
+    g_string_append_printf (json, "\"tracks\": %u, \"present\": %u, "
+                            "\"copy\": %u, \"transcode\": %u, "
+                            "\"voiceover\": %u, \"duplicate\": %u, "
+                            "\"remove\": %u, ",
+                            plan->tracks, plan->present, plan->copy,
+                            plan->transcode, plan->voiceover,
+                            plan->duplicate, plan->remove);
+    g_string_append_printf (json, "\"bytes\": %" G_GUINT64_FORMAT ", "
+                            "\"available\": %" G_GUINT64_FORMAT ", "
+                            "\"fits\": %s, \"seconds\": %s}\n",
+                            plan->bytes, plan->available,
+                            plan->fits ? "true" : "false",
+                            plan->seconds < 0 ? "null" :
+                            g_ascii_formatd (buf, sizeof (buf), "%.1f",
+                                             plan->seconds));
+
+    return g_string_free (json, FALSE);
+}
+
+/**
+ * Internal, sync medialib ids to the iPod and write the database.
+ * The ids' properties are looked up in table, as built by
+ * table_from_properties, and rows is their plan table, as built by
+ * build_plan_table, shared by planning and every chunk. Progress is
+ * reported to job, if any.
+ * In mirror mode, tracks in the iPod that don't correspond to any of the
+ * ids are removed as well, along with the last chunk.
+ * Nothing is copied unless the tracks fit in the iPod, see plan_ids,
+ * which may also leave out some of the ids.
+ *
+ * If chunk_size is set, the ids are synced and committed in chunks of
+ * that many ids, and a journal in the iPod records the chunks committed.
+ * Should the sync fail, only the failed chunk is undone, and running the
+ * same sync again skips the ids already synced. Otherwise, either all or
+ * none of the tracks are copied.
+ */
+static gboolean
+sync_ids (GArray *ids, GHashTable *table, plan_table_t *rows,
+          gboolean mirror, sync_job_t *job, GError **err)
+{
+    guint start = 0, end;
+    gboolean ret = TRUE;
+    GHashTable *wanted;
+    journal_t *journal = NULL;
+
+    job_set_stage (job, "planning");
+
+    fingerprint_sources (ids, table);
+
+    /* keyed by the ids asked for, as --fill may leave a different set
+     * of them out once some are synced
+     */
+    if (chunk_size > 0) {
+        if (!(journal = journal_open (itdb, ids, mirror, err))) {
+            return FALSE;
+        }
+
+        if (journal_get_done (journal) > 0) {
+            LOG_MESSAGE ("Resuming sync, %u tracks already synced\n",
+                         journal_get_done (journal));
+        }
+    }
+
+    if (ids->len > 0 && !plan_ids (ids, table, rows, err)) {
+        if (journal) {
+            journal_close (journal, FALSE);
+        }
+
+        return FALSE;
+    }
+
+    wanted = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+    job_set_total (job, ids->len);
+
+    do {
+        end = chunk_size > 0 ? MIN (start + chunk_size, ids->len) : ids->len;
+        ret = sync_chunk (ids, start, end, table, rows, wanted,
+                          mirror && end == ids->len, job, journal, err);
+        start = end;
+    } while (ret && start < ids->len);
+
+    g_hash_table_destroy (wanted);
+
+    if (journal) {
+        journal_close (journal, ret);
+    }
+
+    return ret;
+}
+
+/**
+ * Internal, run a sync job from the job thread.
+ */
+static void
+run_job (sync_job_t *job)
+{
+    GArray *ids;
+    GError *err = NULL;
+    sync_plan_t plan;
+    plan_table_t *rows;
+
+    ids = job_get_ids (job);
+
+    LOG_MESSAGE ("Running job %u with %u tracks\n", job_get_id (job), ids->len);
+
+    if (!refresh_database (&err)) {
+        /* the iPod is gone, or its database unreadable */
+    } else if (job_is_dry_run (job)) {
+        job_set_stage (job, "planning");
+        if (plan_sync (ids, job_get_data (job), job_is_mirror (job), &plan, &err)) {
+            job_set_report (job, plan_to_json (&plan));
+        }
+    } else {
+        rows = build_plan_table ((const gint32 *) ids->data, ids->len,
+                                 job_get_data (job));
+        sync_ids (ids, job_get_data (job), rows, job_is_mirror (job), job, &err);
+        plan_table_free (rows);
+        stats_save_rates ();
+
+#ifdef NATIVE_CONVERSION
+        /* the service may run for long, so don't wait for it to exit */
+        if (soundcheck) {
+            loudness_save ();
+        }
+#endif
+    }
+
+    job_finish (job, err);
+
+    if (err) {
+        LOG_ERROR ("Job %u failed: %s\n", job_get_id (job), err->message);
+        g_error_free (err);
+    }
+
+    g_array_free (ids, TRUE);
+
+    return;
+}
+
+/**
+ * Sync medialib ids to the iPod.
+ * Exported for other clients, as "sync" and, with SYNC_MIRROR in udata, as
+ * "mirror", which also removes all tracks not given by the ids. With
+ * SYNC_DRY_RUN, exported as "plan", nothing is synced: the job works out
+ * what a sync would do, see plan_sync, and "status" reports it.
+ * The sync runs in the background; the id of the job is returned right
+ * away, to be used with "status" and "cancel".
+ * Each job is atomic: either all or none of its tracks are synced.
+ */
+static xmmsv_t *
+sync_method (xmmsv_t *args, xmmsv_t *kwargs, void *udata)
+{
+    GArray *ids;
+    GError *err = NULL;
+    sync_job_t *job;
+    fetch_context_t *ctx;
+    xmmsc_result_t *res;
+    gint flags = GPOINTER_TO_INT (udata);
+
+    if (!(ids = parse_ids (args, &err))) {
+        return xmmsv_error_from_GError ("Sync failed: %s", &err);
+    }
+
+    job = job_new (ids, flags & SYNC_MIRROR, flags & SYNC_DRY_RUN);
+
+    if (ids->len > 0) {
+        ctx = g_new (fetch_context_t, 1);
+        ctx->job = job;
+        ctx->since = stats_now ();
+
+        res = query_track_properties (ids);
+        xmmsc_result_notifier_set_full (res, job_properties_cb, ctx, g_free);
+        xmmsc_result_unref (res);
+    } else {
+        job_start (job, NULL, NULL);
+    }
+
+    return xmmsv_new_int (job_get_id (job));
+}
+
+/**
+ * Internal, parse the single job id argument of a service method.
+ */
+static gboolean
+parse_job_id (xmmsv_t *args, guint *id, GError **err)
+{
+    gint32 i;
+
+    if (!xmmsv_list_get_int (args, 0, &i) || i <= 0) {
+        SET_ERROR (err, "expected a job id");
+        return FALSE;
+    }
+
+    *id = i;
+    return TRUE;
+}
+
+/**
+ * Report the progress of a sync job.
+ * Exported for other clients as "status".
+ */
+static xmmsv_t *
+status_method (xmmsv_t *args, xmmsv_t *kwargs, void *udata)
+{
+    guint id;
+    GError *err = NULL;
+    job_status_t status;
+    xmmsv_t *ret;
+
+    if (!parse_job_id (args, &id, &err)) {
+        return xmmsv_error_from_GError ("Status failed: %s", &err);
+    }
+
+    if (!job_get_status (id, &status)) {
+        return xmmsv_new_error ("Status failed: no such job");
+    }
+
+    ret = xmmsv_build_dict (
+        XMMSV_DICT_ENTRY_INT ("id", status.id),
+        XMMSV_DICT_ENTRY_STR ("state", job_state_name (status.state)),
+        XMMSV_DICT_ENTRY_STR ("stage", status.stage),
+        XMMSV_DICT_ENTRY_INT ("tracks_total", status.tracks_total),
+        XMMSV_DICT_ENTRY_INT ("tracks_done", status.tracks_done),
+        XMMSV_DICT_ENTRY_INT ("written_kb", status.bytes_written / 1024),
+        XMMSV_DICT_END);
+
+    if (status.error) {
+        xmmsv_dict_set_string (ret, "error", status.error);
+        g_free (status.error);
+    }
+
+    if (status.report) {
+        xmmsv_dict_set_string (ret, "report", status.report);
+        g_free (status.report);
+    }
+
+    return ret;
+}
+
+/**
+ * Cancel a queued or running sync job. Tracks already copied by a running
+ * job are removed again, as if it had failed.
+ * Exported for other clients as "cancel".
+ */
+static xmmsv_t *
+cancel_method (xmmsv_t *args, xmmsv_t *kwargs, void *udata)
+{
+    guint id;
+    GError *err = NULL;
+
+    if (!parse_job_id (args, &id, &err)) {
+        return xmmsv_error_from_GError ("Cancel failed: %s", &err);
+    }
+
+    if (!job_cancel (id)) {
+        return xmmsv_new_error ("Cancel failed: no such job, or already finished");
+    }
+
+    return NULL;
+}
+
+/**
+ * Report the time spent in each stage of all syncs so far, as JSON.
+ * Exported for other clients as "stats".
+ */
+static xmmsv_t *
+stats_method (xmmsv_t *args, xmmsv_t *kwargs, void *udata)
+{
+    gchar *json;
+    xmmsv_t *ret;
+
+    json = stats_to_json ();
+    ret = xmmsv_new_string (json);
+    g_free (json);
+
+    return ret;
+}
+
+/**
+ * Internal, run a collection query, given as a string.
+ * Returns the resulting ids, or NULL upon error.
+ */
+static GArray *
+query_ids (const gchar *query, GError **err)
+{
+    xmmsv_t *idl;
+    xmmsc_result_t *res;
+    xmmsv_coll_t *coll;
+    const char *errstr;
+    GArray *ids = NULL;
+    gint64 since;
+
+    if (!xmmsv_coll_parse (query, &coll)) {
+        SET_ERROR (err, "can't parse the query");
+        return NULL;
+    }
+
+    since = stats_now ();
+
+    res = xmmsc_coll_query_ids (connection, coll, NULL, 0, 0);
+    xmmsc_result_wait (res);
+
+    stats_record (STATS_QUERY, since, 0);
+
+    idl = xmmsc_result_get_value (res);
+    if (xmmsv_get_error (idl, &errstr)) {
+        g_set_error (err, g_quark_from_static_string (__func__), 0,
+                     "failed to get collection: %s", errstr);
+    } else {
+        ids = parse_ids (idl, err);
+    }
+
+    xmmsv_coll_unref (coll);
+    xmmsc_result_unref (res);
+
+    return ids;
+}
+
+/**
+ * Internal, get the ids of a playlist, in order, or of a saved
+ * collection, in the namespace ns.
+ * Returns the ids, or NULL upon error.
+ */
+static GArray *
+fetch_collection_ids (const gchar *name, const gchar *ns, GError **err)
+{
+    xmmsv_t *val;
+    xmmsv_coll_t *coll;
+    xmmsc_result_t *res, *collres = NULL;
+    const char *errstr;
+    GArray *ids = NULL;
+
+    if (strcmp (ns, XMMS_COLLECTION_NS_PLAYLISTS) == 0) {
+        res = xmmsc_playlist_list_entries (connection, name);
+    } else {
+        collres = xmmsc_coll_get (connection, name, ns);
+        xmmsc_result_wait (collres);
+
+        val = xmmsc_result_get_value (collres);
+        if (xmmsv_get_error (val, &errstr) || !xmmsv_get_coll (val, &coll)) {
+            g_set_error (err, g_quark_from_static_string (__func__), 0,
+                         "failed to get collection %s", name);
+            xmmsc_result_unref (collres);
+            return NULL;
+        }
+
+        res = xmmsc_coll_query_ids (connection, coll, NULL, 0, 0);
+    }
+
+    xmmsc_result_wait (res);
+
+    val = xmmsc_result_get_value (res);
+    if (xmmsv_get_error (val, &errstr)) {
+        g_set_error (err, g_quark_from_static_string (__func__), 0,
+                     "failed to get the tracks of %s: %s", name, errstr);
+    } else {
+        ids = parse_ids (val, err);
+    }
+
+    xmmsc_result_unref (res);
+    if (collres) {
+        xmmsc_result_unref (collres);
+    }
+
+    return ids;
+}
+
+/**
+ * Internal, add the playlists or collections of a namespace in the
+ * medialib to sources, see fetch_playlists.
+ */
+static gboolean
+fetch_namespace (const gchar *ns, GPtrArray *sources, GError **err)
+{
+    gint i, j;
+    gboolean ret = TRUE, taken;
+    xmmsv_t *names;
+    xmmsc_result_t *res;
+    const char *name, *errstr;
+    GArray *ids;
+    playlist_source_t *source;
+
+    res = xmmsc_coll_list (connection, ns);
+    xmmsc_result_wait (res);
+
+    names = xmmsc_result_get_value (res);
+    if (xmmsv_get_error (names, &errstr)) {
+        g_set_error (err, g_quark_from_static_string (__func__), 0,
+                     "failed to list %s: %s", ns, errstr);
+        ret = FALSE;
+    }
+
+    for (i = 0; ret && i < xmmsv_list_get_size (names); i++) {
+        if (!xmmsv_list_get_string (names, i, &name) || name[0] == '_') {
+            continue;
+        }
+
+        for (j = 0, taken = FALSE; !taken && j < sources->len; j++) {
+            source = g_ptr_array_index (sources, j);
+            taken = strcmp (source->name, name) == 0;
+        }
+
+        if (taken) {
+            LOG_MESSAGE ("Skipping %s %s, a playlist has the same name\n", ns, name);
+        } else if ((ids = fetch_collection_ids (name, ns, err))) {
+            g_ptr_array_add (sources, playlist_source_new (name, ids));
+        } else {
+            ret = FALSE;
+        }
+    }
+
+    xmmsc_result_unref (res);
+
+    return ret;
+}
+
+/**
+ * Internal, get the playlists and saved collections in the medialib to
+ * mirror in the iPod. Hidden ones, whose names start with an underscore,
+ * are left out, and so are collections named like a playlist.
+ * The ids of their tracks not in ids yet are appended to it, so that the
+ * tracks shared by several playlists are only synced once.
+ * Returns the playlists, or NULL upon error.
+ */
+static GPtrArray *
+fetch_playlists (GArray *ids, GError **err)
+{
+    guint i, j;
+    gint32 id;
+    GHashTable *seen;
+    GPtrArray *sources;
+    playlist_source_t *source;
+
+    sources = g_ptr_array_new_with_free_func ((GDestroyNotify) playlist_source_free);
+
+    if (!fetch_namespace (XMMS_COLLECTION_NS_PLAYLISTS, sources, err) ||
+        !fetch_namespace (XMMS_COLLECTION_NS_COLLECTIONS, sources, err)) {
+        g_ptr_array_free (sources, TRUE);
+        return NULL;
+    }
+
+    seen = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+    for (i = 0; i < ids->len; i++) {
+        g_hash_table_add (seen, GINT_TO_POINTER (g_array_index (ids, gint32, i)));
+    }
+
+    for (i = 0; i < sources->len; i++) {
+        source = g_ptr_array_index (sources, i);
+
+        for (j = 0; j < source->ids->len; j++) {
+            id = g_array_index (source->ids, gint32, j);
+
+            if (!g_hash_table_contains (seen, GINT_TO_POINTER (id))) {
+                g_hash_table_add (seen, GINT_TO_POINTER (id));
+                g_array_append_val (ids, id);
+            }
+        }
+    }
+
+    g_hash_table_destroy (seen);
+
+    LOG_MESSAGE ("Found %u playlists\n", sources->len);
+
+    return sources;
+}
+
+/**
+ * Internal, mirror playlists in the iPod once their tracks are synced,
+ * see playlists_mirror, and write the database if they changed.
+ * The plan table of the ids synced, see sync_ids, maps the playlists' ids
+ * to the tracks in the iPod.
+ */
+static gboolean
+mirror_playlists (GPtrArray *sources, plan_table_t *rows, GError **err)
+{
+    guint i;
+    gint64 since;
+    gboolean ret, changed, needs_conversion;
+    const gchar *fingerprint;
+    Itdb_Track *track;
+    GHashTable *tracks;
+    playlist_source_t *source;
+
+    tracks = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+    for (i = 0; i < rows->len; i++) {
+        if ((track = row_in_device (rows, i, &needs_conversion, &fingerprint))) {
+            g_hash_table_insert (tracks, GINT_TO_POINTER (rows->ids[i]), track);
+        }
+    }
+
+    ret = playlists_mirror (itdb, sources, tracks, &changed, err);
+
+    for (i = 0; ret && i < sources->len; i++) {
+        source = g_ptr_array_index (sources, i);
+
+        if (source->foreign) {
+            LOG_MESSAGE ("Not mirroring playlist %s, the iPod has another "
+                         "playlist by that name\n", source->name);
+        }
+    }
+
+    if (ret && changed) {
+        LOG_MESSAGE ("Updating playlists\n");
+
+        since = stats_now ();
+        ret = write_database (err);
+        stats_record (STATS_WRITE, since, 0);
+    }
+
+    if (ret) {
+        ret = playlists_record (itdb, sources, err);
+    }
+
+    g_hash_table_destroy (tracks);
+
+    return ret;
+}
+
+/**
+ * Run a collection query, if any, and sync the resulting ids.
+ * With playlists set, the tracks of the medialib's playlists are synced
+ * along with them, and the playlists mirrored, see fetch_playlists.
+ * In mirror mode, all other tracks are removed from the iPod.
+ * On a dry run, the plan for the sync is printed as JSON instead.
+ */
+static bool
+run_query (const gchar *query, gboolean playlists, gboolean mirror,
+           gboolean dry_run)
+{
+    sync_plan_t plan;
+    gchar *json;
+    GArray *ids;
+    GPtrArray *sources = NULL;
+    GHashTable *table = NULL;
+    plan_table_t *rows;
+    GError *err = NULL;
+
+    if (query) {
+        ids = query_ids (query, &err);
+    } else {
+        ids = g_array_new (FALSE, FALSE, sizeof (gint32));
+    }
+
+    if (ids && playlists) {
+        sources = fetch_playlists (ids, &err);
+    }
+
+    if (ids && (!playlists || sources)) {
+        if (ids->len == 0 ||
+            (table = fetch_track_properties (ids, &err))) {
+            if (dry_run) {
+                if (plan_sync (ids, table, mirror, &plan, &err)) {
+                    json = plan_to_json (&plan);
+                    g_printf ("%s", json);
+                    g_free (json);
+                }
+            } else {
+                fetch_artwork (table);
+                rows = build_plan_table ((const gint32 *) ids->data, ids->len, table);
+
+                if (sync_ids (ids, table, rows, mirror, NULL, &err) && sources) {
+                    mirror_playlists (sources, rows, &err);
+                }
+
+                plan_table_free (rows);
+            }
+        }
+    }
+
+    if (ids) {
+        g_array_free (ids, TRUE);
+    }
+
+    if (sources) {
+        g_ptr_array_free (sources, TRUE);
+    }
+
+    if (table) {
+        g_hash_table_destroy (table);
+    }
+
+    if (err) {
+        LOG_ERROR ("Sync failed: %s\n", err->message);
+        g_error_free (err);
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Internal, update the metadata of a track in the iPod from its medialib
+ * properties. Returns whether anything changed.
+ */
+static gboolean
+update_track (Itdb_Track *track, xmmsv_t *properties)
+{
+    Itdb_Track *fresh;
+    gboolean changed = FALSE;
+
+    #define UPDATE_STRING_FIELD(name) \
+        if (g_strcmp0 (track->name, fresh->name) != 0) { \
+            g_free (track->name); \
+            track->name = fresh->name; \
+            fresh->name = NULL; \
+            changed = TRUE; \
+        }
+
+    fresh = itdb_track_new ();
+
+    if (import_track_properties (fresh, properties, NULL)) {
+        g_free (fresh->userdata);
+        fresh->userdata = NULL;
+
+        UPDATE_STRING_FIELD(title);
+        UPDATE_STRING_FIELD(album);
+        UPDATE_STRING_FIELD(artist);
+        UPDATE_STRING_FIELD(genre);
+
+        if (track->track_nr != fresh->track_nr) {
+            track->track_nr = fresh->track_nr;
+            changed = TRUE;
+        }
+    }
+
+    itdb_track_free (fresh);
+
+    if (changed) {
+        track_index_add (device_index, track);
+    }
+
+    #undef UPDATE_STRING_FIELD
+
+    return changed;
+}
+
+static void
+free_watch_batch (watch_batch_t *batch)
+{
+    g_array_free (batch->changed, TRUE);
+
+    if (batch->stale) {
+        g_ptr_array_free (batch->stale, TRUE);
+        g_array_free (batch->added, TRUE);
+        g_array_free (batch->updated, TRUE);
+    }
+
+    if (batch->table) {
+        g_hash_table_destroy (batch->table);
+    }
+
+    g_free (batch);
+
+    return;
+}
+
+/**
+ * Internal, apply a batch of medialib changes to the iPod from the job
+ * thread: remove the stale tracks, update the metadata of the changed
+ * ones and sync the new ones, writing the database once.
+ * Updated tracks that aren't in the iPod, say because an earlier batch
+ * failed, are synced as well.
+ */
+static void
+run_watch_job (sync_job_t *job)
+{
+    guint i;
+    gint32 id;
+    gint64 since;
+    guint writes;
+    gboolean changed;
+    gchar *filepath;
+    GArray *added;
+    GHashTable *stale;
+    GPtrArray *files;
+    GError *err = NULL;
+    xmmsv_t *properties;
+    Itdb_Track *track;
+    plan_table_t *rows;
+    watch_retry_t *retry = NULL;
+    watch_batch_t *batch = job_get_data (job);
+
+    if (!refresh_database (&err)) {
+        LOG_ERROR ("Watch: %s\n", err->message);
+        job_finish (job, err);
+        g_error_free (err);
+
+        retry = g_new0 (watch_retry_t, 1);
+        retry->ids = g_array_new (FALSE, FALSE, sizeof (gint32));
+        g_array_append_vals (retry->ids, batch->added->data, batch->added->len);
+        retry->stale = batch->stale;
+        batch->stale = g_ptr_array_new_with_free_func (g_free);
+
+        g_idle_add (watch_batch_done, retry);
+        return;
+    }
+
+    writes = database_writes;
+
+    job_set_stage (job, "removing");
+    stale = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+    for (i = 0; i < batch->stale->len; i++) {
+        if ((track = track_index_lookup_source (device_index,
+                                                g_ptr_array_index (batch->stale, i)))) {
+            g_hash_table_add (stale, track);
+        }
+    }
+
+    changed = g_hash_table_size (stale) > 0;
+    files = g_ptr_array_new_with_free_func (g_free);
+    remove_tracks (stale, files);
+    g_hash_table_destroy (stale);
+
+    job_set_stage (job, "updating");
+    added = g_array_new (FALSE, FALSE, sizeof (gint32));
+    g_array_append_vals (added, batch->added->data, batch->added->len);
+
+    for (i = 0; i < batch->updated->len; i++) {
+        id = g_array_index (batch->updated, gint32, i);
+        properties = g_hash_table_lookup (batch->table, GINT_TO_POINTER (id));
+        filepath = filepath_from_medialib_info (properties, NULL);
+
+        if (filepath && (track = track_index_lookup_source (device_index, filepath))) {
+            changed |= update_track (track, properties);
+        } else {
+            g_array_append_val (added, id);
+        }
 
-    xmmsv_get_list_iter (args, &it);
-    while (xmmsv_list_iter_valid (it)) {
-        xmmsv_list_iter_entry (it, &idv);
+        g_free (filepath);
+    }
 
-        if (!xmmsv_get_int (idv, &id)) {
-            SET_ERROR (&err, "can't parse track id");
-            break;
-        } else if (id <= 0) {
-            SET_ERROR (&err, "invalid track id");
-            break;
-        } else if (!(t = sync_track (id, &err))) {
-            break;
+    LOG_MESSAGE ("Watch: removing %u tracks, updating %u, adding %u\n",
+                 batch->stale->len, batch->updated->len - (added->len - batch->added->len),
+                 added->len);
+
+    /* syncing writes the database for all of the batch */
+    if (added->len > 0) {
+        rows = build_plan_table ((const gint32 *) added->data, added->len,
+                                 batch->table);
+
+        if (!sync_ids (added, batch->table, rows, FALSE, job, &err)) {
+            retry = g_new0 (watch_retry_t, 1);
+            retry->ids = g_array_new (FALSE, FALSE, sizeof (gint32));
+            g_array_append_vals (retry->ids, added->data, added->len);
         }
 
-        tracks = g_list_prepend (tracks, t);
-        xmmsv_list_iter_next (it);
+        plan_table_free (rows);
+
+#ifdef NATIVE_CONVERSION
+        if (soundcheck) {
+            loudness_save ();
+        }
+#endif
+    } else if (changed) {
+        job_set_stage (job, "writing");
+        since = stats_now ();
+
+        if (write_database (&err)) {
+            stats_record (STATS_WRITE, since, 0);
+        }
     }
 
-    if (!err && itdb_write (itdb, &err)) {
-        return NULL;
+    if (database_writes != writes) {
+        /* the stale tracks went out with the first write */
+        delete_files (files);
+    } else if (err) {
+        /* still in the iPod's database, so remove them with the next batch */
+        session_invalidate ();
+
+        if (!retry) {
+            retry = g_new0 (watch_retry_t, 1);
+        }
+
+        retry->stale = batch->stale;
+        batch->stale = g_ptr_array_new_with_free_func (g_free);
     }
 
-    /* Something went wrong -- remove all tracks we copied */
-    for (n = tracks; n; n = g_list_next (n)) {
-        remove_track ((Itdb_Track *) n->data);
+    g_ptr_array_free (files, TRUE);
+
+    job_finish (job, err);
+
+    if (err) {
+        LOG_ERROR ("Watch: failed to apply changes: %s\n", err->message);
+        g_error_free (err);
     }
 
-    return xmmsv_error_from_GError ("Sync failed: %s", &err);
+    g_array_free (added, TRUE);
+    g_idle_add (watch_batch_done, retry);
+
+    return;
 }
 
 /**
- * Run a collection query and sync the resulting ids.
+ * Called from the main loop once a batch was applied, with what failed,
+ * if anything, to be retried with the next batch.
  */
-static bool
-run_query (const gchar *query)
+static gboolean
+watch_batch_done (gpointer udata)
 {
-    xmmsv_t *idl, *err;
-    xmmsc_result_t *res;
-    xmmsv_coll_t *coll;
+    guint i;
+    watch_retry_t *retry = (watch_retry_t *) udata;
+
+    if (retry) {
+        for (i = 0; retry->ids && i < retry->ids->len; i++) {
+            g_hash_table_remove (watched, GINT_TO_POINTER (
+                                     g_array_index (retry->ids, gint32, i)));
+        }
+
+        for (i = 0; retry->stale && i < retry->stale->len; i++) {
+            g_ptr_array_add (watch_stale, g_strdup (g_ptr_array_index (retry->stale, i)));
+        }
+
+        if (retry->ids) {
+            g_array_free (retry->ids, TRUE);
+        }
+
+        if (retry->stale) {
+            g_ptr_array_free (retry->stale, TRUE);
+        }
+
+        g_free (retry);
+    }
+
+    watch_done (watcher);
+
+    return FALSE;
+}
+
+/**
+ * Internal, queue a batch for the job thread, unless there's nothing
+ * to do.
+ */
+static void
+submit_watch_batch (watch_batch_t *batch)
+{
+    sync_job_t *job;
+
+    if (batch->stale->len == 0 && batch->added->len == 0 &&
+        batch->updated->len == 0) {
+        free_watch_batch (batch);
+        watch_done (watcher);
+        return;
+    }
+
+    /* claims no ids, so no sync job is coalesced into it */
+    job = job_new (g_array_new (FALSE, FALSE, sizeof (gint32)), FALSE, FALSE);
+    job_start_with_runner (job, run_watch_job, batch,
+                           (GDestroyNotify) free_watch_batch);
+
+    return;
+}
+
+/**
+ * Called from the main loop with the properties of the ids to add or
+ * update in a batch. An id whose file moved is treated as a new one,
+ * replacing the track for its old path.
+ */
+static int
+watch_properties_cb (xmmsv_t *val, void *udata)
+{
+    guint i, j;
+    gint32 id;
+    gchar *filepath;
+    const gchar *old;
+    xmmsv_t *properties;
+    GError *err = NULL;
+    watch_batch_t *batch = (watch_batch_t *) udata;
+
+    if (!(batch->table = table_from_properties (val, &err))) {
+        LOG_ERROR ("Watch: failed to fetch track properties: %s\n", err->message);
+        g_error_free (err);
+        free_watch_batch (batch);
+        watch_done (watcher);
+        return FALSE;
+    }
+
+    for (i = 0, j = 0; i < batch->updated->len; i++) {
+        id = g_array_index (batch->updated, gint32, i);
+        properties = g_hash_table_lookup (batch->table, GINT_TO_POINTER (id));
+        filepath = properties ? filepath_from_medialib_info (properties, NULL) : NULL;
+        old = g_hash_table_lookup (watched, GINT_TO_POINTER (id));
+
+        if (filepath && g_strcmp0 (filepath, old) == 0) {
+            g_array_index (batch->updated, gint32, j++) = id;
+        } else {
+            g_ptr_array_add (batch->stale, g_strdup (old));
+            g_hash_table_remove (watched, GINT_TO_POINTER (id));
+            g_array_append_val (batch->added, id);
+        }
+
+        g_free (filepath);
+    }
+
+    g_array_set_size (batch->updated, j);
+
+    for (i = 0, j = 0; i < batch->added->len; i++) {
+        id = g_array_index (batch->added, gint32, i);
+        properties = g_hash_table_lookup (batch->table, GINT_TO_POINTER (id));
+
+        /* those without a path can't be synced */
+        if (properties && (filepath = filepath_from_medialib_info (properties, NULL))) {
+            g_hash_table_insert (watched, GINT_TO_POINTER (id), filepath);
+            g_array_index (batch->added, gint32, j++) = id;
+        }
+    }
+
+    g_array_set_size (batch->added, j);
+
+    fetch_artwork_async (batch->table, watch_artwork_ready, batch);
+
+    return FALSE;
+}
+
+/**
+ * Submits a batch once the artwork of its tracks is there.
+ */
+static void
+watch_artwork_ready (GHashTable *table, gpointer udata)
+{
+    submit_watch_batch ((watch_batch_t *) udata);
+
+    return;
+}
+
+/**
+ * Called from the main loop with the ids the watched query matches now.
+ * Works out which tracks of a batch to remove, add or update.
+ */
+static int
+watch_ids_cb (xmmsv_t *val, void *udata)
+{
+    guint i;
+    gint32 id;
     const char *errstr;
+    GArray *ids, *fetch;
+    GHashTable *current;
+    GHashTableIter iter;
+    gpointer key, filepath;
+    GError *err = NULL;
+    xmmsc_result_t *res;
+    watch_batch_t *batch = (watch_batch_t *) udata;
 
-    if (!xmmsv_coll_parse (query, &coll)) {
-        LOG_ERROR ("Failed to parse query.\n");
-        return false;
+    if (xmmsv_get_error (val, &errstr)) {
+        g_set_error (&err, g_quark_from_static_string (__func__), 0,
+                     "failed to get collection: %s", errstr);
     }
 
-    res = xmmsc_coll_query_ids (connection, coll, NULL, 0, 0);
-    xmmsc_result_wait (res);
+    if (err || !(ids = parse_ids (val, &err))) {
+        LOG_ERROR ("Watch: %s\n", err->message);
+        g_error_free (err);
+        free_watch_batch (batch);
+        watch_done (watcher);
+        return FALSE;
+    }
 
-    idl = xmmsc_result_get_value (res);
-    if (xmmsv_get_error (idl, &errstr)) {
-        LOG_ERROR ("Failed to get collection: %s\n", errstr);
-        return false;
-    } else if ((err = sync_method (idl, NULL, NULL))) {
-        xmmsv_get_error (err, &errstr);
-        LOG_ERROR ("%s\n", errstr);
-        return false;
+    batch->stale = g_ptr_array_new_with_free_func (g_free);
+    batch->added = g_array_new (FALSE, FALSE, sizeof (gint32));
+    batch->updated = g_array_new (FALSE, FALSE, sizeof (gint32));
+
+    current = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+    for (i = 0; i < ids->len; i++) {
+        id = g_array_index (ids, gint32, i);
+        g_hash_table_add (current, GINT_TO_POINTER (id));
+
+        if (!g_hash_table_contains (watched, GINT_TO_POINTER (id))) {
+            g_array_append_val (batch->added, id);
+        }
     }
 
-    xmmsv_coll_unref (coll);
+    /* left over by a failed batch */
+    for (i = 0; i < watch_stale->len; i++) {
+        g_ptr_array_add (batch->stale, g_strdup (g_ptr_array_index (watch_stale, i)));
+    }
+
+    g_ptr_array_set_size (watch_stale, 0);
+
+    g_hash_table_iter_init (&iter, watched);
+    while (g_hash_table_iter_next (&iter, &key, &filepath)) {
+        if (!g_hash_table_contains (current, key)) {
+            g_ptr_array_add (batch->stale, g_strdup (filepath));
+            g_hash_table_iter_remove (&iter);
+        }
+    }
+
+    for (i = 0; i < batch->changed->len; i++) {
+        id = g_array_index (batch->changed, gint32, i);
+
+        if (g_hash_table_contains (current, GINT_TO_POINTER (id)) &&
+            g_hash_table_contains (watched, GINT_TO_POINTER (id))) {
+            g_array_append_val (batch->updated, id);
+        }
+    }
+
+    g_hash_table_destroy (current);
+    g_array_free (ids, TRUE);
+
+    if (batch->added->len == 0 && batch->updated->len == 0) {
+        submit_watch_batch (batch);
+        return FALSE;
+    }
+
+    fetch = g_array_new (FALSE, FALSE, sizeof (gint32));
+    g_array_append_vals (fetch, batch->added->data, batch->added->len);
+    g_array_append_vals (fetch, batch->updated->data, batch->updated->len);
+
+    res = query_track_properties (fetch);
+    xmmsc_result_notifier_set (res, watch_properties_cb, batch);
     xmmsc_result_unref (res);
 
-    return true;
+    g_array_free (fetch, TRUE);
+
+    return FALSE;
+}
+
+/**
+ * Called by the watch with a batch of changed entries. Starts by
+ * running the watched query again, as the changes may have added tracks
+ * to it or taken them out.
+ */
+static void
+watch_flush (GArray *changed, gpointer udata)
+{
+    xmmsc_result_t *res;
+    watch_batch_t *batch;
+
+    batch = g_new0 (watch_batch_t, 1);
+    batch->changed = changed;
+
+    res = xmmsc_coll_query_ids (connection, watch_coll, NULL, 0, 0);
+    xmmsc_result_notifier_set (res, watch_ids_cb, batch);
+    xmmsc_result_unref (res);
+
+    return;
+}
+
+/**
+ * Broadcast handler for medialib entries added or changed.
+ */
+static int
+entry_changed_cb (xmmsv_t *val, void *udata)
+{
+    gint32 id;
+
+    if (xmmsv_get_int (val, &id)) {
+        watch_entry_changed (watcher, id);
+    }
+
+    return TRUE;
+}
+
+/**
+ * Broadcast handler for medialib entries removed and collections changed.
+ */
+static int
+refresh_cb (xmmsv_t *val, void *udata)
+{
+    watch_refresh (watcher);
+
+    return TRUE;
+}
+
+/**
+ * Internal, start watching the medialib for changes to the tracks of a
+ * query, to keep them up to date in the iPod. Changes are gathered into
+ * batches, see watch.h, each applied with a single database write.
+ * The tracks the query matches now are taken to be synced already.
+ */
+static gboolean
+setup_watch (const gchar *query, GError **err)
+{
+    guint i;
+    gint32 id;
+    gchar *filepath;
+    GArray *ids;
+    GHashTable *table = NULL;
+    xmmsv_t *properties;
+    xmmsc_result_t *res;
+
+    if (!xmmsv_coll_parse (query, &watch_coll)) {
+        SET_ERROR (err, "can't parse the query");
+        return FALSE;
+    }
+
+    if (!(ids = query_ids (query, err))) {
+        return FALSE;
+    }
+
+    if (ids->len > 0 && !(table = fetch_track_properties (ids, err))) {
+        g_array_free (ids, TRUE);
+        return FALSE;
+    }
+
+    watched = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, g_free);
+    watch_stale = g_ptr_array_new_with_free_func (g_free);
+
+    for (i = 0; i < ids->len; i++) {
+        id = g_array_index (ids, gint32, i);
+
+        if ((properties = g_hash_table_lookup (table, GINT_TO_POINTER (id))) &&
+            (filepath = filepath_from_medialib_info (properties, NULL))) {
+            g_hash_table_insert (watched, GINT_TO_POINTER (id), filepath);
+        }
+    }
+
+    g_array_free (ids, TRUE);
+    if (table) {
+        g_hash_table_destroy (table);
+    }
+
+    watcher = watch_new (watch_window, watch_flush, NULL);
+
+    res = xmmsc_broadcast_medialib_entry_added (connection);
+    xmmsc_result_notifier_set (res, entry_changed_cb, NULL);
+    xmmsc_result_unref (res);
+
+    res = xmmsc_broadcast_medialib_entry_changed (connection);
+    xmmsc_result_notifier_set (res, entry_changed_cb, NULL);
+    xmmsc_result_unref (res);
+
+    res = xmmsc_broadcast_medialib_entry_removed (connection);
+    xmmsc_result_notifier_set (res, refresh_cb, NULL);
+    xmmsc_result_unref (res);
+
+    res = xmmsc_broadcast_collection_changed (connection);
+    xmmsc_result_notifier_set (res, refresh_cb, NULL);
+    xmmsc_result_unref (res);
+
+    LOG_MESSAGE ("Watching %u tracks for changes\n", g_hash_table_size (watched));
+
+    return TRUE;
 }
 
 /**
@@ -405,6 +3090,8 @@ run_query (const gchar *query)
 static void
 setup_service ()
 {
+    jobs_init (run_job);
+
     xmmsc_sc_method_new_noargs (connection,
                                 NULL,
                                 sync_method,
@@ -414,6 +3101,51 @@ setup_service ()
                                 false,
                                 NULL);
 
+    xmmsc_sc_method_new_noargs (connection,
+                                NULL,
+                                sync_method,
+                                "mirror",
+                                "Make the tracks in the iPod match the given tracks",
+                                true,
+                                false,
+                                GINT_TO_POINTER (SYNC_MIRROR));
+
+    xmmsc_sc_method_new_noargs (connection,
+                                NULL,
+                                sync_method,
+                                "plan",
+                                "Estimate what syncing the given tracks would take, without syncing them",
+                                true,
+                                false,
+                                GINT_TO_POINTER (SYNC_DRY_RUN));
+
+    xmmsc_sc_method_new_noargs (connection,
+                                NULL,
+                                status_method,
+                                "status",
+                                "Report the progress of a sync job",
+                                true,
+                                false,
+                                NULL);
+
+    xmmsc_sc_method_new_noargs (connection,
+                                NULL,
+                                cancel_method,
+                                "cancel",
+                                "Cancel a sync job",
+                                true,
+                                false,
+                                NULL);
+
+    xmmsc_sc_method_new_noargs (connection,
+                                NULL,
+                                stats_method,
+                                "stats",
+                                "Report the time spent in each stage of the syncs, as JSON",
+                                true,
+                                false,
+                                NULL);
+
     xmmsc_sc_setup (connection);
     return;
 }
@@ -434,9 +3166,14 @@ int
 main(int argc, char **argv)
 {
     guint ret = 0;
+    gint cache_size = DEFAULT_CACHE_SIZE;
     GError *err = NULL;
-    gboolean service = false, clear = false;
-    gchar *mountpoint = g_strdup (DEFAULT_MOUNTPOINT), *query = NULL;
+    gboolean service = false, clear = false, mirror = false, stats = false;
+    gboolean dry_run = false, playlists = false, watch = false;
+    gchar *mountpoint = g_strdup (DEFAULT_MOUNTPOINT), *query = NULL, *json;
+#ifdef VOICEOVER
+    gboolean voiceover_helper = false;
+#endif
 
     GOptionContext *optc;
     GOptionEntry entries[] = {
@@ -444,6 +3181,25 @@ main(int argc, char **argv)
         {"service", 's', 0, G_OPTION_ARG_NONE, &service, "Run as a service.", NULL},
         {"verbose", 'v', 0, G_OPTION_ARG_NONE, &verbose, "Display more messages", NULL},
         {"clear", 0, 0, G_OPTION_ARG_NONE, &clear, "Remove all tracks in the iPod", NULL},
+        {"mirror", 0, 0, G_OPTION_ARG_NONE, &mirror, "Remove all tracks in the iPod that don't match the query", NULL},
+        {"cache-size", 0, 0, G_OPTION_ARG_INT, &cache_size, "Size limit in MB for the cache of converted tracks, 0 to disable. Default: " G_STRINGIFY (DEFAULT_CACHE_SIZE), "MB"},
+        {"direct", 0, 0, G_OPTION_ARG_NONE, &direct, "Convert tracks straight onto the iPod, bypassing temporary files and the cache", NULL},
+        {"jobs", 'j', 0, G_OPTION_ARG_INT, &transcode_workers, "Number of tracks to convert in parallel. Default: number of cores", "N"},
+#ifdef VOICEOVER
+        {VOICEOVER_HELPER_OPTION, 0, G_OPTION_FLAG_HIDDEN, G_OPTION_ARG_NONE, &voiceover_helper, NULL, NULL},
+#endif
+        {"stats", 0, 0, G_OPTION_ARG_NONE, &stats, "Print the time spent in each stage as JSON when done", NULL},
+        {"fill", 0, 0, G_OPTION_ARG_STRING, &fill_property, "If the tracks don't fit in the iPod, sync those that do, ranked by a medialib property, highest first, or lowest first if prefixed with '-'", "PROPERTY"},
+        {"dry-run", 'n', 0, G_OPTION_ARG_NONE, &dry_run, "Print what syncing the query would do and take, as JSON, without syncing", NULL},
+        {"playlists", 0, 0, G_OPTION_ARG_NONE, &playlists, "Sync the tracks of the medialib's playlists and saved collections, and mirror them as iPod playlists", NULL},
+        {"watch", 0, 0, G_OPTION_ARG_NONE, &watch, "With --service, keep the tracks of the query up to date in the iPod as the medialib changes", NULL},
+        {"watch-window", 0, 0, G_OPTION_ARG_INT, &watch_window, "Milliseconds to wait for further changes before applying them in watch mode. Default: " G_STRINGIFY (DEFAULT_WATCH_WINDOW), "MS"},
+#ifdef NATIVE_CONVERSION
+        {"soundcheck", 0, 0, G_OPTION_ARG_NONE, &soundcheck, "Measure the loudness of the tracks synced and set their Sound Check volume adjustment", NULL},
+#endif
+        {"mp3-only", 0, 0, G_OPTION_ARG_NONE, &mp3_only, "Convert every track that isn't mp3, even if the iPod plays its format", NULL},
+        {"dedup", 0, 0, G_OPTION_ARG_NONE, &dedup, "Sync only one copy of recordings found under several paths, telling them by the contents of their files", NULL},
+        {"chunk-size", 0, 0, G_OPTION_ARG_INT, &chunk_size, "Commit every N tracks and resume interrupted syncs from the last commit, instead of syncing all or nothing", "N"},
         {NULL}
     };
 
@@ -456,8 +3212,31 @@ main(int argc, char **argv)
         goto out;
     }
 
-    if (!(service || argc > 1 || clear)) {
-        LOG_ERROR ("Need either --service, --clear or a query string.\n");
+#ifdef VOICEOVER
+    if (voiceover_helper) {
+        ret = voiceover_helper_main ();
+        goto out;
+    }
+#endif
+
+    if (watch && !(service && argc > 1)) {
+        LOG_ERROR ("--watch needs --service and a query string.\n");
+        ret = 1;
+        goto out;
+    }
+
+    if (dry_run && clear) {
+        LOG_ERROR ("--dry-run can't be combined with --clear.\n");
+        ret = 1;
+        goto out;
+    }
+
+    if (transcode_workers <= 0) {
+        transcode_workers = g_get_num_processors ();
+    }
+
+    if (!(service || argc > 1 || clear || playlists)) {
+        LOG_ERROR ("Need either --service, --clear, --playlists or a query string.\n");
         ret = 1;
         goto out;
     }
@@ -468,15 +3247,39 @@ main(int argc, char **argv)
         goto out;
     }
 
-    itdb = itdb_parse (mountpoint, &err);
+    itdb = session_open (mountpoint, &err);
     if (!itdb) {
         LOG_ERROR ("Failed to parse iPod database: %s\n", err->message);
         ret = 1;
         goto out;
     }
 
+    device_index = track_index_new (itdb);
+    device_formats = mp3_only ? FORMAT_CAP (AUDIO_FORMAT_MP3)
+                              : format_device_caps (itdb->device);
+    stats_init ();
+
+    if (dedup) {
+        fingerprint_init ();
+    }
+
+#ifdef NATIVE_CONVERSION
+    if (soundcheck) {
+        loudness_init ();
+    }
+#endif
+
+    if (cache_size > 0 &&
+        !transcode_cache_init ((guint64) cache_size * 1024 * 1024)) {
+        LOG_ERROR ("Failed to set up the transcode cache, continuing without it.\n");
+    }
+
 #ifdef VOICEOVER
-    voiceover = voiceover_init (mountpoint);
+    voiceover = voiceover_init (mountpoint, argv[0], transcode_workers);
+#endif
+
+#ifdef ARTWORK
+    artwork = artwork_new (itdb->device);
 #endif
 
     if (clear && confirm ("Do you really wish to clear all tracks?")) {
@@ -487,15 +3290,31 @@ main(int argc, char **argv)
         }
     }
 
-    if (argc > 1) {
-        query = g_strjoinv (" ", argv + 1);
-        ret = !run_query (query);
-        g_free (query);
+    if (argc > 1 || playlists) {
+        query = argc > 1 ? g_strjoinv (" ", argv + 1) : NULL;
+        ret = !run_query (query, playlists, mirror, dry_run);
+
+        if (!dry_run) {
+            stats_save_rates ();
+        }
+    }
+
+    if (stats) {
+        json = stats_to_json ();
+        g_printf ("%s", json);
+        g_free (json);
     }
 
     if (service) {
         /* FIXME: leaks */
         mainloop = g_main_loop_new (NULL, FALSE);
+
+        if (watch && !setup_watch (query, &err)) {
+            LOG_ERROR ("Failed to watch the medialib: %s\n", err->message);
+            ret = 1;
+            goto out;
+        }
+
         xmmsc_mainloop_gmain_init (connection);
         setup_service ();
         g_main_loop_run (mainloop);
@@ -503,14 +3322,32 @@ main(int argc, char **argv)
 
 out:
     g_free (mountpoint);
+    g_free (query);
+    g_free (fill_property);
     if (err) { g_error_free (err); err = NULL; }
 
     if (optc) g_option_context_free (optc);
     if (connection) xmmsc_unref (connection);
+    if (device_index) track_index_free (device_index);
+    transcode_cache_deinit ();
+    stats_deinit ();
+    fingerprint_deinit ();
+#ifdef NATIVE_CONVERSION
+    loudness_deinit ();
+#endif
+    if (source_fingerprints) g_hash_table_destroy (source_fingerprints);
+    if (watcher) watch_free (watcher);
+    if (watched) g_hash_table_destroy (watched);
+    if (watch_stale) g_ptr_array_free (watch_stale, TRUE);
+    if (watch_coll) xmmsv_coll_unref (watch_coll);
     if (itdb) itdb_free (itdb);
+    session_close ();
 #ifdef VOICEOVER
     if (voiceover) voiceover_deinit ();
 #endif
+#ifdef ARTWORK
+    if (artwork) artwork_free (artwork);
+#endif
 
     return ret;
 }
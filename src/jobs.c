@@ -0,0 +1,430 @@
+/* Copyright 2012, Guilherme P. Gonçalves (guilherme.p.gonc@gmail.com)
+ *
+ * This file is part of ipod-syncer.
+ *
+ * ipod-syncer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ipod-syncer.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <glib.h>
+
+#include "jobs.h"
+
+/* How many finished jobs to remember for status queries */
+#define MAX_FINISHED_JOBS 64
+
+/* Sync jobs are run one at a time, in submission order, by a single
+ * thread, so the iTunesDB is never touched by two jobs at once.
+ *
+ * Ids that are already claimed by a queued or running sync job are
+ * coalesced into it when a new sync job is submitted: the new job only
+ * syncs them itself if the job that claimed them didn't succeed.
+ * Mirror jobs need their full id list, so they are never coalesced, and
+ * dry runs don't sync anything, so they never claim or coalesce ids.
+ * Instead, dry runs leave a report for status queries.
+ * Jobs may bring their own runner, to do other work on the iTunesDB in
+ * turn with the syncs.
+ */
+struct sync_job_St {
+    guint id;
+    gboolean mirror;
+    gboolean dry_run;
+    GArray *ids;
+    GHashTable *coalesced;
+
+    job_state_t state;
+    const gchar *stage;
+    guint tracks_total;
+    guint tracks_done;
+    guint64 bytes_written;
+    gchar *error;
+    gchar *report;
+    gint cancelled;
+
+    job_runner_t runner;
+    gpointer data;
+    GDestroyNotify destroy;
+};
+
+static GMutex lock;
+static GAsyncQueue *queue;
+static GHashTable *jobs;
+static GHashTable *claimed;
+static GQueue finished = G_QUEUE_INIT;
+static guint next_id = 1;
+static job_runner_t run_job;
+
+static gpointer job_thread (gpointer udata);
+static void free_job (sync_job_t *job);
+
+static gpointer
+job_thread (gpointer udata)
+{
+    sync_job_t *job;
+
+    while ((job = g_async_queue_pop (queue))) {
+        if (job_is_cancelled (job)) {
+            job_finish (job, NULL);
+            continue;
+        }
+
+        g_mutex_lock (&lock);
+        job->state = JOB_RUNNING;
+        g_mutex_unlock (&lock);
+
+        if (job->runner) {
+            job->runner (job);
+        } else {
+            run_job (job);
+        }
+    }
+
+    return NULL;
+}
+
+static void
+free_job (sync_job_t *job)
+{
+    if (job->data && job->destroy) {
+        job->destroy (job->data);
+    }
+
+    g_array_free (job->ids, TRUE);
+    g_hash_table_destroy (job->coalesced);
+    g_free (job->error);
+    g_free (job->report);
+    g_free (job);
+
+    return;
+}
+
+/**
+ * Start the job thread. Jobs are handed to runner, which must call
+ * job_finish when done.
+ */
+void
+jobs_init (job_runner_t runner)
+{
+    run_job = runner;
+
+    queue = g_async_queue_new ();
+    jobs = g_hash_table_new (g_direct_hash, g_direct_equal);
+    claimed = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+    g_thread_unref (g_thread_new ("sync", job_thread, NULL));
+
+    return;
+}
+
+/**
+ * Create a job for a list of medialib ids, taking ownership of the list.
+ * The job isn't run until job_start is called.
+ */
+sync_job_t *
+job_new (GArray *ids, gboolean mirror, gboolean dry_run)
+{
+    guint i;
+    gint32 id;
+    gpointer claimer;
+    sync_job_t *job;
+
+    job = g_new0 (sync_job_t, 1);
+    job->mirror = mirror;
+    job->dry_run = dry_run;
+    job->ids = ids;
+    job->coalesced = g_hash_table_new (g_direct_hash, g_direct_equal);
+    job->state = JOB_QUEUED;
+    job->stage = "fetching";
+
+    g_mutex_lock (&lock);
+
+    job->id = next_id++;
+    g_hash_table_insert (jobs, GUINT_TO_POINTER (job->id), job);
+
+    for (i = 0; !mirror && !dry_run && i < ids->len; i++) {
+        id = g_array_index (ids, gint32, i);
+
+        if ((claimer = g_hash_table_lookup (claimed, GINT_TO_POINTER (id)))) {
+            g_hash_table_insert (job->coalesced, GINT_TO_POINTER (id), claimer);
+        } else {
+            g_hash_table_insert (claimed, GINT_TO_POINTER (id),
+                                 GUINT_TO_POINTER (job->id));
+        }
+    }
+
+    g_mutex_unlock (&lock);
+
+    return job;
+}
+
+/**
+ * Queue a job, attaching data to it for the runner.
+ */
+void
+job_start (sync_job_t *job, gpointer data, GDestroyNotify destroy)
+{
+    job->data = data;
+    job->destroy = destroy;
+
+    g_mutex_lock (&lock);
+    job->stage = "queued";
+    g_mutex_unlock (&lock);
+
+    g_async_queue_push (queue, job);
+
+    return;
+}
+
+/**
+ * Queue a job to be run by runner instead of the one given to jobs_init.
+ */
+void
+job_start_with_runner (sync_job_t *job, job_runner_t runner,
+                       gpointer data, GDestroyNotify destroy)
+{
+    job->runner = runner;
+    job_start (job, data, destroy);
+
+    return;
+}
+
+guint
+job_get_id (sync_job_t *job)
+{
+    return job->id;
+}
+
+gboolean
+job_is_mirror (sync_job_t *job)
+{
+    return job->mirror;
+}
+
+gboolean
+job_is_dry_run (sync_job_t *job)
+{
+    return job->dry_run;
+}
+
+gpointer
+job_get_data (sync_job_t *job)
+{
+    return job->data;
+}
+
+/**
+ * Return the ids a job must sync itself, leaving out those coalesced
+ * into jobs that already synced them. The list must be free'd.
+ */
+GArray *
+job_get_ids (sync_job_t *job)
+{
+    guint i;
+    gint32 id;
+    gpointer claimer;
+    sync_job_t *other;
+    GArray *ids;
+
+    ids = g_array_sized_new (FALSE, FALSE, sizeof (gint32), job->ids->len);
+
+    g_mutex_lock (&lock);
+
+    for (i = 0; i < job->ids->len; i++) {
+        id = g_array_index (job->ids, gint32, i);
+        claimer = g_hash_table_lookup (job->coalesced, GINT_TO_POINTER (id));
+
+        if (claimer && (other = g_hash_table_lookup (jobs, claimer)) &&
+            other->state == JOB_DONE) {
+            continue;
+        }
+
+        g_array_append_val (ids, id);
+    }
+
+    g_mutex_unlock (&lock);
+
+    return ids;
+}
+
+void
+job_set_stage (sync_job_t *job, const gchar *stage)
+{
+    if (job) {
+        g_mutex_lock (&lock);
+        job->stage = stage;
+        g_mutex_unlock (&lock);
+    }
+
+    return;
+}
+
+void
+job_set_total (sync_job_t *job, guint total)
+{
+    if (job) {
+        g_mutex_lock (&lock);
+        job->tracks_total = total;
+        g_mutex_unlock (&lock);
+    }
+
+    return;
+}
+
+void
+job_add_progress (sync_job_t *job, guint tracks, guint64 bytes)
+{
+    if (job) {
+        g_mutex_lock (&lock);
+        job->tracks_done += tracks;
+        job->bytes_written += bytes;
+        g_mutex_unlock (&lock);
+    }
+
+    return;
+}
+
+/**
+ * Attach a report to a job, taking ownership of it.
+ */
+void
+job_set_report (sync_job_t *job, gchar *report)
+{
+    g_mutex_lock (&lock);
+    g_free (job->report);
+    job->report = report;
+    g_mutex_unlock (&lock);
+
+    return;
+}
+
+gboolean
+job_is_cancelled (sync_job_t *job)
+{
+    return job && g_atomic_int_get (&job->cancelled);
+}
+
+/**
+ * Mark a job as finished, successfully if err is NULL.
+ * Releases the job's data and its claim on its ids.
+ */
+void
+job_finish (sync_job_t *job, const GError *err)
+{
+    guint i;
+    gpointer id;
+    sync_job_t *old;
+
+    g_mutex_lock (&lock);
+
+    if (job_is_cancelled (job)) {
+        job->state = JOB_CANCELLED;
+    } else if (err) {
+        job->state = JOB_FAILED;
+        job->error = g_strdup (err->message);
+    } else {
+        job->state = JOB_DONE;
+    }
+
+    job->stage = "finished";
+
+    for (i = 0; i < job->ids->len; i++) {
+        id = GINT_TO_POINTER (g_array_index (job->ids, gint32, i));
+
+        if (g_hash_table_lookup (claimed, id) == GUINT_TO_POINTER (job->id)) {
+            g_hash_table_remove (claimed, id);
+        }
+    }
+
+    if (job->data && job->destroy) {
+        job->destroy (job->data);
+    }
+
+    job->data = NULL;
+
+    /* forget about the oldest jobs */
+    g_queue_push_tail (&finished, job);
+    while (g_queue_get_length (&finished) > MAX_FINISHED_JOBS) {
+        old = g_queue_pop_head (&finished);
+        g_hash_table_remove (jobs, GUINT_TO_POINTER (old->id));
+        free_job (old);
+    }
+
+    g_mutex_unlock (&lock);
+
+    return;
+}
+
+/**
+ * Request a job to be cancelled.
+ * Returns false if there is no such job, or if it already finished.
+ */
+gboolean
+job_cancel (guint id)
+{
+    sync_job_t *job;
+    gboolean ret = FALSE;
+
+    g_mutex_lock (&lock);
+
+    job = g_hash_table_lookup (jobs, GUINT_TO_POINTER (id));
+    if (job && (job->state == JOB_QUEUED || job->state == JOB_RUNNING)) {
+        g_atomic_int_set (&job->cancelled, TRUE);
+        ret = TRUE;
+    }
+
+    g_mutex_unlock (&lock);
+
+    return ret;
+}
+
+/**
+ * Take a snapshot of a job's progress.
+ * Returns false if there is no such job.
+ */
+gboolean
+job_get_status (guint id, job_status_t *status)
+{
+    sync_job_t *job;
+
+    g_mutex_lock (&lock);
+
+    if ((job = g_hash_table_lookup (jobs, GUINT_TO_POINTER (id)))) {
+        status->id = job->id;
+        status->state = job->state;
+        status->stage = job->stage;
+        status->tracks_total = job->tracks_total;
+        status->tracks_done = job->tracks_done;
+        status->bytes_written = job->bytes_written;
+        status->error = g_strdup (job->error);
+        status->report = g_strdup (job->report);
+    }
+
+    g_mutex_unlock (&lock);
+
+    return job != NULL;
+}
+
+const gchar *
+job_state_name (job_state_t state)
+{
+    switch (state) {
+        case JOB_QUEUED: return "queued";
+        case JOB_RUNNING: return "running";
+        case JOB_DONE: return "done";
+        case JOB_FAILED: return "failed";
+        case JOB_CANCELLED: return "cancelled";
+    }
+
+    return "unknown";
+}
@@ -0,0 +1,377 @@
+/* Copyright 2012, Guilherme P. Gonçalves (guilherme.p.gonc@gmail.com)
+ *
+ * This file is part of ipod-syncer.
+ *
+ * ipod-syncer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ipod-syncer.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gpod/itdb.h>
+
+#include "errors.h"
+#include "journal.h"
+
+#define JOURNAL_FILENAME "ipod-syncer.journal"
+#define JOURNAL_MAGIC "ipod-syncer journal 1"
+
+/* The journal is a small text file in the iPod's iTunes directory, only
+ * ever appended to, with one record per line:
+ *
+ *   key <hash>          the ids and mode of the sync it belongs to
+ *   begin <time>        a chunk started copying at time
+ *   file <path>         the chunk is about to create path in the iPod
+ *   done <id>           id was synced, if a commit follows
+ *   commit              the database was written with the chunk
+ *
+ * Each record is flushed to the device before going on, so after a crash
+ * the journal tells which ids need not be synced again, and exactly which
+ * files the last chunk left in the iPod, if it was interrupted.
+ */
+struct journal_St {
+    FILE *file;
+    gchar *path;
+    GHashTable *done;
+};
+
+static gchar *journal_key (GArray *ids, gboolean mirror);
+static gboolean journal_append (journal_t *journal, const gchar *record, GError **err);
+static GPtrArray *load (journal_t *journal, const gchar *key);
+static void remove_orphans (Itdb_iTunesDB *itdb, GPtrArray *files);
+static gboolean rewrite (journal_t *journal, const gchar *key, GError **err);
+
+/**
+ * Internal, hash the ids and mode of a sync, so a journal is only
+ * resumed by the same sync.
+ */
+static gchar *
+journal_key (GArray *ids, gboolean mirror)
+{
+    gchar *key;
+    GChecksum *checksum;
+
+    checksum = g_checksum_new (G_CHECKSUM_SHA1);
+    g_checksum_update (checksum, (const guchar *) ids->data,
+                       ids->len * sizeof (gint32));
+    g_checksum_update (checksum, (const guchar *) (mirror ? "m" : "s"), 1);
+
+    key = g_strdup (g_checksum_get_string (checksum));
+    g_checksum_free (checksum);
+
+    return key;
+}
+
+/**
+ * Internal, append a record to the journal and flush it to the device.
+ */
+static gboolean
+journal_append (journal_t *journal, const gchar *record, GError **err)
+{
+    if (fprintf (journal->file, "%s\n", record) < 0 ||
+        fflush (journal->file) != 0 ||
+        fsync (fileno (journal->file)) != 0) {
+
+        SET_ERRNO_ERROR (err, "can't write to the journal");
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/**
+ * Internal, read the committed ids from an existing journal, if it
+ * belongs to the sync given by key.
+ * If the last chunk of the journal was interrupted, the files it was
+ * creating in the iPod are returned, regardless of the key, otherwise
+ * NULL is returned.
+ */
+static GPtrArray *
+load (journal_t *journal, const gchar *key)
+{
+    guint i;
+    gchar *contents, **lines;
+    gboolean matches = FALSE;
+    GArray *uncommitted;
+    GPtrArray *files = NULL;
+    gint32 id;
+
+    if (!g_file_get_contents (journal->path, &contents, NULL, NULL)) {
+        return NULL;
+    }
+
+    lines = g_strsplit (contents, "\n", -1);
+    uncommitted = g_array_new (FALSE, FALSE, sizeof (gint32));
+
+    if (!lines[0] || strcmp (lines[0], JOURNAL_MAGIC) != 0) {
+        goto out;
+    }
+
+    for (i = 1; lines[i]; i++) {
+        if (g_str_has_prefix (lines[i], "key ")) {
+            matches = strcmp (lines[i] + 4, key) == 0;
+        } else if (g_str_has_prefix (lines[i], "begin ")) {
+            if (files) {
+                g_ptr_array_free (files, TRUE);
+            }
+
+            files = g_ptr_array_new_with_free_func (g_free);
+            g_array_set_size (uncommitted, 0);
+        } else if (g_str_has_prefix (lines[i], "file ") && files) {
+            g_ptr_array_add (files, g_strcompress (lines[i] + 5));
+        } else if (g_str_has_prefix (lines[i], "done ")) {
+            id = g_ascii_strtoll (lines[i] + 5, NULL, 10);
+            g_array_append_val (uncommitted, id);
+        } else if (strcmp (lines[i], "commit") == 0) {
+            if (files) {
+                g_ptr_array_free (files, TRUE);
+                files = NULL;
+            }
+
+            while (matches && uncommitted->len > 0) {
+                id = g_array_index (uncommitted, gint32, uncommitted->len - 1);
+                g_hash_table_add (journal->done, GINT_TO_POINTER (id));
+                g_array_set_size (uncommitted, uncommitted->len - 1);
+            }
+        }
+    }
+
+out:
+    g_array_free (uncommitted, TRUE);
+    g_strfreev (lines);
+    g_free (contents);
+
+    return files;
+}
+
+/**
+ * Internal, remove the files an interrupted chunk was creating in the
+ * iPod, unless a track in the database references them after all.
+ */
+static void
+remove_orphans (Itdb_iTunesDB *itdb, GPtrArray *files)
+{
+    guint i;
+    GList *n;
+    GHashTable *referenced;
+    gchar *path;
+
+    referenced = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+    for (n = itdb->tracks; n; n = g_list_next (n)) {
+        if ((path = itdb_filename_on_ipod ((Itdb_Track *) n->data))) {
+            g_hash_table_add (referenced, path);
+        }
+    }
+
+    for (i = 0; i < files->len; i++) {
+        path = g_ptr_array_index (files, i);
+
+        if (!g_hash_table_contains (referenced, path)) {
+            g_remove (path);
+        }
+    }
+
+    g_hash_table_destroy (referenced);
+
+    return;
+}
+
+/**
+ * Internal, start over with a compacted journal holding just the ids
+ * committed so far. It is written aside and renamed over the old one
+ * once it is on the device, so a crash meanwhile loses nothing.
+ */
+static gboolean
+rewrite (journal_t *journal, const gchar *key, GError **err)
+{
+    gint32 id;
+    gchar *tmppath;
+    GHashTableIter it;
+    gpointer idp;
+    gboolean ret = FALSE;
+
+    tmppath = g_strconcat (journal->path, ".tmp", NULL);
+
+    if (!(journal->file = fopen (tmppath, "w"))) {
+        SET_ERRNO_ERROR (err, "can't create the journal");
+        goto out;
+    }
+
+    fprintf (journal->file, "%s\nkey %s\n", JOURNAL_MAGIC, key);
+
+    g_hash_table_iter_init (&it, journal->done);
+    while (g_hash_table_iter_next (&it, &idp, NULL)) {
+        id = GPOINTER_TO_INT (idp);
+        fprintf (journal->file, "done %d\n", id);
+    }
+
+    if (!journal_append (journal, "commit", err)) {
+        g_remove (tmppath);
+        goto out;
+    }
+
+    if (g_rename (tmppath, journal->path) != 0) {
+        SET_ERRNO_ERROR (err, "can't replace the journal");
+        g_remove (tmppath);
+        goto out;
+    }
+
+    ret = TRUE;
+
+out:
+    g_free (tmppath);
+
+    return ret;
+}
+
+/**
+ * Open the journal for syncing ids to the iPod.
+ * If the journal was left behind by an earlier run of the same sync, the
+ * ids it committed are remembered, see journal_is_done. Files left behind
+ * by an interrupted chunk are removed, whichever sync it belonged to.
+ * Returns NULL upon error.
+ */
+journal_t *
+journal_open (Itdb_iTunesDB *itdb, GArray *ids, gboolean mirror, GError **err)
+{
+    gchar *key, *itunesdir;
+    GPtrArray *orphans;
+    journal_t *journal;
+
+    itunesdir = itdb_get_itunes_dir (itdb_get_mountpoint (itdb));
+    if (!itunesdir) {
+        g_set_error (err, g_quark_from_static_string (__func__), 0,
+                     "can't find the iPod's iTunes directory");
+        return NULL;
+    }
+
+    journal = g_new0 (journal_t, 1);
+    journal->path = g_build_filename (itunesdir, JOURNAL_FILENAME, NULL);
+    journal->done = g_hash_table_new (g_direct_hash, g_direct_equal);
+    g_free (itunesdir);
+
+    key = journal_key (ids, mirror);
+
+    if ((orphans = load (journal, key))) {
+        remove_orphans (itdb, orphans);
+        g_ptr_array_free (orphans, TRUE);
+    }
+
+    if (!rewrite (journal, key, err)) {
+        g_free (key);
+        journal_close (journal, FALSE);
+        return NULL;
+    }
+
+    g_free (key);
+
+    return journal;
+}
+
+/**
+ * Check whether an id was synced by an earlier run of the same sync.
+ */
+gboolean
+journal_is_done (journal_t *journal, gint32 id)
+{
+    return g_hash_table_contains (journal->done, GINT_TO_POINTER (id));
+}
+
+/**
+ * Get how many ids were synced by an earlier run of the same sync.
+ */
+guint
+journal_get_done (journal_t *journal)
+{
+    return g_hash_table_size (journal->done);
+}
+
+/**
+ * Record that a chunk is about to be copied to the iPod.
+ */
+gboolean
+journal_begin (journal_t *journal, GError **err)
+{
+    gboolean ret;
+    gchar *record;
+
+    record = g_strdup_printf ("begin %" G_GINT64_FORMAT,
+                              g_get_real_time () / G_USEC_PER_SEC);
+    ret = journal_append (journal, record, err);
+    g_free (record);
+
+    return ret;
+}
+
+/**
+ * Record that the current chunk is about to create path in the iPod,
+ * so it can be removed if the chunk is interrupted.
+ */
+gboolean
+journal_add_file (journal_t *journal, const gchar *path, GError **err)
+{
+    gboolean ret;
+    gchar *escaped, *record;
+
+    escaped = g_strescape (path, NULL);
+    record = g_strconcat ("file ", escaped, NULL);
+    ret = journal_append (journal, record, err);
+    g_free (record);
+    g_free (escaped);
+
+    return ret;
+}
+
+/**
+ * Record that the database was written with a chunk of n ids.
+ */
+gboolean
+journal_commit (journal_t *journal, const gint32 *ids, guint n, GError **err)
+{
+    guint i;
+
+    for (i = 0; i < n; i++) {
+        fprintf (journal->file, "done %d\n", ids[i]);
+        g_hash_table_add (journal->done, GINT_TO_POINTER (ids[i]));
+    }
+
+    return journal_append (journal, "commit", err);
+}
+
+/**
+ * Close the journal. If the sync finished, the journal is removed, as
+ * there is nothing left to resume.
+ */
+void
+journal_close (journal_t *journal, gboolean finished)
+{
+    if (journal->file) {
+        fclose (journal->file);
+    }
+
+    if (finished) {
+        g_remove (journal->path);
+    }
+
+    g_hash_table_destroy (journal->done);
+    g_free (journal->path);
+    g_free (journal);
+
+    return;
+}
@@ -0,0 +1,465 @@
+/* Copyright 2012, Guilherme P. Gonçalves (guilherme.p.gonc@gmail.com)
+ *
+ * This file is part of ipod-syncer.
+ *
+ * ipod-syncer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ipod-syncer.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <math.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "loudness.h"
+
+#define CACHE_FILENAME "loudness"
+
+/* Gating blocks are 400ms long and start every 100ms */
+#define BLOCK_STEPS 4
+#define STEPS_PER_SECOND 10
+
+/* Blocks quieter than this, in LUFS, are left out altogether */
+#define ABSOLUTE_GATE -70.0
+
+/* and those this many LU below the loudness of the rest too */
+#define RELATIVE_GATE 10.0
+
+/* Loudness that needs no adjustment, in LUFS, as used by ReplayGain 2 */
+#define REFERENCE_LOUDNESS -18.0
+
+/* Loudness is measured as in ITU-R BS.1770: the PCM is K-weighted, its
+ * mean square is taken over overlapping 400ms blocks, and the blocks
+ * that pass the absolute and relative gates are averaged. Decoders feed
+ * the meter as they go, so measuring doesn't take a pass of its own.
+ *
+ * Measurements are kept in the user's cache directory, keyed by path,
+ * and only taken again when the size or mtime of the file change.
+ */
+
+/* A biquad filter, and its state for each channel */
+typedef struct {
+    gdouble b[3];
+    gdouble a[3];
+    gdouble z[2][2];
+} biquad_t;
+
+struct loudness_meter_St {
+    gint channels;
+    gint step_frames;
+    biquad_t shelf;
+    biquad_t highpass;
+
+    /* mean squares of the current step and the last few */
+    gdouble energy;
+    gint frames;
+    gdouble steps[BLOCK_STEPS];
+    guint num_steps;
+
+    GArray *blocks;
+};
+
+typedef struct {
+    gdouble loudness;
+    goffset size;
+    gint64 mtime;
+} cache_entry_t;
+
+static GMutex lock;
+static GHashTable *cache;
+static gchar *cache_path;
+static gboolean dirty;
+
+static gdouble filter (biquad_t *filter, gint channel, gdouble x);
+static void end_step (loudness_meter_t *meter);
+static gdouble energy_to_loudness (gdouble energy);
+static gdouble gated_mean (GArray *blocks, gdouble gate);
+static void load_cache (void);
+static void save_cache (void);
+
+static gdouble
+filter (biquad_t *filter, gint channel, gdouble x)
+{
+    gdouble *z = filter->z[channel];
+    gdouble y;
+
+    /* transposed direct form II */
+    y = filter->b[0] * x + z[0];
+    z[0] = filter->b[1] * x - filter->a[1] * y + z[1];
+    z[1] = filter->b[2] * x - filter->a[2] * y;
+
+    return y;
+}
+
+/**
+ * Internal, close a 100ms step, and the block ending with it once there
+ * are enough steps for one.
+ */
+static void
+end_step (loudness_meter_t *meter)
+{
+    guint i;
+    gdouble block = 0;
+
+    meter->steps[meter->num_steps++ % BLOCK_STEPS] = meter->energy / meter->frames;
+    meter->energy = 0;
+    meter->frames = 0;
+
+    if (meter->num_steps < BLOCK_STEPS) {
+        return;
+    }
+
+    for (i = 0; i < BLOCK_STEPS; i++) {
+        block += meter->steps[i];
+    }
+
+    block /= BLOCK_STEPS;
+    g_array_append_val (meter->blocks, block);
+
+    return;
+}
+
+static gdouble
+energy_to_loudness (gdouble energy)
+{
+    return -0.691 + 10 * log10 (energy);
+}
+
+/**
+ * Internal, the mean energy of the blocks louder than gate, in LUFS,
+ * or 0 if there are none.
+ */
+static gdouble
+gated_mean (GArray *blocks, gdouble gate)
+{
+    guint i, count = 0;
+    gdouble block, sum = 0;
+
+    for (i = 0; i < blocks->len; i++) {
+        block = g_array_index (blocks, gdouble, i);
+
+        if (block > 0 && energy_to_loudness (block) > gate) {
+            sum += block;
+            count++;
+        }
+    }
+
+    return count ? sum / count : 0;
+}
+
+/**
+ * Create a meter for PCM with the given format.
+ * Only mono and stereo are supported, like everywhere else.
+ */
+loudness_meter_t *
+loudness_meter_new (gint channels, gint rate)
+{
+    loudness_meter_t *meter;
+    gdouble f0, gain, q, k, vh, vb, a0;
+
+    g_return_val_if_fail (channels == 1 || channels == 2, NULL);
+    g_return_val_if_fail (rate > 0, NULL);
+
+    meter = g_new0 (loudness_meter_t, 1);
+    meter->channels = channels;
+    meter->step_frames = MAX (rate / STEPS_PER_SECOND, 1);
+    meter->blocks = g_array_new (FALSE, FALSE, sizeof (gdouble));
+
+    /* the K-weighting filters of BS.1770, at the stream's sample rate:
+     * a high shelf modelling the head, and a high-pass filter
+     */
+    f0 = 1681.974450955533;
+    gain = 3.999843853973347;
+    q = 0.7071752369554196;
+
+    k = tan (G_PI * f0 / rate);
+    vh = pow (10.0, gain / 20.0);
+    vb = pow (vh, 0.4996667741545416);
+    a0 = 1.0 + k / q + k * k;
+
+    meter->shelf.b[0] = (vh + vb * k / q + k * k) / a0;
+    meter->shelf.b[1] = 2.0 * (k * k - vh) / a0;
+    meter->shelf.b[2] = (vh - vb * k / q + k * k) / a0;
+    meter->shelf.a[1] = 2.0 * (k * k - 1.0) / a0;
+    meter->shelf.a[2] = (1.0 - k / q + k * k) / a0;
+
+    f0 = 38.13547087602444;
+    q = 0.5003270373238773;
+
+    k = tan (G_PI * f0 / rate);
+    a0 = 1.0 + k / q + k * k;
+
+    meter->highpass.b[0] = 1.0;
+    meter->highpass.b[1] = -2.0;
+    meter->highpass.b[2] = 1.0;
+    meter->highpass.a[1] = 2.0 * (k * k - 1.0) / a0;
+    meter->highpass.a[2] = (1.0 - k / q + k * k) / a0;
+
+    return meter;
+}
+
+/**
+ * Feed interleaved 16 bit host-endian PCM to a meter.
+ */
+void
+loudness_meter_add (loudness_meter_t *meter, const gint16 *pcm, gint frames)
+{
+    gint i, ch;
+    gdouble x;
+
+    for (i = 0; i < frames; i++) {
+        for (ch = 0; ch < meter->channels; ch++) {
+            x = pcm[i * meter->channels + ch] / 32768.0;
+            x = filter (&meter->highpass, ch, filter (&meter->shelf, ch, x));
+
+            /* left and right both weigh 1 */
+            meter->energy += x * x;
+        }
+
+        if (++meter->frames == meter->step_frames) {
+            end_step (meter);
+        }
+    }
+
+    return;
+}
+
+/**
+ * Free a meter, returning the integrated loudness of everything fed to
+ * it, in LUFS, or LOUDNESS_UNKNOWN if it was too short or silent.
+ */
+gdouble
+loudness_meter_free (loudness_meter_t *meter)
+{
+    gdouble energy;
+
+    /* relative to the loudness of the blocks above the absolute gate */
+    energy = gated_mean (meter->blocks, ABSOLUTE_GATE);
+    if (energy > 0) {
+        energy = gated_mean (meter->blocks,
+                             energy_to_loudness (energy) - RELATIVE_GATE);
+    }
+
+    g_array_free (meter->blocks, TRUE);
+    g_free (meter);
+
+    return energy > 0 ? energy_to_loudness (energy) : LOUDNESS_UNKNOWN;
+}
+
+/**
+ * Get the soundcheck value for the iPod that brings a track of some
+ * loudness to the reference loudness.
+ */
+guint32
+loudness_to_soundcheck (gdouble loudness)
+{
+    gdouble gain, soundcheck;
+
+    if (loudness == LOUDNESS_UNKNOWN) {
+        return 0;
+    }
+
+    /* the same scale as iTunes, 1000 being no adjustment */
+    gain = REFERENCE_LOUDNESS - loudness;
+    soundcheck = 1000.0 * pow (10.0, -gain / 10.0);
+
+    return (guint32) CLAMP (soundcheck, 1.0, (gdouble) G_MAXUINT32);
+}
+
+/**
+ * Internal, read the measurements of earlier runs.
+ * Each line holds a loudness, the size and mtime of the file it was
+ * measured from, and its escaped path.
+ */
+static void
+load_cache (void)
+{
+    guint i;
+    gchar *contents, **lines, **fields;
+    cache_entry_t *entry;
+
+    if (!g_file_get_contents (cache_path, &contents, NULL, NULL)) {
+        return;
+    }
+
+    lines = g_strsplit (contents, "\n", -1);
+
+    for (i = 0; lines[i]; i++) {
+        fields = g_strsplit (lines[i], " ", 4);
+
+        if (g_strv_length (fields) == 4) {
+            entry = g_new0 (cache_entry_t, 1);
+            entry->loudness = g_ascii_strtod (fields[0], NULL);
+            entry->size = g_ascii_strtoll (fields[1], NULL, 10);
+            entry->mtime = g_ascii_strtoll (fields[2], NULL, 10);
+
+            g_hash_table_replace (cache, g_strcompress (fields[3]), entry);
+        }
+
+        g_strfreev (fields);
+    }
+
+    g_strfreev (lines);
+    g_free (contents);
+
+    return;
+}
+
+/**
+ * Internal, store the measurements for later runs, see load_cache.
+ */
+static void
+save_cache (void)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+    cache_entry_t *entry;
+    GString *data;
+    gchar *dir, *escaped;
+    gchar loudness[G_ASCII_DTOSTR_BUF_SIZE];
+
+    data = g_string_new (NULL);
+
+    g_hash_table_iter_init (&iter, cache);
+    while (g_hash_table_iter_next (&iter, &key, &value)) {
+        entry = (cache_entry_t *) value;
+        escaped = g_strescape ((const gchar *) key, NULL);
+
+        g_ascii_dtostr (loudness, sizeof (loudness), entry->loudness);
+        g_string_append_printf (data, "%s %" G_GINT64_FORMAT " %" G_GINT64_FORMAT " %s\n",
+                                loudness, (gint64) entry->size,
+                                entry->mtime, escaped);
+        g_free (escaped);
+    }
+
+    dir = g_path_get_dirname (cache_path);
+    g_mkdir_with_parents (dir, 0755);
+    g_free (dir);
+
+    g_file_set_contents (cache_path, data->str, data->len, NULL);
+    g_string_free (data, TRUE);
+
+    return;
+}
+
+/**
+ * Load the measurements taken by earlier runs.
+ */
+void
+loudness_init (void)
+{
+    cache = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+    cache_path = g_build_filename (g_get_user_cache_dir (), "ipod-syncer",
+                                   CACHE_FILENAME, NULL);
+    load_cache ();
+
+    return;
+}
+
+/**
+ * Store the measurements taken since the last save, if any, for later
+ * runs. Safe to call while measuring.
+ */
+void
+loudness_save (void)
+{
+    g_return_if_fail (cache);
+
+    g_mutex_lock (&lock);
+
+    if (dirty) {
+        save_cache ();
+        dirty = FALSE;
+    }
+
+    g_mutex_unlock (&lock);
+
+    return;
+}
+
+/**
+ * Store the measurements taken so far, and free them.
+ */
+void
+loudness_deinit (void)
+{
+    if (!cache) {
+        return;
+    }
+
+    loudness_save ();
+
+    g_hash_table_destroy (cache);
+    g_free (cache_path);
+    cache = NULL;
+
+    return;
+}
+
+/**
+ * Get the loudness measured for a file, if it hasn't changed since.
+ * Returns LOUDNESS_UNKNOWN otherwise.
+ * Safe to call from several threads at once.
+ */
+gdouble
+loudness_lookup (const gchar *filepath)
+{
+    GStatBuf st;
+    cache_entry_t *entry;
+    gdouble loudness = LOUDNESS_UNKNOWN;
+
+    g_return_val_if_fail (cache, LOUDNESS_UNKNOWN);
+
+    if (g_stat (filepath, &st) != 0) {
+        return LOUDNESS_UNKNOWN;
+    }
+
+    g_mutex_lock (&lock);
+
+    entry = g_hash_table_lookup (cache, filepath);
+    if (entry && entry->size == st.st_size && entry->mtime == st.st_mtime) {
+        loudness = entry->loudness;
+    }
+
+    g_mutex_unlock (&lock);
+
+    return loudness;
+}
+
+/**
+ * Remember the loudness measured for a file.
+ * Safe to call from several threads at once.
+ */
+void
+loudness_store (const gchar *filepath, gdouble loudness)
+{
+    GStatBuf st;
+    cache_entry_t *entry;
+
+    g_return_if_fail (cache);
+
+    if (loudness == LOUDNESS_UNKNOWN || g_stat (filepath, &st) != 0) {
+        return;
+    }
+
+    entry = g_new0 (cache_entry_t, 1);
+    entry->loudness = loudness;
+    entry->size = st.st_size;
+    entry->mtime = st.st_mtime;
+
+    g_mutex_lock (&lock);
+    g_hash_table_replace (cache, g_strdup (filepath), entry);
+    dirty = TRUE;
+    g_mutex_unlock (&lock);
+
+    return;
+}
@@ -0,0 +1,676 @@
+/* Copyright 2012, Guilherme P. Gonçalves (guilherme.p.gonc@gmail.com)
+ *
+ * This file is part of ipod-syncer.
+ *
+ * ipod-syncer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ipod-syncer.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <stdio.h>
+#include <string.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <FLAC/stream_decoder.h>
+#include <vorbis/vorbisfile.h>
+#include <lame/lame.h>
+#include <gpod/itdb.h>
+
+#include "format-probe.h"
+#include "conversion.h"
+#include "native-conversion.h"
+#include "loudness.h"
+
+/* PCM is decoded and encoded in chunks of at most this many frames */
+#define PCM_BUFFER_FRAMES 4096
+
+/* Worst case mp3 output for a chunk, as documented in lame.h */
+#define MP3_BUFFER_SIZE (PCM_BUFFER_FRAMES * 5 / 4 + 7200)
+
+/* mp3 input is read this many bytes at a time, and decoded a frame,
+ * of at most MP3_FRAME_SAMPLES samples per channel, at a time
+ */
+#define MP3_READ_SIZE 8192
+#define MP3_FRAME_SAMPLES 1152
+
+/* Size in bytes of a full chunk of a stream */
+#define CHUNK_BYTES(stream) (PCM_BUFFER_FRAMES * 2 * (stream)->channels)
+
+/* State of a conversion, shared by the decoders and the encoder.
+ * Decoders fill in pcm with interleaved 16 bit host-endian samples and
+ * hand it to stream_write. The encoder is set up lazily once the
+ * decoder knows the stream's format. If measure is set, the PCM is fed
+ * to a loudness meter on the way; streams without an output file are
+ * only measured, not encoded.
+ */
+typedef struct {
+    lame_t lame;
+    FILE *out;
+    const conversion_tags_t *tags;
+    gboolean measure;
+    loudness_meter_t *meter;
+    gint channels;
+    gint rate;
+    gint16 pcm[PCM_BUFFER_FRAMES * 2];
+    guchar mp3[MP3_BUFFER_SIZE];
+    GError *err;
+} pcm_stream_t;
+
+typedef gboolean (*decoder_t) (const gchar *filepath, pcm_stream_t *stream);
+
+static gboolean stream_start (pcm_stream_t *stream, gint channels, gint rate);
+static gboolean stream_write (pcm_stream_t *stream, gint frames);
+static gboolean stream_finish (pcm_stream_t *stream);
+static void set_tags (lame_t lame, const conversion_tags_t *tags);
+static FLAC__StreamDecoderWriteStatus flac_write_cb (const FLAC__StreamDecoder *decoder, const FLAC__Frame *frame, const FLAC__int32 * const buffer[], void *udata);
+static void flac_error_cb (const FLAC__StreamDecoder *decoder, FLAC__StreamDecoderErrorStatus status, void *udata);
+static gboolean decode_flac (const gchar *filepath, pcm_stream_t *stream);
+static gboolean decode_vorbis (const gchar *filepath, pcm_stream_t *stream);
+static gboolean decode_wav (const gchar *filepath, pcm_stream_t *stream);
+static gboolean decode_mp3 (const gchar *filepath, pcm_stream_t *stream);
+static decoder_t find_decoder (audio_format_t format);
+static gdouble stream_free (pcm_stream_t *stream);
+
+static const struct {
+    audio_format_t format;
+    decoder_t decode;
+} decoders[] = {
+    {AUDIO_FORMAT_FLAC, decode_flac},
+    {AUDIO_FORMAT_VORBIS, decode_vorbis},
+    {AUDIO_FORMAT_WAV, decode_wav},
+    {AUDIO_FORMAT_MP3, decode_mp3},
+    {AUDIO_FORMAT_UNKNOWN, NULL}
+};
+
+/**
+ * Set up the encoder for a stream's format.
+ */
+static gboolean
+stream_start (pcm_stream_t *stream, gint channels, gint rate)
+{
+    if (channels < 1 || channels > 2) {
+        g_set_error (&stream->err, g_quark_from_static_string (__func__), 0,
+                     "unsupported number of channels: %d", channels);
+        return FALSE;
+    }
+
+    stream->channels = channels;
+    stream->rate = rate;
+
+    if (stream->measure) {
+        stream->meter = loudness_meter_new (channels, rate);
+    }
+
+    if (!stream->out) {
+        return TRUE;
+    }
+
+    stream->lame = lame_init ();
+    lame_set_num_channels (stream->lame, channels);
+    lame_set_in_samplerate (stream->lame, rate);
+
+    /* same as ENCODER_OPTS */
+    lame_set_preset (stream->lame, STANDARD);
+
+    set_tags (stream->lame, stream->tags);
+
+    if (lame_init_params (stream->lame) < 0) {
+        g_set_error_literal (&stream->err, g_quark_from_static_string (__func__), 0,
+                             "can't set up the mp3 encoder");
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/**
+ * Encode frames from the stream's PCM buffer.
+ */
+static gboolean
+stream_write (pcm_stream_t *stream, gint frames)
+{
+    gint len;
+
+    if (stream->meter) {
+        loudness_meter_add (stream->meter, stream->pcm, frames);
+    }
+
+    if (!stream->out) {
+        return TRUE;
+    }
+
+    if (stream->channels == 2) {
+        len = lame_encode_buffer_interleaved (stream->lame, stream->pcm, frames,
+                                              stream->mp3, MP3_BUFFER_SIZE);
+    } else {
+        len = lame_encode_buffer (stream->lame, stream->pcm, stream->pcm, frames,
+                                  stream->mp3, MP3_BUFFER_SIZE);
+    }
+
+    if (len < 0) {
+        g_set_error (&stream->err, g_quark_from_static_string (__func__), len,
+                     "mp3 encoder failed with code %d", len);
+        return FALSE;
+    } else if (fwrite (stream->mp3, 1, len, stream->out) != (gsize) len) {
+        g_set_error_literal (&stream->err, g_quark_from_static_string (__func__), 0,
+                             "can't write mp3 file");
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/**
+ * Flush the encoder and write the VBR header.
+ */
+static gboolean
+stream_finish (pcm_stream_t *stream)
+{
+    gint len;
+
+    if (!stream->channels) {
+        g_set_error_literal (&stream->err, g_quark_from_static_string (__func__), 0,
+                             "no audio found");
+        return FALSE;
+    } else if (!stream->out) {
+        return TRUE;
+    }
+
+    len = lame_encode_flush (stream->lame, stream->mp3, MP3_BUFFER_SIZE);
+    if (len > 0) {
+        fwrite (stream->mp3, 1, len, stream->out);
+    }
+
+    lame_mp3_tags_fid (stream->lame, stream->out);
+
+    if (fflush (stream->out) != 0 || ferror (stream->out)) {
+        g_set_error_literal (&stream->err, g_quark_from_static_string (__func__), 0,
+                             "can't write mp3 file");
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/**
+ * Set the ID3 tags the encoder will write.
+ */
+static void
+set_tags (lame_t lame, const conversion_tags_t *tags)
+{
+    gchar *track;
+
+    id3tag_init (lame);
+    id3tag_add_v2 (lame);
+
+    if (!tags) {
+        return;
+    }
+
+    if (tags->title) id3tag_set_title (lame, tags->title);
+    if (tags->artist) id3tag_set_artist (lame, tags->artist);
+    if (tags->album) id3tag_set_album (lame, tags->album);
+    if (tags->genre) id3tag_set_genre (lame, tags->genre);
+
+    if (tags->track_nr > 0) {
+        track = g_strdup_printf ("%d", tags->track_nr);
+        id3tag_set_track (lame, track);
+        g_free (track);
+    }
+
+    return;
+}
+
+static FLAC__StreamDecoderWriteStatus
+flac_write_cb (const FLAC__StreamDecoder *decoder, const FLAC__Frame *frame,
+               const FLAC__int32 * const buffer[], void *udata)
+{
+    pcm_stream_t *stream = (pcm_stream_t *) udata;
+    guint i, ch, done, chunk;
+    guint channels = frame->header.channels;
+    guint bps = frame->header.bits_per_sample;
+    FLAC__int32 sample;
+
+    if (!stream->channels &&
+        !stream_start (stream, channels, frame->header.sample_rate)) {
+        return FLAC__STREAM_DECODER_WRITE_STATUS_ABORT;
+    }
+
+    if (channels != (guint) stream->channels ||
+        frame->header.sample_rate != (guint) stream->rate) {
+
+        g_set_error_literal (&stream->err, g_quark_from_static_string (__func__), 0,
+                             "stream format changes midway");
+        return FLAC__STREAM_DECODER_WRITE_STATUS_ABORT;
+    }
+
+    for (done = 0; done < frame->header.blocksize; done += chunk) {
+        chunk = MIN (frame->header.blocksize - done, PCM_BUFFER_FRAMES);
+
+        for (i = 0; i < chunk; i++) {
+            for (ch = 0; ch < channels; ch++) {
+                sample = buffer[ch][done + i];
+                stream->pcm[i * channels + ch] =
+                    bps > 16 ? sample >> (bps - 16) : sample << (16 - bps);
+            }
+        }
+
+        if (!stream_write (stream, chunk)) {
+            return FLAC__STREAM_DECODER_WRITE_STATUS_ABORT;
+        }
+    }
+
+    return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
+}
+
+static void
+flac_error_cb (const FLAC__StreamDecoder *decoder,
+               FLAC__StreamDecoderErrorStatus status, void *udata)
+{
+    pcm_stream_t *stream = (pcm_stream_t *) udata;
+
+    if (!stream->err) {
+        g_set_error (&stream->err, g_quark_from_static_string (__func__), status,
+                     "FLAC decoder error %d", status);
+    }
+
+    return;
+}
+
+static gboolean
+decode_flac (const gchar *filepath, pcm_stream_t *stream)
+{
+    gboolean ret;
+    FLAC__StreamDecoder *decoder;
+
+    decoder = FLAC__stream_decoder_new ();
+
+    if (FLAC__stream_decoder_init_file (decoder, filepath, flac_write_cb, NULL,
+                                        flac_error_cb, stream) !=
+        FLAC__STREAM_DECODER_INIT_STATUS_OK) {
+
+        g_set_error_literal (&stream->err, g_quark_from_static_string (__func__), 0,
+                             "can't open FLAC file");
+        FLAC__stream_decoder_delete (decoder);
+        return FALSE;
+    }
+
+    ret = FLAC__stream_decoder_process_until_end_of_stream (decoder);
+
+    FLAC__stream_decoder_finish (decoder);
+    FLAC__stream_decoder_delete (decoder);
+
+    if (!ret && !stream->err) {
+        g_set_error_literal (&stream->err, g_quark_from_static_string (__func__), 0,
+                             "FLAC decoding failed");
+    }
+
+    return !stream->err;
+}
+
+static gboolean
+decode_vorbis (const gchar *filepath, pcm_stream_t *stream)
+{
+    glong len;
+    gint section;
+    vorbis_info *info;
+    OggVorbis_File vf;
+
+    if (ov_fopen ((char *) filepath, &vf) != 0) {
+        g_set_error_literal (&stream->err, g_quark_from_static_string (__func__), 0,
+                             "can't open Ogg Vorbis file");
+        return FALSE;
+    }
+
+    info = ov_info (&vf, -1);
+    if (!stream_start (stream, info->channels, info->rate)) {
+        ov_clear (&vf);
+        return FALSE;
+    }
+
+    while ((len = ov_read (&vf, (char *) stream->pcm, CHUNK_BYTES (stream),
+                           G_BYTE_ORDER == G_BIG_ENDIAN, 2, 1, &section)) != 0) {
+        if (len == OV_HOLE) {
+            continue;
+        } else if (len < 0) {
+            g_set_error (&stream->err, g_quark_from_static_string (__func__), len,
+                         "Ogg Vorbis decoder error %ld", len);
+            break;
+        }
+
+        info = ov_info (&vf, section);
+        if (info->channels != stream->channels || info->rate != stream->rate) {
+            g_set_error_literal (&stream->err, g_quark_from_static_string (__func__), 0,
+                                 "stream format changes midway");
+            break;
+        }
+
+        if (!stream_write (stream, len / (2 * stream->channels))) {
+            break;
+        }
+    }
+
+    ov_clear (&vf);
+
+    return !stream->err;
+}
+
+/**
+ * Decode a 16 bit PCM RIFF/WAVE file.
+ */
+static gboolean
+decode_wav (const gchar *filepath, pcm_stream_t *stream)
+{
+    FILE *f;
+    guchar hdr[16];
+    guint32 size, remaining = 0;
+    guint16 format = 0, channels = 0, bits = 0;
+    guint32 rate = 0;
+    gsize i, len;
+    gboolean found_data = FALSE;
+
+    #define LE16(p) ((guint16) ((p)[0] | ((p)[1] << 8)))
+    #define LE32(p) ((guint32) ((p)[0] | ((p)[1] << 8) | ((p)[2] << 16) | ((guint32) (p)[3] << 24)))
+
+    if (!(f = g_fopen (filepath, "rb"))) {
+        g_set_error_literal (&stream->err, g_quark_from_static_string (__func__), 0,
+                             "can't open WAV file");
+        return FALSE;
+    }
+
+    if (fread (hdr, 1, 12, f) != 12 ||
+        memcmp (hdr, "RIFF", 4) || memcmp (hdr + 8, "WAVE", 4)) {
+        goto unsupported;
+    }
+
+    while (!found_data && fread (hdr, 1, 8, f) == 8) {
+        size = LE32 (hdr + 4);
+
+        if (!memcmp (hdr, "fmt ", 4) && size >= 16) {
+            if (fread (hdr, 1, 16, f) != 16) {
+                goto unsupported;
+            }
+
+            format = LE16 (hdr);
+            channels = LE16 (hdr + 2);
+            rate = LE32 (hdr + 4);
+            bits = LE16 (hdr + 14);
+
+            size -= 16;
+        } else if (!memcmp (hdr, "data", 4)) {
+            remaining = size;
+            found_data = TRUE;
+            break;
+        }
+
+        /* chunks are padded to an even size */
+        if (fseek (f, size + (size & 1), SEEK_CUR) != 0) {
+            goto unsupported;
+        }
+    }
+
+    /* anything but plain 16 bit PCM is left to the conversion script */
+    if (!found_data || format != 1 || bits != 16) {
+        goto unsupported;
+    }
+
+    if (!stream_start (stream, channels, rate)) {
+        fclose (f);
+        return FALSE;
+    }
+
+    while (remaining > 0) {
+        len = MIN (remaining, CHUNK_BYTES (stream));
+        len = fread (stream->pcm, 1, len, f);
+        if (len == 0) {
+            break;
+        }
+
+        for (i = 0; i < len / 2; i++) {
+            stream->pcm[i] = GINT16_FROM_LE (stream->pcm[i]);
+        }
+
+        remaining -= len;
+
+        if (!stream_write (stream, len / (2 * channels))) {
+            break;
+        }
+    }
+
+    fclose (f);
+
+    return !stream->err;
+
+unsupported:
+    g_set_error_literal (&stream->err, g_quark_from_static_string (__func__), 0,
+                         "unsupported WAV file");
+    fclose (f);
+
+    return FALSE;
+
+    #undef LE16
+    #undef LE32
+}
+
+/**
+ * Decode an mp3 file with lame's decoder. Only used to measure the
+ * loudness of mp3 files, which are never converted.
+ */
+static gboolean
+decode_mp3 (const gchar *filepath, pcm_stream_t *stream)
+{
+    FILE *f;
+    hip_t hip;
+    mp3data_struct info;
+    guchar buf[MP3_READ_SIZE];
+    gshort left[MP3_FRAME_SAMPLES], right[MP3_FRAME_SAMPLES];
+    gsize len;
+    gint i, frames = 0;
+
+    if (!(f = g_fopen (filepath, "rb"))) {
+        g_set_error_literal (&stream->err, g_quark_from_static_string (__func__), 0,
+                             "can't open mp3 file");
+        return FALSE;
+    }
+
+    /* skip the ID3v2 tag, the decoder doesn't know about it */
+    if (fread (buf, 1, 10, f) == 10 && memcmp (buf, "ID3", 3) == 0) {
+        len = 10 + ((buf[6] & 0x7f) << 21 | (buf[7] & 0x7f) << 14 |
+                    (buf[8] & 0x7f) << 7 | (buf[9] & 0x7f));
+        fseek (f, len + (buf[5] & 0x10 ? 10 : 0), SEEK_SET);
+    } else {
+        rewind (f);
+    }
+
+    hip = hip_decode_init ();
+    memset (&info, 0, sizeof (info));
+
+    while (frames >= 0 && !stream->err &&
+           (len = fread (buf, 1, sizeof (buf), f)) > 0) {
+
+        /* a frame at a time, until the decoder needs more input */
+        for (frames = hip_decode1_headers (hip, buf, len, left, right, &info);
+             frames > 0;
+             frames = hip_decode1_headers (hip, buf, 0, left, right, &info)) {
+
+            if (!stream->channels &&
+                !stream_start (stream, info.stereo, info.samplerate)) {
+                break;
+            }
+
+            if (info.stereo != stream->channels ||
+                info.samplerate != stream->rate) {
+                g_set_error_literal (&stream->err, g_quark_from_static_string (__func__), 0,
+                                     "stream format changes midway");
+                break;
+            }
+
+            for (i = 0; i < frames; i++) {
+                stream->pcm[i * stream->channels] = left[i];
+                if (stream->channels == 2) {
+                    stream->pcm[i * 2 + 1] = right[i];
+                }
+            }
+
+            if (!stream_write (stream, frames)) {
+                break;
+            }
+        }
+    }
+
+    if (frames < 0 && !stream->err) {
+        g_set_error_literal (&stream->err, g_quark_from_static_string (__func__), 0,
+                             "mp3 decoding failed");
+    }
+
+    hip_decode_exit (hip);
+    fclose (f);
+
+    return !stream->err;
+}
+
+/**
+ * Find the decoder for a format, as told by format_probe.
+ */
+static decoder_t
+find_decoder (audio_format_t format)
+{
+    guint i;
+
+    for (i = 0; decoders[i].decode; i++) {
+        if (decoders[i].format == format) {
+            return decoders[i].decode;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Check whether files of a format can be converted without the
+ * conversion script.
+ */
+gboolean
+native_can_convert (audio_format_t format)
+{
+    return find_decoder (format) != NULL;
+}
+
+/**
+ * Internal, free a stream, returning the loudness it measured, if any.
+ */
+static gdouble
+stream_free (pcm_stream_t *stream)
+{
+    gdouble loudness = LOUDNESS_UNKNOWN;
+
+    if (stream->lame) {
+        lame_close (stream->lame);
+    }
+
+    if (stream->meter) {
+        loudness = loudness_meter_free (stream->meter);
+    }
+
+    g_free (stream);
+
+    return loudness;
+}
+
+/**
+ * Convert a file of some format to mp3 in-process, streaming it through
+ * fixed-size buffers, and tag it with the given tags.
+ * If loudness isn't NULL, the loudness of the file is measured on the
+ * way and stored in it, see loudness.h.
+ * Safe to call from several threads at once.
+ */
+gboolean
+native_convert_to_mp3 (const gchar *filepath, audio_format_t format,
+                       const gchar *mp3path, const conversion_tags_t *tags,
+                       gdouble *loudness, GError **err)
+{
+    decoder_t decode;
+    pcm_stream_t *stream;
+    gboolean ret;
+
+    if (!(decode = find_decoder (format))) {
+        g_set_error_literal (err, g_quark_from_static_string (__func__), 0,
+                             "unsupported file format");
+        return FALSE;
+    }
+
+    stream = g_new0 (pcm_stream_t, 1);
+    stream->tags = tags;
+    stream->measure = loudness != NULL;
+
+    /* lame_mp3_tags_fid reads the file back to patch in the VBR header */
+    if (!(stream->out = g_fopen (mp3path, "w+b"))) {
+        g_set_error (err, g_quark_from_static_string (__func__), 0,
+                     "can't open %s for writing", mp3path);
+        g_free (stream);
+        return FALSE;
+    }
+
+    ret = decode (filepath, stream) && stream_finish (stream);
+
+    if (fclose (stream->out) != 0 && ret) {
+        g_set_error_literal (&stream->err, g_quark_from_static_string (__func__), 0,
+                             "can't write mp3 file");
+        ret = FALSE;
+    }
+
+    if (!ret) {
+        g_propagate_error (err, stream->err);
+        stream_free (stream);
+    } else if (loudness) {
+        *loudness = stream_free (stream);
+    } else {
+        stream_free (stream);
+    }
+
+    return ret;
+}
+
+/**
+ * Measure the loudness of a file of some format, see loudness.h, by
+ * decoding it without encoding anything. Used for files copied to the
+ * iPod as they are. Safe to call from several threads at once.
+ */
+gboolean
+native_measure_loudness (const gchar *filepath, audio_format_t format,
+                         gdouble *loudness, GError **err)
+{
+    decoder_t decode;
+    pcm_stream_t *stream;
+    gboolean ret;
+
+    if (!(decode = find_decoder (format))) {
+        g_set_error_literal (err, g_quark_from_static_string (__func__), 0,
+                             "unsupported file format");
+        return FALSE;
+    }
+
+    stream = g_new0 (pcm_stream_t, 1);
+    stream->measure = TRUE;
+
+    ret = decode (filepath, stream) && stream_finish (stream);
+
+    if (!ret) {
+        g_propagate_error (err, stream->err);
+        stream_free (stream);
+    } else {
+        *loudness = stream_free (stream);
+    }
+
+    return ret;
+}
@@ -0,0 +1,131 @@
+/* Copyright 2012, Guilherme P. Gonçalves (guilherme.p.gonc@gmail.com)
+ *
+ * This file is part of ipod-syncer.
+ *
+ * ipod-syncer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ipod-syncer.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <glib.h>
+#include <gpod/itdb.h>
+
+#include "format-probe.h"
+#include "plan-table.h"
+
+/* Big enough for the strings of a few hundred tracks */
+#define ARENA_SIZE (16 * 1024)
+
+/* Planning a sync only needs to find each track in the iPod, so rather
+ * than building a throwaway Itdb_Track per id, with strings of its own,
+ * a table holds the few properties that takes in arrays, a handful of
+ * allocations however many tracks there are. Itdb_Tracks are only built
+ * for the tracks that are actually copied. The table is a copy on top of
+ * the medialib properties, which are kept for the whole sync, so it saves
+ * allocations rather than lowering peak memory.
+ */
+
+/**
+ * Create a table of len rows, all empty.
+ */
+plan_table_t *
+plan_table_new (guint len)
+{
+    plan_table_t *rows;
+
+    rows = g_new0 (plan_table_t, 1);
+    rows->len = len;
+    rows->ids = g_new0 (gint32, len);
+    rows->paths = g_new0 (const gchar *, len);
+    rows->titles = g_new0 (const gchar *, len);
+    rows->artists = g_new0 (const gchar *, len);
+    rows->albums = g_new0 (const gchar *, len);
+    rows->track_nrs = g_new0 (gint32, len);
+    rows->durations = g_new0 (gint32, len);
+    rows->sizes = g_new0 (gint32, len);
+    rows->formats = g_new0 (audio_format_t, len);
+    rows->probed = g_new0 (guint8, len);
+    rows->strings = g_string_chunk_new (ARENA_SIZE);
+
+    return rows;
+}
+
+void
+plan_table_free (plan_table_t *rows)
+{
+    g_free (rows->ids);
+    g_free (rows->paths);
+    g_free (rows->titles);
+    g_free (rows->artists);
+    g_free (rows->albums);
+    g_free (rows->track_nrs);
+    g_free (rows->durations);
+    g_free (rows->sizes);
+    g_free (rows->formats);
+    g_free (rows->probed);
+    g_string_chunk_free (rows->strings);
+    g_free (rows);
+
+    return;
+}
+
+/**
+ * Fill in a row of the table, copying the strings into it.
+ * Any of them may be NULL.
+ */
+void
+plan_table_set_row (plan_table_t *rows, guint row, gint32 id,
+                    const gchar *path, const gchar *title,
+                    const gchar *artist, const gchar *album,
+                    gint32 track_nr, gint32 duration, gint32 size)
+{
+    g_return_if_fail (row < rows->len);
+
+    rows->ids[row] = id;
+
+    /* paths are unique, so there's no point in looking them up */
+    rows->paths[row] = path ? g_string_chunk_insert (rows->strings, path) : NULL;
+
+    rows->titles[row] = title ? g_string_chunk_insert_const (rows->strings, title) : NULL;
+    rows->artists[row] = artist ? g_string_chunk_insert_const (rows->strings, artist) : NULL;
+    rows->albums[row] = album ? g_string_chunk_insert_const (rows->strings, album) : NULL;
+
+    rows->track_nrs[row] = track_nr;
+    rows->durations[row] = duration;
+    rows->sizes[row] = size;
+    rows->probed[row] = FALSE;
+
+    return;
+}
+
+/**
+ * Copy row from over row to, as when leaving rows out of the table.
+ * The strings are shared, not copied.
+ */
+void
+plan_table_move_row (plan_table_t *rows, guint to, guint from)
+{
+    g_return_if_fail (to < rows->len && from < rows->len);
+
+    rows->ids[to] = rows->ids[from];
+    rows->paths[to] = rows->paths[from];
+    rows->titles[to] = rows->titles[from];
+    rows->artists[to] = rows->artists[from];
+    rows->albums[to] = rows->albums[from];
+    rows->track_nrs[to] = rows->track_nrs[from];
+    rows->durations[to] = rows->durations[from];
+    rows->sizes[to] = rows->sizes[from];
+    rows->formats[to] = rows->formats[from];
+    rows->probed[to] = rows->probed[from];
+
+    return;
+}
@@ -0,0 +1,248 @@
+/* Copyright 2012, Guilherme P. Gonçalves (guilherme.p.gonc@gmail.com)
+ *
+ * This file is part of ipod-syncer.
+ *
+ * ipod-syncer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ipod-syncer.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <errno.h>
+#include <sys/statvfs.h>
+#include <glib.h>
+#include <xmmsclient/xmmsclient.h>
+#include <gpod/itdb.h>
+
+#include "errors.h"
+#include "format-probe.h"
+#include "conversion.h"
+#include "planner.h"
+
+/* The planner collects the tracks a sync is about to copy, along with
+ * how many bytes each is expected to take in the iPod, and decides
+ * which of them fit in the space available.
+ *
+ * When not everything fits, tracks are ranked by a medialib property,
+ * highest first, or lowest first if the property's name is prefixed
+ * with a '-'. Tracks missing the property rank last, and ties keep
+ * the order they were added in.
+ */
+typedef struct {
+    gint32 id;
+    guint index;
+    guint64 bytes;
+    gboolean has_rank;
+    gint32 rank_int;
+    gchar *rank_str;
+} plan_entry_t;
+
+struct planner_St {
+    gchar *rank_property;
+    gboolean ascending;
+    GArray *entries;
+    guint64 bytes;
+};
+
+static gint compare_ranks (const plan_entry_t *a, const plan_entry_t *b, gboolean ascending);
+static gint compare_entries (gconstpointer a, gconstpointer b, gpointer udata);
+
+/**
+ * Internal, compare the ranks of two entries, highest first.
+ */
+static gint
+compare_ranks (const plan_entry_t *a, const plan_entry_t *b, gboolean ascending)
+{
+    gint ret;
+
+    if (!a->has_rank || !b->has_rank) {
+        return b->has_rank - a->has_rank;
+    }
+
+    if (a->rank_str || b->rank_str) {
+        ret = g_strcmp0 (b->rank_str, a->rank_str);
+    } else {
+        ret = (b->rank_int > a->rank_int) - (b->rank_int < a->rank_int);
+    }
+
+    return ascending ? -ret : ret;
+}
+
+static gint
+compare_entries (gconstpointer a, gconstpointer b, gpointer udata)
+{
+    const plan_entry_t *ea = a, *eb = b;
+    planner_t *planner = (planner_t *) udata;
+    gint ret;
+
+    if ((ret = compare_ranks (ea, eb, planner->ascending)) == 0) {
+        ret = (ea->index > eb->index) - (ea->index < eb->index);
+    }
+
+    return ret;
+}
+
+/**
+ * Create a planner, ranking tracks by rank_property, which may be NULL if
+ * tracks won't need ranking.
+ */
+planner_t *
+planner_new (const gchar *rank_property)
+{
+    planner_t *planner;
+
+    planner = g_new0 (planner_t, 1);
+    planner->entries = g_array_new (FALSE, FALSE, sizeof (plan_entry_t));
+
+    if (rank_property) {
+        planner->ascending = rank_property[0] == '-';
+        planner->rank_property = g_strdup (rank_property + planner->ascending);
+    }
+
+    return planner;
+}
+
+void
+planner_free (planner_t *planner)
+{
+    guint i;
+
+    for (i = 0; i < planner->entries->len; i++) {
+        g_free (g_array_index (planner->entries, plan_entry_t, i).rank_str);
+    }
+
+    g_array_free (planner->entries, TRUE);
+    g_free (planner->rank_property);
+    g_free (planner);
+
+    return;
+}
+
+/**
+ * Add a track to be copied to the plan, given its medialib properties.
+ */
+void
+planner_add (planner_t *planner, gint32 id, xmmsv_t *properties,
+             gboolean needs_conversion)
+{
+    const gchar *str;
+    plan_entry_t entry = {0};
+
+    entry.id = id;
+    entry.index = planner->entries->len;
+    entry.bytes = planner_estimate_bytes (properties, needs_conversion);
+
+    if (planner->rank_property) {
+        if (xmmsv_dict_entry_get_int (properties, planner->rank_property,
+                                      &entry.rank_int)) {
+            entry.has_rank = TRUE;
+        } else if (xmmsv_dict_entry_get_string (properties,
+                                                planner->rank_property, &str)) {
+            entry.has_rank = TRUE;
+            entry.rank_str = g_strdup (str);
+        }
+    }
+
+    planner->bytes += entry.bytes;
+    g_array_append_val (planner->entries, entry);
+
+    return;
+}
+
+/**
+ * Get the bytes all tracks in the plan are expected to take.
+ */
+guint64
+planner_get_bytes (planner_t *planner)
+{
+    return planner->bytes;
+}
+
+/**
+ * Pick the tracks that fit in the available bytes, by rank. Tracks that
+ * don't fit are skipped in favour of lower ranked ones that do.
+ * Returns the set of ids left out, which must be destroyed.
+ */
+GHashTable *
+planner_fit (planner_t *planner, guint64 available)
+{
+    guint i;
+    GArray *ranked;
+    GHashTable *dropped;
+    plan_entry_t *entry;
+
+    dropped = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+    ranked = g_array_sized_new (FALSE, FALSE, sizeof (plan_entry_t),
+                                planner->entries->len);
+    g_array_append_vals (ranked, planner->entries->data, planner->entries->len);
+    g_array_sort_with_data (ranked, compare_entries, planner);
+
+    for (i = 0; i < ranked->len; i++) {
+        entry = &g_array_index (ranked, plan_entry_t, i);
+
+        if (entry->bytes <= available) {
+            available -= entry->bytes;
+        } else {
+            g_hash_table_add (dropped, GINT_TO_POINTER (entry->id));
+        }
+    }
+
+    g_array_free (ranked, TRUE);
+
+    return dropped;
+}
+
+/**
+ * Estimate how many bytes a track will take in the iPod, from its
+ * medialib properties. Tracks that need converting are estimated from
+ * their duration and the encoder's average bitrate, others take their
+ * own size.
+ */
+guint64
+planner_estimate_bytes (xmmsv_t *properties, gboolean needs_conversion)
+{
+    gint32 size = 0, duration = 0, bitrate = 0;
+
+    xmmsv_dict_entry_get_int (properties, "size", &size);
+    xmmsv_dict_entry_get_int (properties, "duration", &duration);
+    xmmsv_dict_entry_get_int (properties, "bitrate", &bitrate);
+
+    /* duration is in ms, bitrates in kbps and bps respectively */
+    if (needs_conversion && duration > 0) {
+        return (guint64) duration * ENCODER_AVERAGE_BITRATE / 8;
+    } else if (size > 0) {
+        return (guint32) size;
+    } else if (duration > 0 && bitrate > 0) {
+        return (guint64) duration * bitrate / 8000;
+    }
+
+    return 0;
+}
+
+/**
+ * Get the bytes available in the filesystem at mountpoint.
+ */
+gboolean
+planner_free_space (const gchar *mountpoint, guint64 *available, GError **err)
+{
+    struct statvfs st;
+
+    if (statvfs (mountpoint, &st) != 0) {
+        SET_ERRNO_ERROR (err, "can't get the iPod's free space");
+        return FALSE;
+    }
+
+    *available = (guint64) st.f_bavail * st.f_frsize;
+
+    return TRUE;
+}
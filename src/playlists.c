@@ -0,0 +1,327 @@
+/* Copyright 2012, Guilherme P. Gonçalves (guilherme.p.gonc@gmail.com)
+ *
+ * This file is part of ipod-syncer.
+ *
+ * ipod-syncer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ipod-syncer.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <glib.h>
+#include <gpod/itdb.h>
+
+#include "playlists.h"
+
+#define RECORD_FILENAME "ipod-syncer.playlists"
+
+/* Playlists are mirrored in place: the tracks of an existing playlist
+ * that are no longer wanted are removed from it, the new ones added, and
+ * the members sorted if their order changed, so unchanged playlists
+ * aren't touched at all.
+ *
+ * The names of the playlists mirrored are recorded in a file next to the
+ * iTunesDB, so that the ones gone from the medialib can be told apart
+ * from playlists made by other means, which are left alone. Sources named
+ * like one of those aren't mirrored at all.
+ */
+
+static gchar *record_path (Itdb_iTunesDB *itdb, GError **err);
+static GHashTable *load_record (const gchar *path);
+static gint compare_positions (gconstpointer a, gconstpointer b, gpointer udata);
+static gboolean same_members (Itdb_Playlist *playlist, GPtrArray *wanted);
+static gboolean update_playlist (Itdb_Playlist *playlist, GPtrArray *wanted);
+
+playlist_source_t *
+playlist_source_new (const gchar *name, GArray *ids)
+{
+    playlist_source_t *source;
+
+    source = g_new0 (playlist_source_t, 1);
+    source->name = g_strdup (name);
+    source->ids = ids;
+
+    return source;
+}
+
+void
+playlist_source_free (playlist_source_t *source)
+{
+    g_free (source->name);
+    g_array_free (source->ids, TRUE);
+    g_free (source);
+
+    return;
+}
+
+static gchar *
+record_path (Itdb_iTunesDB *itdb, GError **err)
+{
+    gchar *itunesdir, *path;
+
+    itunesdir = itdb_get_itunes_dir (itdb_get_mountpoint (itdb));
+    if (!itunesdir) {
+        g_set_error (err, g_quark_from_static_string (__func__), 0,
+                     "can't find the iPod's iTunes directory");
+        return NULL;
+    }
+
+    path = g_build_filename (itunesdir, RECORD_FILENAME, NULL);
+    g_free (itunesdir);
+
+    return path;
+}
+
+/**
+ * Internal, read the names of the playlists mirrored last time, one
+ * escaped name per line.
+ */
+static GHashTable *
+load_record (const gchar *path)
+{
+    guint i;
+    gchar *contents, **lines;
+    GHashTable *names;
+
+    names = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+    if (!g_file_get_contents (path, &contents, NULL, NULL)) {
+        return names;
+    }
+
+    lines = g_strsplit (contents, "\n", -1);
+
+    for (i = 0; lines[i]; i++) {
+        if (*lines[i]) {
+            g_hash_table_add (names, g_strcompress (lines[i]));
+        }
+    }
+
+    g_strfreev (lines);
+    g_free (contents);
+
+    return names;
+}
+
+static gint
+compare_positions (gconstpointer a, gconstpointer b, gpointer udata)
+{
+    GHashTable *positions = (GHashTable *) udata;
+    guint pa, pb;
+
+    pa = GPOINTER_TO_UINT (g_hash_table_lookup (positions, a));
+    pb = GPOINTER_TO_UINT (g_hash_table_lookup (positions, b));
+
+    return (pa > pb) - (pa < pb);
+}
+
+/**
+ * Internal, check whether a playlist has exactly the wanted tracks,
+ * in order.
+ */
+static gboolean
+same_members (Itdb_Playlist *playlist, GPtrArray *wanted)
+{
+    guint i = 0;
+    GList *n;
+
+    for (n = playlist->members; n && i < wanted->len; n = g_list_next (n)) {
+        if (n->data != g_ptr_array_index (wanted, i++)) {
+            return FALSE;
+        }
+    }
+
+    return !n && i == wanted->len;
+}
+
+/**
+ * Internal, make the members of a playlist the wanted tracks, which must
+ * be unique, touching only what changed.
+ * Returns whether the playlist changed.
+ */
+static gboolean
+update_playlist (Itdb_Playlist *playlist, GPtrArray *wanted)
+{
+    guint i;
+    GList *n, *stale = NULL;
+    GHashTable *positions, *members;
+    Itdb_Track *track;
+
+    if (same_members (playlist, wanted)) {
+        return FALSE;
+    }
+
+    /* positions are stored off by one, so the first isn't NULL */
+    positions = g_hash_table_new (g_direct_hash, g_direct_equal);
+    for (i = 0; i < wanted->len; i++) {
+        g_hash_table_insert (positions, g_ptr_array_index (wanted, i),
+                             GUINT_TO_POINTER (i + 1));
+    }
+
+    members = g_hash_table_new (g_direct_hash, g_direct_equal);
+    for (n = playlist->members; n; n = g_list_next (n)) {
+        if (!g_hash_table_contains (positions, n->data) ||
+            g_hash_table_contains (members, n->data)) {
+            stale = g_list_prepend (stale, n->data);
+        } else {
+            g_hash_table_add (members, n->data);
+        }
+    }
+
+    for (n = stale; n; n = g_list_next (n)) {
+        itdb_playlist_remove_track (playlist, n->data);
+    }
+
+    for (i = 0; i < wanted->len; i++) {
+        track = g_ptr_array_index (wanted, i);
+        if (!g_hash_table_contains (members, track)) {
+            itdb_playlist_add_track (playlist, track, -1);
+        }
+    }
+
+    playlist->members = g_list_sort_with_data (playlist->members,
+                                               compare_positions, positions);
+
+    g_list_free (stale);
+    g_hash_table_destroy (members);
+    g_hash_table_destroy (positions);
+
+    return TRUE;
+}
+
+/**
+ * Mirror playlists in the iPod. Each source becomes a playlist of the
+ * same name, made of the tracks its ids map to in tracks, from medialib
+ * ids to Itdb_Tracks; ids not in tracks are skipped, and so are repeated
+ * tracks. Playlists mirrored earlier whose source is gone are removed.
+ * Sources whose name is taken by a playlist that wasn't mirrored are
+ * skipped, and marked as foreign.
+ * Nothing is written to the iPod, and changed tells whether the database
+ * needs writing.
+ */
+gboolean
+playlists_mirror (Itdb_iTunesDB *itdb, GPtrArray *sources, GHashTable *tracks,
+                  gboolean *changed, GError **err)
+{
+    guint i, j;
+    gchar *path;
+    gpointer name;
+    gboolean mirrored;
+    GHashTable *recorded, *seen;
+    GHashTableIter iter;
+    GPtrArray *wanted;
+    Itdb_Playlist *playlist;
+    Itdb_Track *track;
+    playlist_source_t *source;
+
+    *changed = FALSE;
+
+    if (!(path = record_path (itdb, err))) {
+        return FALSE;
+    }
+
+    recorded = load_record (path);
+    g_free (path);
+
+    for (i = 0; i < sources->len; i++) {
+        source = g_ptr_array_index (sources, i);
+        mirrored = g_hash_table_remove (recorded, source->name);
+
+        /* can't take the place of the iPod's own playlists, or of
+         * those made by other means
+         */
+        if ((playlist = itdb_playlist_by_name (itdb, source->name)) &&
+            (!mirrored || itdb_playlist_is_mpl (playlist) ||
+             itdb_playlist_is_podcasts (playlist))) {
+            source->foreign = TRUE;
+            continue;
+        }
+
+        if (!playlist) {
+            playlist = itdb_playlist_new (source->name, FALSE);
+            itdb_playlist_add (itdb, playlist, -1);
+            *changed = TRUE;
+        }
+
+        wanted = g_ptr_array_new ();
+        seen = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+        for (j = 0; j < source->ids->len; j++) {
+            track = g_hash_table_lookup (tracks, GINT_TO_POINTER (
+                                             g_array_index (source->ids, gint32, j)));
+            if (track && !g_hash_table_contains (seen, track)) {
+                g_hash_table_add (seen, track);
+                g_ptr_array_add (wanted, track);
+            }
+        }
+
+        *changed |= update_playlist (playlist, wanted);
+
+        g_hash_table_destroy (seen);
+        g_ptr_array_free (wanted, TRUE);
+    }
+
+    /* what's left in the record is gone from the medialib */
+    g_hash_table_iter_init (&iter, recorded);
+    while (g_hash_table_iter_next (&iter, &name, NULL)) {
+        if ((playlist = itdb_playlist_by_name (itdb, name)) &&
+            !itdb_playlist_is_mpl (playlist) && !itdb_playlist_is_podcasts (playlist)) {
+            itdb_playlist_remove (playlist);
+            *changed = TRUE;
+        }
+    }
+
+    g_hash_table_destroy (recorded);
+
+    return TRUE;
+}
+
+/**
+ * Record the names of the playlists mirrored, once the database with
+ * them was written, see playlists_mirror. Foreign sources are left out.
+ */
+gboolean
+playlists_record (Itdb_iTunesDB *itdb, GPtrArray *sources, GError **err)
+{
+    guint i;
+    gchar *path, *escaped;
+    gboolean ret;
+    GString *data;
+    playlist_source_t *source;
+
+    if (!(path = record_path (itdb, err))) {
+        return FALSE;
+    }
+
+    data = g_string_new (NULL);
+
+    for (i = 0; i < sources->len; i++) {
+        source = g_ptr_array_index (sources, i);
+
+        if (source->foreign) {
+            continue;
+        }
+
+        escaped = g_strescape (source->name, NULL);
+
+        g_string_append (data, escaped);
+        g_string_append_c (data, '\n');
+        g_free (escaped);
+    }
+
+    ret = g_file_set_contents (path, data->str, data->len, err);
+
+    g_string_free (data, TRUE);
+    g_free (path);
+
+    return ret;
+}
@@ -0,0 +1,62 @@
+/* Copyright 2012, Guilherme P. Gonçalves (guilherme.p.gonc@gmail.com)
+ *
+ * This file is part of ipod-syncer.
+ *
+ * ipod-syncer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ipod-syncer.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <glib.h>
+
+#include "riff.h"
+
+/* RIFF files, like wav, store their numbers little endian, and are made
+ * of chunks, each starting with a four letter id and the size of what
+ * follows.
+ */
+
+/**
+ * Append a little endian 16 bit value to a buffer.
+ */
+void
+riff_append_u16 (GByteArray *buf, guint16 value)
+{
+    value = GUINT16_TO_LE (value);
+    g_byte_array_append (buf, (const guint8 *) &value, 2);
+
+    return;
+}
+
+/**
+ * Append a little endian 32 bit value to a buffer.
+ */
+void
+riff_append_u32 (GByteArray *buf, guint32 value)
+{
+    value = GUINT32_TO_LE (value);
+    g_byte_array_append (buf, (const guint8 *) &value, 4);
+
+    return;
+}
+
+/**
+ * Append the header of a RIFF chunk to a buffer.
+ */
+void
+riff_append_chunk (GByteArray *buf, const gchar id[4], guint32 size)
+{
+    g_byte_array_append (buf, (const guint8 *) id, 4);
+    riff_append_u32 (buf, size);
+
+    return;
+}
@@ -0,0 +1,194 @@
+/* Copyright 2012, Guilherme P. Gonçalves (guilherme.p.gonc@gmail.com)
+ *
+ * This file is part of ipod-syncer.
+ *
+ * ipod-syncer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ipod-syncer.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gpod/itdb.h>
+
+#include "session.h"
+
+/* How much of the start of the database is hashed: its header, with the
+ * database's id, and the first records after it
+ */
+#define HEAD_SIZE 4096
+
+/* Size of a SHA1 digest */
+#define DIGEST_SIZE 20
+
+/* The iTunesDB is parsed once and kept in memory between syncs.
+ * The database file and the mountpoint are stamped whenever the database
+ * is read or written by us; if the stamp no longer matches, because the
+ * iPod was remounted or someone else wrote to the database, the copy in
+ * memory is stale and must be parsed again.
+ * As FAT only keeps mtimes to two seconds, and a rewrite may well keep the
+ * size, the start of the database is hashed too.
+ */
+typedef struct {
+    dev_t mount_dev;
+    dev_t dev;
+    ino_t ino;
+    goffset size;
+    gint64 mtime;
+    guint8 head[DIGEST_SIZE];
+} stamp_t;
+
+static gchar *mountpoint;
+static stamp_t stamp;
+
+static gboolean hash_head (const gchar *path, guint8 *digest);
+static gboolean take_stamp (stamp_t *s);
+
+/**
+ * Internal, hash the first HEAD_SIZE bytes of a file into digest.
+ */
+static gboolean
+hash_head (const gchar *path, guint8 *digest)
+{
+    FILE *file;
+    GChecksum *checksum;
+    guchar buffer[HEAD_SIZE];
+    gsize len = DIGEST_SIZE, n;
+
+    if (!(file = g_fopen (path, "rb"))) {
+        return FALSE;
+    }
+
+    n = fread (buffer, 1, sizeof (buffer), file);
+    fclose (file);
+
+    checksum = g_checksum_new (G_CHECKSUM_SHA1);
+    g_checksum_update (checksum, buffer, n);
+    g_checksum_get_digest (checksum, digest, &len);
+    g_checksum_free (checksum);
+
+    return TRUE;
+}
+
+/**
+ * Internal, stamp the database in the iPod.
+ * Returns false if it can't be found, say because the iPod is unplugged.
+ */
+static gboolean
+take_stamp (stamp_t *s)
+{
+    GStatBuf st;
+    gchar *path;
+    gboolean ret;
+
+    memset (s, 0, sizeof (stamp_t));
+
+    if (g_stat (mountpoint, &st) != 0) {
+        return FALSE;
+    }
+
+    s->mount_dev = st.st_dev;
+
+    if (!(path = itdb_get_itunesdb_path (mountpoint))) {
+        return FALSE;
+    }
+
+    if ((ret = g_stat (path, &st) == 0 && hash_head (path, s->head))) {
+        s->dev = st.st_dev;
+        s->ino = st.st_ino;
+        s->size = st.st_size;
+        s->mtime = st.st_mtime;
+    }
+
+    g_free (path);
+
+    return ret;
+}
+
+/**
+ * Parse the database of the iPod at mountpoint and start watching it.
+ */
+Itdb_iTunesDB *
+session_open (const gchar *path, GError **err)
+{
+    g_free (mountpoint);
+    mountpoint = g_strdup (path);
+
+    return session_reload (err);
+}
+
+/**
+ * Parse the database of the iPod again, see session_is_stale.
+ */
+Itdb_iTunesDB *
+session_reload (GError **err)
+{
+    /* stamped first, so changes made while parsing aren't missed */
+    take_stamp (&stamp);
+
+    return itdb_parse (mountpoint, err);
+}
+
+/**
+ * Check whether the database in memory may no longer match the iPod's.
+ */
+gboolean
+session_is_stale (void)
+{
+    stamp_t now;
+
+    if (!take_stamp (&now)) {
+        return TRUE;
+    }
+
+    return now.mount_dev != stamp.mount_dev || now.dev != stamp.dev ||
+           now.ino != stamp.ino || now.size != stamp.size ||
+           now.mtime != stamp.mtime ||
+           memcmp (now.head, stamp.head, DIGEST_SIZE) != 0;
+}
+
+/**
+ * Note that the database in memory was just written to the iPod.
+ */
+void
+session_mark_written (void)
+{
+    take_stamp (&stamp);
+
+    return;
+}
+
+/**
+ * Note that the database in memory was changed without writing it, say
+ * because the write failed, so it must be parsed again: the next
+ * session_is_stale returns true.
+ */
+void
+session_invalidate (void)
+{
+    memset (&stamp, 0, sizeof (stamp_t));
+
+    return;
+}
+
+void
+session_close (void)
+{
+    g_free (mountpoint);
+    mountpoint = NULL;
+
+    return;
+}
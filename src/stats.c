@@ -0,0 +1,334 @@
+/* Copyright 2012, Guilherme P. Gonçalves (guilherme.p.gonc@gmail.com)
+ *
+ * This file is part of ipod-syncer.
+ *
+ * ipod-syncer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ipod-syncer.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <string.h>
+#include <glib.h>
+
+#include "stats.h"
+
+/* Throughput figures measured by earlier runs, used for estimates */
+#define RATES_FILENAME "throughput"
+
+/* Latencies are kept in power of two buckets of microseconds, the
+ * last one catching everything from about half an hour up.
+ */
+#define HISTOGRAM_BUCKETS 32
+
+/* Each stage of a sync keeps the number of times it ran, the time spent
+ * in it and the bytes it produced, along with a histogram of how long
+ * each run took. Stages that run in parallel, like conversion, add up
+ * the time spent by each worker.
+ */
+typedef struct {
+    guint64 count;
+    gint64 total;
+    guint64 bytes;
+    guint64 histogram[HISTOGRAM_BUCKETS];
+} stage_stats_t;
+
+static const gchar *stage_names[STATS_NUM_STAGES] = {
+    "query", "fetch", "import", "convert", "copy", "voiceover", "write"
+};
+
+/* The throughput figures are kept in a key file in the user's cache
+ * directory, with a group per stage holding the seconds it took per run
+ * and per byte produced. Each save averages the figures measured since
+ * the one before into them, saved holding the totals as of that save.
+ */
+static GMutex lock;
+static gint64 started;
+static stage_stats_t stages[STATS_NUM_STAGES];
+static stage_stats_t saved[STATS_NUM_STAGES];
+static GKeyFile *rates;
+static gchar *rates_path;
+
+static guint bucket (gint64 usec);
+static void merge_rate (const gchar *group, const gchar *key, gdouble value);
+static guint64 peak_rss_kb (void);
+
+/**
+ * Internal, the histogram bucket for a latency.
+ */
+static guint
+bucket (gint64 usec)
+{
+    guint i = 0;
+
+    while (usec > 1 && i < HISTOGRAM_BUCKETS - 1) {
+        usec >>= 1;
+        i++;
+    }
+
+    return i;
+}
+
+/**
+ * Internal, average a measured figure into the stored ones.
+ */
+static void
+merge_rate (const gchar *group, const gchar *key, gdouble value)
+{
+    gdouble old;
+    GError *err = NULL;
+
+    old = g_key_file_get_double (rates, group, key, &err);
+    if (!err) {
+        value = (old + value) / 2;
+    }
+
+    g_clear_error (&err);
+    g_key_file_set_double (rates, group, key, value);
+
+    return;
+}
+
+/**
+ * Start keeping statistics, loading the throughput figures of earlier
+ * runs.
+ */
+void
+stats_init (void)
+{
+    started = stats_now ();
+
+    rates = g_key_file_new ();
+    rates_path = g_build_filename (g_get_user_cache_dir (), "ipod-syncer",
+                                   RATES_FILENAME, NULL);
+    g_key_file_load_from_file (rates, rates_path, G_KEY_FILE_NONE, NULL);
+
+    return;
+}
+
+/**
+ * Stop keeping statistics.
+ */
+void
+stats_deinit (void)
+{
+    if (rates) {
+        g_key_file_free (rates);
+        g_free (rates_path);
+        rates = NULL;
+    }
+
+    return;
+}
+
+/**
+ * Get a timestamp to be passed to stats_record.
+ */
+gint64
+stats_now (void)
+{
+    return g_get_monotonic_time ();
+}
+
+/**
+ * Record a run of a stage, which started at since, as given by stats_now.
+ */
+void
+stats_record (stats_stage_t stage, gint64 since, guint64 bytes)
+{
+    stats_record_batch (stage, since, 1, bytes);
+
+    return;
+}
+
+/**
+ * Record runs of a stage done in a single batch, which started at since.
+ * Each run is taken to have taken the same time.
+ */
+void
+stats_record_batch (stats_stage_t stage, gint64 since, guint runs, guint64 bytes)
+{
+    gint64 elapsed = MAX (stats_now () - since, 0);
+
+    if (runs == 0) {
+        return;
+    }
+
+    g_mutex_lock (&lock);
+
+    stages[stage].count += runs;
+    stages[stage].total += elapsed;
+    stages[stage].bytes += bytes;
+    stages[stage].histogram[bucket (elapsed / runs)] += runs;
+
+    g_mutex_unlock (&lock);
+
+    return;
+}
+
+/**
+ * Store the throughput measured since the last save, for later
+ * estimates.
+ */
+void
+stats_save_rates (void)
+{
+    guint i;
+    gchar *dir, *data;
+    gsize length;
+    gdouble seconds;
+    guint64 count, bytes;
+
+    g_return_if_fail (rates);
+
+    g_mutex_lock (&lock);
+
+    for (i = 0; i < STATS_NUM_STAGES; i++) {
+        count = stages[i].count - saved[i].count;
+        bytes = stages[i].bytes - saved[i].bytes;
+        seconds = (stages[i].total - saved[i].total) / (gdouble) G_USEC_PER_SEC;
+
+        saved[i] = stages[i];
+
+        if (count == 0) {
+            continue;
+        }
+
+        merge_rate (stage_names[i], "seconds_per_run", seconds / count);
+        if (bytes > 0) {
+            merge_rate (stage_names[i], "seconds_per_byte", seconds / bytes);
+        }
+    }
+
+    g_mutex_unlock (&lock);
+
+    dir = g_path_get_dirname (rates_path);
+    g_mkdir_with_parents (dir, 0755);
+    g_free (dir);
+
+    data = g_key_file_to_data (rates, &length, NULL);
+    g_file_set_contents (rates_path, data, length, NULL);
+    g_free (data);
+
+    return;
+}
+
+/**
+ * Estimate how long a stage will take to produce bytes, or if that's not
+ * known or bytes is 0, to run the given number of times, from the
+ * throughput of earlier runs.
+ * Returns the estimate in seconds, or a negative value if the stage
+ * never ran before.
+ */
+gdouble
+stats_estimate (stats_stage_t stage, guint runs, guint64 bytes)
+{
+    gdouble rate;
+    GError *err = NULL;
+    const gchar *name = stage_names[stage];
+
+    g_return_val_if_fail (rates, -1);
+
+    if (bytes > 0) {
+        rate = g_key_file_get_double (rates, name, "seconds_per_byte", &err);
+        if (!err) {
+            return rate * bytes;
+        }
+
+        g_clear_error (&err);
+    }
+
+    rate = g_key_file_get_double (rates, name, "seconds_per_run", &err);
+    if (err) {
+        g_error_free (err);
+        return -1;
+    }
+
+    return rate * runs;
+}
+
+/**
+ * Internal, the peak resident set size of the process in kB, as told by
+ * /proc, or 0 where it's not available.
+ */
+static guint64
+peak_rss_kb (void)
+{
+    gchar *contents, *line;
+    guint64 kb = 0;
+
+    if (!g_file_get_contents ("/proc/self/status", &contents, NULL, NULL)) {
+        return 0;
+    }
+
+    if ((line = strstr (contents, "VmHWM:"))) {
+        kb = g_ascii_strtoull (line + strlen ("VmHWM:"), NULL, 10);
+    }
+
+    g_free (contents);
+
+    return kb;
+}
+
+/**
+ * Dump the statistics as a JSON object, one stage per line.
+ * Histograms are lists of [upper bound in microseconds, count] pairs,
+ * leaving out empty buckets.
+ * The string must be free'd.
+ */
+gchar *
+stats_to_json (void)
+{
+    guint i, j;
+    gboolean first;
+    GString *json;
+    gchar seconds[G_ASCII_DTOSTR_BUF_SIZE];
+
+    json = g_string_new ("{\n");
+
+    g_mutex_lock (&lock);
+
+    g_ascii_dtostr (seconds, sizeof (seconds),
+                    (stats_now () - started) / (gdouble) G_USEC_PER_SEC);
+    g_string_append_printf (json, "  \"uptime\": %s,\n  \"peak_rss_kb\": %"
+                            G_GUINT64_FORMAT ",\n  \"stages\": {\n",
+                            seconds, peak_rss_kb ());
+
+    for (i = 0; i < STATS_NUM_STAGES; i++) {
+        g_ascii_dtostr (seconds, sizeof (seconds),
+                        stages[i].total / (gdouble) G_USEC_PER_SEC);
+
+        g_string_append_printf (json, "    \"%s\": {\"count\": %" G_GUINT64_FORMAT
+                                ", \"seconds\": %s, \"bytes\": %" G_GUINT64_FORMAT
+                                ", \"histogram\": [", stage_names[i],
+                                stages[i].count, seconds, stages[i].bytes);
+
+        for (j = 0, first = TRUE; j < HISTOGRAM_BUCKETS; j++) {
+            if (stages[i].histogram[j]) {
+                g_string_append_printf (json, "%s[%" G_GUINT64_FORMAT ", %"
+                                        G_GUINT64_FORMAT "]", first ? "" : ", ",
+                                        (guint64) 1 << (j + 1),
+                                        stages[i].histogram[j]);
+                first = FALSE;
+            }
+        }
+
+        g_string_append_printf (json, "]}%s\n",
+                                i < STATS_NUM_STAGES - 1 ? "," : "");
+    }
+
+    g_mutex_unlock (&lock);
+
+    g_string_append (json, "  }\n}\n");
+
+    return g_string_free (json, FALSE);
+}
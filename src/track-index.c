@@ -0,0 +1,433 @@
+/* Copyright 2012, Guilherme P. Gonçalves (guilherme.p.gonc@gmail.com)
+ *
+ * This file is part of ipod-syncer.
+ *
+ * ipod-syncer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ipod-syncer.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <glib.h>
+#include <gpod/itdb.h>
+
+#include "track-index.h"
+
+/* Tracks synced by us carry the path of their source file in the
+ * keywords field, which the iPod doesn't display for music.
+ */
+#define SOURCE_TAG_PREFIX "ipod-syncer:"
+
+/* Index of the tracks in the iPod.
+ * Tracks are looked up either by their source tag, or by a key built
+ * from their normalized metadata. Both tables map keys to arrays of the
+ * Itdb_Tracks with that key, in the order they were added, and lookups
+ * return the first one; the others are found once it's removed.
+ * Tracks may also be given the fingerprint of their source file, see
+ * fingerprint.h, to find other copies of the same recording.
+ * The keys each track was indexed under are kept in by_track, so tracks
+ * can be removed even after their metadata changed.
+ */
+struct track_index_St {
+    GHashTable *by_source;
+    GHashTable *by_metadata;
+    GHashTable *by_fingerprint;
+    GHashTable *by_track;
+};
+
+typedef struct {
+    gchar *source;
+    gchar *metadata;
+    gchar *fingerprint;
+} track_keys_t;
+
+static gchar *normalize (const gchar *str);
+static gchar *build_metadata_key (const gchar *artist, const gchar *album, const gchar *title, gint track_nr, gint tracklen, gint size);
+static gchar *metadata_key (Itdb_Track *track);
+static const gchar *source_key (Itdb_Track *track);
+static GHashTable *new_key_table (void);
+static void insert_key (GHashTable *table, const gchar *key, Itdb_Track *track);
+static void remove_key (GHashTable *table, const gchar *key, Itdb_Track *track);
+static Itdb_Track *lookup_key (GHashTable *table, const gchar *key);
+static void free_track_keys (track_keys_t *keys);
+
+/**
+ * Normalize a metadata string for comparison.
+ */
+static gchar *
+normalize (const gchar *str)
+{
+    gchar *normalized, *folded;
+
+    if (!str) {
+        return g_strdup ("");
+    }
+
+    normalized = g_utf8_normalize (str, -1, G_NORMALIZE_ALL_COMPOSE);
+    if (!normalized) {
+        /* not valid UTF-8, compare it as is */
+        return g_strstrip (g_strdup (str));
+    }
+
+    folded = g_utf8_casefold (normalized, -1);
+    g_free (normalized);
+
+    return g_strstrip (folded);
+}
+
+/**
+ * Build the metadata key for a track's fields.
+ */
+static gchar *
+build_metadata_key (const gchar *artist, const gchar *album,
+                    const gchar *title, gint track_nr, gint tracklen,
+                    gint size)
+{
+    gchar *nartist, *nalbum, *ntitle, *key;
+
+    nartist = normalize (artist);
+    nalbum = normalize (album);
+    ntitle = normalize (title);
+
+    key = g_strdup_printf ("%s\x1f%s\x1f%s\x1f%d\x1f%d\x1f%d",
+                           nartist, nalbum, ntitle, track_nr, tracklen, size);
+
+    g_free (nartist);
+    g_free (nalbum);
+    g_free (ntitle);
+
+    return key;
+}
+
+/**
+ * Build the metadata key for a track.
+ */
+static gchar *
+metadata_key (Itdb_Track *track)
+{
+    return build_metadata_key (track->artist, track->album, track->title,
+                               track->track_nr, track->tracklen, track->size);
+}
+
+/**
+ * Return the source tag of a track, or NULL if it has none.
+ */
+static const gchar *
+source_key (Itdb_Track *track)
+{
+    if (track->keywords && g_str_has_prefix (track->keywords, SOURCE_TAG_PREFIX)) {
+        return track->keywords;
+    }
+
+    return NULL;
+}
+
+/**
+ * Create a table mapping keys to the tracks with each key.
+ */
+static GHashTable *
+new_key_table (void)
+{
+    return g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                  (GDestroyNotify) g_ptr_array_unref);
+}
+
+/**
+ * Add a track under a key of a table, after the tracks already there.
+ */
+static void
+insert_key (GHashTable *table, const gchar *key, Itdb_Track *track)
+{
+    GPtrArray *tracks;
+
+    if (!(tracks = g_hash_table_lookup (table, key))) {
+        tracks = g_ptr_array_new ();
+        g_hash_table_insert (table, g_strdup (key), tracks);
+    }
+
+    g_ptr_array_add (tracks, track);
+
+    return;
+}
+
+/**
+ * Remove a track from under a key of a table, dropping the key along
+ * with its last track.
+ */
+static void
+remove_key (GHashTable *table, const gchar *key, Itdb_Track *track)
+{
+    GPtrArray *tracks;
+
+    if ((tracks = g_hash_table_lookup (table, key)) &&
+        g_ptr_array_remove (tracks, track) && tracks->len == 0) {
+        g_hash_table_remove (table, key);
+    }
+
+    return;
+}
+
+/**
+ * Look up the first track added under a key of a table, or NULL.
+ */
+static Itdb_Track *
+lookup_key (GHashTable *table, const gchar *key)
+{
+    GPtrArray *tracks;
+
+    if (!(tracks = g_hash_table_lookup (table, key))) {
+        return NULL;
+    }
+
+    return g_ptr_array_index (tracks, 0);
+}
+
+static void
+free_track_keys (track_keys_t *keys)
+{
+    g_free (keys->source);
+    g_free (keys->metadata);
+    g_free (keys->fingerprint);
+    g_free (keys);
+
+    return;
+}
+
+/**
+ * Build an index of all tracks in an iTunesDB.
+ */
+track_index_t *
+track_index_new (Itdb_iTunesDB *itdb)
+{
+    GList *n;
+    track_index_t *index;
+
+    index = g_new0 (track_index_t, 1);
+    index->by_source = new_key_table ();
+    index->by_metadata = new_key_table ();
+    index->by_fingerprint = new_key_table ();
+    index->by_track = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+                                             NULL, (GDestroyNotify) free_track_keys);
+
+    for (n = itdb->tracks; n; n = g_list_next (n)) {
+        track_index_add (index, (Itdb_Track *) n->data);
+    }
+
+    return index;
+}
+
+void
+track_index_free (track_index_t *index)
+{
+    g_hash_table_destroy (index->by_source);
+    g_hash_table_destroy (index->by_metadata);
+    g_hash_table_destroy (index->by_fingerprint);
+    g_hash_table_destroy (index->by_track);
+    g_free (index);
+
+    return;
+}
+
+/**
+ * Add a track to the index, or re-index it if it was already there,
+ * keeping the fingerprint it was given, as its source file is the same.
+ * If another track already has the same keys, lookups keep finding that
+ * one until it's removed.
+ */
+void
+track_index_add (track_index_t *index, Itdb_Track *track)
+{
+    track_keys_t *keys;
+    gchar *fingerprint = NULL;
+
+    if ((keys = g_hash_table_lookup (index->by_track, track))) {
+        fingerprint = g_strdup (keys->fingerprint);
+    }
+
+    track_index_remove (index, track);
+
+    keys = g_new0 (track_keys_t, 1);
+    keys->source = g_strdup (source_key (track));
+    keys->metadata = metadata_key (track);
+
+    if (keys->source) {
+        insert_key (index->by_source, keys->source, track);
+    }
+
+    insert_key (index->by_metadata, keys->metadata, track);
+
+    g_hash_table_insert (index->by_track, track, keys);
+
+    if (fingerprint) {
+        track_index_set_fingerprint (index, track, fingerprint);
+        g_free (fingerprint);
+    }
+
+    return;
+}
+
+/**
+ * Remove a track from the index.
+ */
+void
+track_index_remove (track_index_t *index, Itdb_Track *track)
+{
+    track_keys_t *keys;
+
+    if (!(keys = g_hash_table_lookup (index->by_track, track))) {
+        return;
+    }
+
+    if (keys->source) {
+        remove_key (index->by_source, keys->source, track);
+    }
+
+    remove_key (index->by_metadata, keys->metadata, track);
+
+    if (keys->fingerprint) {
+        remove_key (index->by_fingerprint, keys->fingerprint, track);
+    }
+
+    /* frees the keys */
+    g_hash_table_remove (index->by_track, track);
+
+    return;
+}
+
+/**
+ * Look up a track in the index.
+ * The track need not be in the iTunesDB; only its metadata and the path
+ * to its source file are used.
+ * Returns the matching Itdb_Track in the iPod, or NULL.
+ */
+Itdb_Track *
+track_index_lookup (track_index_t *index, Itdb_Track *track, const gchar *filepath)
+{
+    gchar *key;
+    Itdb_Track *found = NULL;
+
+    if (filepath) {
+        found = track_index_lookup_source (index, filepath);
+    }
+
+    if (!found) {
+        key = metadata_key (track);
+        found = lookup_key (index->by_metadata, key);
+        g_free (key);
+    }
+
+    return found;
+}
+
+/**
+ * Look up a track in the index by its metadata only, given as fields
+ * rather than as an Itdb_Track.
+ * Returns the matching Itdb_Track in the iPod, or NULL.
+ */
+Itdb_Track *
+track_index_lookup_metadata (track_index_t *index, const gchar *artist,
+                             const gchar *album, const gchar *title,
+                             gint track_nr, gint tracklen, gint size)
+{
+    gchar *key;
+    Itdb_Track *found;
+
+    key = build_metadata_key (artist, album, title, track_nr, tracklen, size);
+    found = lookup_key (index->by_metadata, key);
+    g_free (key);
+
+    return found;
+}
+
+/**
+ * Look up a track in the index by the path to its source file only.
+ * Returns the matching Itdb_Track in the iPod, or NULL.
+ */
+Itdb_Track *
+track_index_lookup_source (track_index_t *index, const gchar *filepath)
+{
+    gchar *key;
+    Itdb_Track *found;
+
+    key = g_strconcat (SOURCE_TAG_PREFIX, filepath, NULL);
+    found = lookup_key (index->by_source, key);
+    g_free (key);
+
+    return found;
+}
+
+/**
+ * Set the fingerprint of the source file of a track in the index.
+ * If another track already has the same fingerprint, lookups keep
+ * finding that one until it's removed.
+ */
+void
+track_index_set_fingerprint (track_index_t *index, Itdb_Track *track,
+                             const gchar *fingerprint)
+{
+    track_keys_t *keys;
+
+    if (!(keys = g_hash_table_lookup (index->by_track, track)) ||
+        g_strcmp0 (keys->fingerprint, fingerprint) == 0) {
+        return;
+    }
+
+    if (keys->fingerprint) {
+        remove_key (index->by_fingerprint, keys->fingerprint, track);
+        g_free (keys->fingerprint);
+    }
+
+    keys->fingerprint = g_strdup (fingerprint);
+    insert_key (index->by_fingerprint, keys->fingerprint, track);
+
+    return;
+}
+
+/**
+ * Look up a track in the index by the fingerprint of its source file.
+ * Returns the matching Itdb_Track in the iPod, or NULL.
+ */
+Itdb_Track *
+track_index_lookup_fingerprint (track_index_t *index, const gchar *fingerprint)
+{
+    return lookup_key (index->by_fingerprint, fingerprint);
+}
+
+/**
+ * Return the path to the source file a track was tagged with, or NULL
+ * if it wasn't synced by us.
+ */
+const gchar *
+track_index_get_source (Itdb_Track *track)
+{
+    const gchar *source;
+
+    if (!(source = source_key (track))) {
+        return NULL;
+    }
+
+    return source + strlen (SOURCE_TAG_PREFIX);
+}
+
+/**
+ * Tag a track with the path to its source file, so that it can be
+ * found in the index even if its metadata changes.
+ * The track must be (re-)added to the index afterwards.
+ */
+void
+track_index_set_source (Itdb_Track *track, const gchar *filepath)
+{
+    g_free (track->keywords);
+    track->keywords = g_strconcat (SOURCE_TAG_PREFIX, filepath, NULL);
+
+    return;
+}
@@ -0,0 +1,414 @@
+/* Copyright 2012, Guilherme P. Gonçalves (guilherme.p.gonc@gmail.com)
+ *
+ * This file is part of ipod-syncer.
+ *
+ * ipod-syncer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ipod-syncer.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <utime.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "transcode-cache.h"
+
+#define CACHE_SUFFIX ".mp3"
+#define TMP_INFIX ".tmp-"
+
+/* Temporary files older than this are leftovers from a crashed run */
+#define STALE_TMP_AGE (24 * 60 * 60)
+
+/* Eviction goes down to this fraction of the limit, so it doesn't run
+ * again on the very next commit
+ */
+#define EVICT_TARGET(size) ((size) / 10 * 9)
+
+/* The cache lives in the user's cache directory and is shared by all
+ * instances of ipod-syncer. Entries are named after a hash of their key
+ * and their mtime is bumped on every hit, so it doubles as the LRU stamp.
+ *
+ * Paths handed out by this module are pinned until released, so they
+ * are never evicted while the caller still needs them. A pin is a shared
+ * flock on the entry, which eviction tries to take exclusively, so pins
+ * hold against other processes sharing the cache too.
+ *
+ * The size of the cache is kept as a running total, only scanning the
+ * directory when it goes over the limit. Entries committed by other
+ * processes aren't counted until then.
+ */
+static GMutex lock;
+static gchar *cachedir;
+static guint64 max_size;
+static guint64 total_size;
+static GHashTable *pinned;
+
+/* A pinned entry, with the descriptor holding its lock */
+typedef struct {
+    gint fd;
+    guint count;
+} pin_t;
+
+typedef struct {
+    gchar *path;
+    goffset size;
+    time_t mtime;
+} cache_entry_t;
+
+static gchar *entry_path (const gchar *key);
+static gboolean pin (const gchar *path);
+static void free_pin (pin_t *p);
+static gint compare_entries (gconstpointer a, gconstpointer b);
+static void evict (void);
+
+static gchar *
+entry_path (const gchar *key)
+{
+    gchar *name, *path;
+
+    name = g_strconcat (key, CACHE_SUFFIX, NULL);
+    path = g_build_filename (cachedir, name, NULL);
+    g_free (name);
+
+    return path;
+}
+
+/**
+ * Pin a path in the cache. Must be called with the lock held.
+ * Returns false if the entry is gone, evicted by another process.
+ */
+static gboolean
+pin (const gchar *path)
+{
+    pin_t *p;
+    gint fd;
+    struct stat st;
+
+    if ((p = g_hash_table_lookup (pinned, path))) {
+        p->count++;
+        return TRUE;
+    }
+
+    if ((fd = g_open (path, O_RDONLY, 0)) == -1) {
+        return FALSE;
+    }
+
+    /* an evictor holds the lock until the entry is unlinked */
+    if (flock (fd, LOCK_SH) != 0 || fstat (fd, &st) != 0 || st.st_nlink == 0) {
+        close (fd);
+        return FALSE;
+    }
+
+    p = g_new0 (pin_t, 1);
+    p->fd = fd;
+    p->count = 1;
+    g_hash_table_insert (pinned, g_strdup (path), p);
+
+    return TRUE;
+}
+
+static void
+free_pin (pin_t *p)
+{
+    /* drops the lock too */
+    close (p->fd);
+    g_free (p);
+
+    return;
+}
+
+static gint
+compare_entries (gconstpointer a, gconstpointer b)
+{
+    const cache_entry_t *ea = a, *eb = b;
+
+    return (ea->mtime > eb->mtime) - (ea->mtime < eb->mtime);
+}
+
+/**
+ * Work out the size of the cache, and if it doesn't fit in max_size,
+ * remove least recently used entries that nobody has pinned until it
+ * fits in EVICT_TARGET (max_size).
+ * Must be called with the lock held.
+ */
+static void
+evict (void)
+{
+    GDir *dir;
+    guint i;
+    gint fd;
+    GStatBuf st;
+    const gchar *name;
+    guint64 total = 0, target;
+    cache_entry_t entry;
+    GArray *entries;
+    time_t now = time (NULL);
+
+    if (!(dir = g_dir_open (cachedir, 0, NULL))) {
+        return;
+    }
+
+    entries = g_array_new (FALSE, FALSE, sizeof (cache_entry_t));
+
+    while ((name = g_dir_read_name (dir))) {
+        entry.path = g_build_filename (cachedir, name, NULL);
+
+        if (g_stat (entry.path, &st) != 0) {
+            g_free (entry.path);
+            continue;
+        }
+
+        if (strstr (name, TMP_INFIX)) {
+            if (now - st.st_mtime > STALE_TMP_AGE) {
+                g_remove (entry.path);
+            }
+
+            g_free (entry.path);
+            continue;
+        }
+
+        entry.size = st.st_size;
+        entry.mtime = st.st_mtime;
+        total += entry.size;
+
+        g_array_append_val (entries, entry);
+    }
+
+    g_dir_close (dir);
+
+    g_array_sort (entries, compare_entries);
+
+    target = total > max_size ? EVICT_TARGET (max_size) : total;
+
+    for (i = 0; i < entries->len; i++) {
+        cache_entry_t *e = &g_array_index (entries, cache_entry_t, i);
+
+        if (total > target && (fd = g_open (e->path, O_RDONLY, 0)) != -1) {
+
+            /* pinned, here or by another process, if it can't be locked */
+            if (flock (fd, LOCK_EX | LOCK_NB) == 0 && g_remove (e->path) == 0) {
+                total -= e->size;
+            }
+
+            close (fd);
+        }
+
+        g_free (e->path);
+    }
+
+    g_array_free (entries, TRUE);
+
+    total_size = total;
+
+    return;
+}
+
+/**
+ * Initialize the transcode cache, limiting it to max_size bytes.
+ */
+gboolean
+transcode_cache_init (guint64 size)
+{
+    cachedir = g_build_filename (g_get_user_cache_dir (),
+                                 "ipod-syncer", "transcoded", NULL);
+
+    if (g_mkdir_with_parents (cachedir, 0700) != 0) {
+        g_free (cachedir);
+        cachedir = NULL;
+        return FALSE;
+    }
+
+    max_size = size;
+    pinned = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                    (GDestroyNotify) free_pin);
+
+    g_mutex_lock (&lock);
+    evict ();
+    g_mutex_unlock (&lock);
+
+    return TRUE;
+}
+
+void
+transcode_cache_deinit (void)
+{
+    if (cachedir) {
+        g_hash_table_destroy (pinned);
+        g_free (cachedir);
+        cachedir = NULL;
+    }
+
+    return;
+}
+
+/**
+ * Build the cache key for converting a file with the given encoder options.
+ * Returns NULL if the cache is disabled or the file can't be stat'd.
+ */
+gchar *
+transcode_cache_key (const gchar *filepath, const gchar *options)
+{
+    gchar *stamp, *key;
+    GChecksum *checksum;
+    GStatBuf st;
+
+    if (!cachedir || g_stat (filepath, &st) != 0) {
+        return NULL;
+    }
+
+    stamp = g_strdup_printf ("%" G_GINT64_FORMAT ":%" G_GINT64_FORMAT,
+                             (gint64) st.st_size, (gint64) st.st_mtime);
+
+    /* include the terminating NULs so fields can't run into each other */
+    checksum = g_checksum_new (G_CHECKSUM_SHA1);
+    g_checksum_update (checksum, (const guchar *) filepath, strlen (filepath) + 1);
+    g_checksum_update (checksum, (const guchar *) stamp, strlen (stamp) + 1);
+    g_checksum_update (checksum, (const guchar *) options, -1);
+
+    key = g_strdup (g_checksum_get_string (checksum));
+
+    g_checksum_free (checksum);
+    g_free (stamp);
+
+    return key;
+}
+
+/**
+ * Look up a key in the cache.
+ * Returns the pinned path to the cached file, or NULL on a miss.
+ */
+gchar *
+transcode_cache_lookup (const gchar *key)
+{
+    gchar *path;
+
+    path = entry_path (key);
+
+    g_mutex_lock (&lock);
+
+    if (g_utime (path, NULL) != 0 || !pin (path)) {
+        g_free (path);
+        path = NULL;
+    }
+
+    g_mutex_unlock (&lock);
+
+    return path;
+}
+
+/**
+ * Create a temporary file in the cache directory, to be filled in
+ * by the caller and then handed to transcode_cache_commit.
+ */
+gchar *
+transcode_cache_reserve (const gchar *key, GError **err)
+{
+    gint fd;
+    gchar *name, *path;
+
+    name = g_strconcat (key, TMP_INFIX, "XXXXXX", NULL);
+    path = g_build_filename (cachedir, name, NULL);
+    g_free (name);
+
+    if ((fd = g_mkstemp (path)) == -1) {
+        g_set_error (err, g_quark_from_static_string (__func__), errno,
+                     "can't create cache file: %s", g_strerror (errno));
+        g_free (path);
+        return NULL;
+    }
+
+    close (fd);
+    return path;
+}
+
+/**
+ * Move a file filled in by the caller into the cache, taking ownership
+ * of tmppath, and evict old entries if needed.
+ * Returns the pinned path to the cached file.
+ */
+gchar *
+transcode_cache_commit (const gchar *key, gchar *tmppath, GError **err)
+{
+    gchar *path;
+    GStatBuf st;
+
+    path = entry_path (key);
+
+    if (g_rename (tmppath, path) != 0) {
+        g_set_error (err, g_quark_from_static_string (__func__), errno,
+                     "can't move file into cache: %s", g_strerror (errno));
+        g_remove (tmppath);
+        g_free (tmppath);
+        g_free (path);
+        return NULL;
+    }
+
+    g_free (tmppath);
+
+    g_mutex_lock (&lock);
+
+    if (g_stat (path, &st) == 0) {
+        total_size += st.st_size;
+    }
+
+    /* only just renamed, so only lost if another process evicted it */
+    if (!pin (path)) {
+        g_set_error (err, g_quark_from_static_string (__func__), 0,
+                     "cache file vanished");
+        g_free (path);
+        path = NULL;
+    } else if (total_size > max_size) {
+        evict ();
+    }
+
+    g_mutex_unlock (&lock);
+
+    return path;
+}
+
+/**
+ * Release a path returned by transcode_cache_lookup or
+ * transcode_cache_commit.
+ * Returns false if the path doesn't belong to the cache.
+ */
+gboolean
+transcode_cache_release (const gchar *path)
+{
+    pin_t *p;
+    gboolean ret = FALSE;
+
+    if (!cachedir) {
+        return FALSE;
+    }
+
+    g_mutex_lock (&lock);
+
+    if ((p = g_hash_table_lookup (pinned, path))) {
+        if (--p->count == 0) {
+            g_hash_table_remove (pinned, path);
+        }
+
+        ret = TRUE;
+    }
+
+    g_mutex_unlock (&lock);
+
+    return ret;
+}
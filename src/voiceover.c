@@ -21,91 +21,123 @@
  *   email: jonsd@users.sourceforge.net
  */
 
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
 #include <glib.h>
 #include <glib/gstdio.h>
-#include <stdio.h>
 #include <gpod/itdb.h>
 #include <espeak/speak_lib.h>
 
+#include "riff.h"
 #include "voiceover.h"
 
-/* These are initialized along with espeak in voiceover_init.
- * Having espeak (de)initialize for every track makes it segfault,
- * so we only initialize it once and keep state in global variables.
+/* The voice used for all voiceovers: a young female voice with US accent,
+ * with increased pitch and range to make the robotic voice less scary.
+ * Any change here must be reflected in VOICE_PARAMS, which is part of the
+ * cache key for synthesized voiceovers.
  */
+#define VOICE_LANGUAGE "en-us"
+#define VOICE_GENDER 2
+#define VOICE_AGE 20
+#define VOICE_VARIANT 0
+#define VOICE_PITCH 70
+#define VOICE_RANGE 80
+#define VOICE_WORDGAP 1
+
+#define VOICE_PARAMS VOICE_LANGUAGE G_STRINGIFY (VOICE_GENDER) \
+    G_STRINGIFY (VOICE_AGE) G_STRINGIFY (VOICE_VARIANT) \
+    G_STRINGIFY (VOICE_PITCH) G_STRINGIFY (VOICE_RANGE) \
+    G_STRINGIFY (VOICE_WORDGAP)
+
+/* Synthesis happens in helper processes, each running this program with
+ * HELPER_OPTION and owning its own espeak instance. Having espeak
+ * (de)initialize for every track makes it segfault, so each helper only
+ * initializes it once and keeps state in global variables.
+ *
+ * Helpers read requests from stdin, one per line, as the path to write
+ * the wav file to and the text to speak, separated by a tab. They reply
+ * on stdout with a line holding 0 on success, 1 otherwise.
+ *
+ * Synthesized voiceovers are kept in the user's cache directory, named
+ * after a hash of their text and the voice, and copied from there to the
+ * iPod, so the same text is never synthesized twice.
+ */
+#define HELPER_OPTION "--" VOICEOVER_HELPER_OPTION
+
+/* espeak produces mono, 16 bit samples */
+#define WAV_CHANNELS 1
+#define WAV_SAMPLE_SIZE 2
+#define WAV_HEADER_SIZE 44
+
+typedef struct {
+    GPid pid;
+    gint requests;
+    gint replies;
+    gchar *key;
+} helper_t;
+
 static gint samplerate;
 static gchar *tracks_voiceoverd;
-
+static gchar *cachedir;
+static gchar *helper_path;
+static helper_t *helpers;
+static guint num_helpers;
+
+/* Samples are collected in memory as espeak produces them, after room
+ * for the header, which is filled in once their size is known. The whole
+ * file is then written out at once.
+ */
 typedef struct {
-    FILE *wavfile;
-    gchar *wavpath;
+    GByteArray *samples;
 } synth_context_t;
 
-static void write_4_bytes (FILE *f, guint value);
-static FILE *open_wav (gchar *path);
-static void close_wav (FILE *wav);
+static GByteArray *build_wav_header (guint32 data_size);
 static gint synth_cb (gshort *wav, gint numsamples, espeak_EVENT *events);
 static gchar *voiceover_path (Itdb_Track *track, const gchar *voiceoverd);
 static gchar *get_tracks_voiceover_dir (const gchar *mountpoint);
+static gchar *voiceover_text (Itdb_Track *track);
+static gchar *cache_path (const gchar *key);
+static gboolean start_helpers (void);
+static void stop_helper (helper_t *helper);
+static gboolean send_request (helper_t *helper, const gchar *key, const gchar *text);
+static gboolean read_reply (helper_t *helper);
+static void synthesize (GHashTable *texts);
+static gboolean copy_voiceover (const gchar *src, const gchar *dest);
+static gboolean speak (const gchar *text, const gchar *wavpath);
 
 /**
- * Write 4 bytes into a file, from least to most significant.
+ * Build the header of a mono, 16 bit PCM wav file holding data_size bytes
+ * of samples.
  */
-static void
-write_4_bytes (FILE *f, guint value)
-{
-    guint i;
-
-    for (i = 0; i < 4; i++) {
-        fputc (value & 0xff, f);
-        value = value >> 8;
-    }
-
-    return;
-}
-
-/**
- * Open a wav file.
- */
-static FILE *
-open_wav (gchar *path)
-{
-    const guchar wave_hdr[] = {
-        'R', 'I', 'F', 'F', 0x24, 0xf0, 0xff, 0x7f, 'W', 'A', 'V', 'E', 'f',
-        'm', 't', ' ', 0x10, 0, 0, 0, 1, 0, 1, 0, 9, 0x3d, 0, 0, 0x12, 0x7a,
-        0, 0, 2, 0, 0x10, 0, 'd', 'a', 't', 'a', 0x00, 0xf0, 0xff, 0x7f
-    };
-
-    FILE *wav = NULL;
-
-    if ((wav = fopen(path, "wb"))) {
-        fwrite (wave_hdr, 1, 24, wav);
-        write_4_bytes (wav, samplerate);
-        write_4_bytes (wav, samplerate * 2);
-        fwrite (&wave_hdr[32], 1, 12, wav);
-    }
-
-    return wav;
-}
-
-static void
-close_wav (FILE *wav)
+static GByteArray *
+build_wav_header (guint32 data_size)
 {
-    guint pos;
+    GByteArray *header;
 
-    fflush (wav);
+    header = g_byte_array_sized_new (WAV_HEADER_SIZE);
 
-    pos = ftell (wav);
+    riff_append_chunk (header, "RIFF", WAV_HEADER_SIZE - 8 + data_size);
+    g_byte_array_append (header, (const guint8 *) "WAVE", 4);
 
-    fseek (wav, 4, SEEK_SET);
-    write_4_bytes (wav, pos - 8);
+    riff_append_chunk (header, "fmt ", 16);
+    riff_append_u16 (header, 1 /* PCM */);
+    riff_append_u16 (header, WAV_CHANNELS);
+    riff_append_u32 (header, samplerate);
+    riff_append_u32 (header, samplerate * WAV_CHANNELS * WAV_SAMPLE_SIZE);
+    riff_append_u16 (header, WAV_CHANNELS * WAV_SAMPLE_SIZE);
+    riff_append_u16 (header, WAV_SAMPLE_SIZE * 8);
 
-    fseek (wav, 40, SEEK_SET);
-    write_4_bytes (wav, pos - 44);
+    riff_append_chunk (header, "data", data_size);
 
-    fclose(wav);
+    g_assert (header->len == WAV_HEADER_SIZE);
 
-    return;
+    return header;
 }
 
 static gint
@@ -113,20 +145,9 @@ synth_cb (gshort *wav, gint numsamples, espeak_EVENT *events)
 {
     synth_context_t *ctx = (synth_context_t *) events[0].user_data;
 
-    if (wav == NULL) {
-        close_wav (ctx->wavfile);
-        return 0;
-    }
-
-    if (!ctx->wavfile) {
-        ctx->wavfile = open_wav (ctx->wavpath);
-        if (!ctx->wavfile) {
-            return 1;
-        }
-    }
-
-    if (numsamples > 0) {
-        fwrite (wav, numsamples * 2, 1, ctx->wavfile);
+    if (wav && numsamples > 0) {
+        g_byte_array_append (ctx->samples, (const guint8 *) wav,
+                             numsamples * WAV_SAMPLE_SIZE);
     }
 
     return 0;
@@ -173,34 +194,294 @@ get_tracks_voiceover_dir (const gchar *mountpoint)
 }
 
 /**
- * Initialize voiceover support.
+ * Internal, the text spoken for a track.
+ */
+static gchar *
+voiceover_text (Itdb_Track *track)
+{
+    gchar *text;
+
+    text = g_strdup_printf ("%s. %s.", track->artist, track->title);
+
+    /* these would break the helpers' protocol */
+    g_strdelimit (text, "\t\r\n", ' ');
+
+    return text;
+}
+
+/**
+ * Internal, the path in the cache for a voiceover, given its key.
+ */
+static gchar *
+cache_path (const gchar *key)
+{
+    gchar *name, *path;
+
+    name = g_strconcat (key, ".wav", NULL);
+    path = g_build_filename (cachedir, name, NULL);
+    g_free (name);
+
+    return path;
+}
+
+/**
+ * Internal, start the helper processes that aren't running.
+ * Returns false if none could be started.
+ */
+static gboolean
+start_helpers (void)
+{
+    guint i, running = 0;
+    GError *err = NULL;
+    gchar *argv[] = {helper_path, HELPER_OPTION, NULL};
+
+    /* a helper dying mid-request must not take us down with it */
+    signal (SIGPIPE, SIG_IGN);
+
+    for (i = 0; i < num_helpers; i++) {
+        if (!helpers[i].pid &&
+            !g_spawn_async_with_pipes (NULL, argv, NULL,
+                                       G_SPAWN_DO_NOT_REAP_CHILD, NULL, NULL,
+                                       &helpers[i].pid, &helpers[i].requests,
+                                       &helpers[i].replies, NULL, &err)) {
+            g_warning ("Failed to start voiceover helper: %s", err->message);
+            g_clear_error (&err);
+        }
+
+        running += helpers[i].pid != 0;
+    }
+
+    return running > 0;
+}
+
+/**
+ * Internal, stop a helper process. Closing its stdin makes it exit.
+ */
+static void
+stop_helper (helper_t *helper)
+{
+    if (helper->pid) {
+        close (helper->requests);
+        close (helper->replies);
+        waitpid (helper->pid, NULL, 0);
+        g_spawn_close_pid (helper->pid);
+    }
+
+    g_free (helper->key);
+    memset (helper, 0, sizeof (helper_t));
+
+    return;
+}
+
+/**
+ * Internal, send a helper a request to synthesize text into the cache
+ * entry for key.
+ */
+static gboolean
+send_request (helper_t *helper, const gchar *key, const gchar *text)
+{
+    gchar *path, *request;
+    gsize len, written = 0;
+    gssize ret;
+
+    path = cache_path (key);
+    request = g_strdup_printf ("%s\t%s\n", path, text);
+    len = strlen (request);
+    g_free (path);
+
+    while (written < len) {
+        ret = write (helper->requests, request + written, len - written);
+        if (ret < 0 && errno != EINTR) {
+            break;
+        }
+
+        written += MAX (ret, 0);
+    }
+
+    g_free (request);
+
+    if (written < len) {
+        return FALSE;
+    }
+
+    helper->key = g_strdup (key);
+
+    return TRUE;
+}
+
+/**
+ * Internal, read a helper's reply to its request. If the helper is gone,
+ * it is stopped, to be restarted on the next batch.
+ * Returns whether synthesis succeeded.
+ */
+static gboolean
+read_reply (helper_t *helper)
+{
+    gchar reply[2];
+    gsize got = 0;
+    gssize ret;
+
+    while (got < sizeof (reply)) {
+        ret = read (helper->replies, reply + got, sizeof (reply) - got);
+        if (ret == 0 || (ret < 0 && errno != EINTR)) {
+            break;
+        }
+
+        got += MAX (ret, 0);
+    }
+
+    g_free (helper->key);
+    helper->key = NULL;
+
+    if (got < sizeof (reply)) {
+        stop_helper (helper);
+        return FALSE;
+    }
+
+    return reply[0] == '0';
+}
+
+/**
+ * Internal, synthesize texts into the cache, spreading them among the
+ * helpers. texts maps cache keys to the texts to be spoken.
+ */
+static void
+synthesize (GHashTable *texts)
+{
+    guint i, busy = 0;
+    GHashTableIter it;
+    gpointer key, text;
+    gboolean more;
+    struct pollfd *fds;
+
+    if (g_hash_table_size (texts) == 0 || !start_helpers ()) {
+        return;
+    }
+
+    fds = g_new0 (struct pollfd, num_helpers);
+
+    g_hash_table_iter_init (&it, texts);
+    more = g_hash_table_iter_next (&it, &key, &text);
+
+    /* hand each idle helper the next text, until all are done */
+    while (more || busy > 0) {
+        for (i = 0; more && i < num_helpers; i++) {
+            if (helpers[i].pid && !helpers[i].key &&
+                send_request (&helpers[i], key, text)) {
+                busy++;
+                more = g_hash_table_iter_next (&it, &key, &text);
+            }
+        }
+
+        if (busy == 0) {
+            /* all helpers are gone */
+            break;
+        }
+
+        /* only wait on the helpers with a request in flight */
+        for (i = 0; i < num_helpers; i++) {
+            fds[i].fd = helpers[i].key ? helpers[i].replies : -1;
+            fds[i].events = POLLIN;
+            fds[i].revents = 0;
+        }
+
+        if (poll (fds, num_helpers, -1) < 0 && errno != EINTR) {
+            break;
+        }
+
+        for (i = 0; i < num_helpers; i++) {
+            if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+                read_reply (&helpers[i]);
+                busy--;
+            }
+        }
+    }
+
+    g_free (fds);
+
+    return;
+}
+
+/**
+ * Internal, copy a voiceover from the cache to the iPod.
+ */
+static gboolean
+copy_voiceover (const gchar *src, const gchar *dest)
+{
+    gchar *contents;
+    gsize length;
+    gboolean ret;
+
+    if (!g_file_get_contents (src, &contents, &length, NULL)) {
+        return FALSE;
+    }
+
+    ret = g_file_set_contents (dest, contents, length, NULL);
+    g_free (contents);
+
+    return ret;
+}
+
+/**
+ * Internal, synthesize text into a wav file, from a helper process.
+ * The file is written in a single write, under a temporary name that's
+ * renamed into place, so other instances never see it half-written.
+ */
+static gboolean
+speak (const gchar *text, const gchar *wavpath)
+{
+    synth_context_t ctx = {0};
+    GByteArray *header;
+    espeak_ERROR res;
+    gboolean ret = FALSE;
+
+    ctx.samples = g_byte_array_sized_new (WAV_HEADER_SIZE + samplerate * WAV_SAMPLE_SIZE * 4);
+    g_byte_array_set_size (ctx.samples, WAV_HEADER_SIZE);
+
+    res = espeak_Synth (text, strlen (text) + 1, 0, POS_SENTENCE, 0,
+                        espeakCHARS_AUTO, NULL, &ctx);
+
+    if (res == EE_OK && ctx.samples->len > WAV_HEADER_SIZE) {
+        header = build_wav_header (ctx.samples->len - WAV_HEADER_SIZE);
+        memcpy (ctx.samples->data, header->data, WAV_HEADER_SIZE);
+        g_byte_array_free (header, TRUE);
+
+        ret = g_file_set_contents (wavpath, (const gchar *) ctx.samples->data,
+                                   ctx.samples->len, NULL);
+    }
+
+    g_byte_array_free (ctx.samples, TRUE);
+
+    return ret;
+}
+
+/**
+ * Initialize voiceover support. Up to num_workers helper processes will
+ * be started to synthesize voiceovers, running the program at self.
  * Returns false if the iPod doesn't support voiceover.
  */
 gboolean
-voiceover_init (const gchar *mountpoint)
+voiceover_init (const gchar *mountpoint, const gchar *self, guint num_workers)
 {
-    espeak_VOICE voice_props = {0};
-
     tracks_voiceoverd = get_tracks_voiceover_dir (mountpoint);
     g_return_val_if_fail (tracks_voiceoverd, FALSE);
 
-    samplerate = espeak_Initialize (AUDIO_OUTPUT_SYNCHRONOUS, 0, NULL, 0);
-    if (samplerate == EE_INTERNAL_ERROR) {
+    cachedir = g_build_filename (g_get_user_cache_dir (), "ipod-syncer",
+                                 "voiceover", NULL);
+    if (g_mkdir_with_parents (cachedir, 0755) != 0) {
+        g_free (cachedir);
         g_free (tracks_voiceoverd);
         return FALSE;
     }
 
-    /* try to get a young female voice with US accent */
-    voice_props.languages = "en-us";
-    voice_props.gender = 2;
-    voice_props.age = 20;
-    voice_props.variant = 0;
-    espeak_SetVoiceByProperties (&voice_props);
+    /* prefer the actual binary, in case self is relative to a changed cwd */
+    helper_path = g_file_read_link ("/proc/self/exe", NULL);
+    if (!helper_path) {
+        helper_path = g_strdup (self);
+    }
 
-    /* increase pitch and range to make robotic voice less scary */
-    espeak_SetParameter (espeakPITCH, 70, 0);
-    espeak_SetParameter (espeakRANGE, 80, 0);
-    espeak_SetParameter (espeakWORDGAP, 1, 0);
+    num_helpers = MAX (num_workers, 1);
+    helpers = g_new0 (helper_t, num_helpers);
 
     return TRUE;
 }
@@ -211,36 +492,134 @@ voiceover_init (const gchar *mountpoint)
 void
 voiceover_deinit (void)
 {
+    guint i;
+
+    for (i = 0; i < num_helpers; i++) {
+        stop_helper (&helpers[i]);
+    }
+
+    g_free (helpers);
+    g_free (helper_path);
+    g_free (cachedir);
     g_free (tracks_voiceoverd);
-    espeak_Terminate ();
 
     return;
 }
 
 /**
- * Make a voiceover file for a track.
+ * Make voiceover files for a list of tracks.
+ * Voiceovers in the cache are reused, and each distinct text missing
+ * from it is synthesized only once, in parallel with the others.
+ * Returns the number of tracks for which no voiceover could be made.
  */
-gboolean
-make_voiceover (Itdb_Track *track)
+guint
+make_voiceovers (GPtrArray *tracks)
 {
-    gchar *text;
-    synth_context_t ctx = {0};
-    espeak_ERROR res = EE_INTERNAL_ERROR;
+    guint i, failed = 0;
+    gchar *text, *key, *src, *dest;
+    GPtrArray *keys;
+    GHashTable *missing;
+    Itdb_Track *track;
 
-    g_return_val_if_fail (samplerate > 0 && tracks_voiceoverd, FALSE);
+    g_return_val_if_fail (tracks_voiceoverd, tracks->len);
 
-    ctx.wavpath = voiceover_path (track, tracks_voiceoverd);
-    g_return_val_if_fail (ctx.wavpath, FALSE);
+    keys = g_ptr_array_new_with_free_func (g_free);
+    missing = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+
+    for (i = 0; i < tracks->len; i++) {
+        track = g_ptr_array_index (tracks, i);
+        text = voiceover_text (track);
+
+        src = g_strconcat (text, "\x1f" VOICE_PARAMS, NULL);
+        key = g_compute_checksum_for_string (G_CHECKSUM_SHA1, src, -1);
+        g_ptr_array_add (keys, key);
+        g_free (src);
+
+        src = cache_path (key);
+
+        if (!g_file_test (src, G_FILE_TEST_EXISTS) &&
+            !g_hash_table_contains (missing, key)) {
+            g_hash_table_insert (missing, g_strdup (key), text);
+        } else {
+            g_free (text);
+        }
+
+        g_free (src);
+    }
+
+    synthesize (missing);
+
+    for (i = 0; i < tracks->len; i++) {
+        track = g_ptr_array_index (tracks, i);
+        src = cache_path (g_ptr_array_index (keys, i));
+        dest = voiceover_path (track, tracks_voiceoverd);
+
+        if (!dest || !copy_voiceover (src, dest)) {
+            failed++;
+        }
+
+        g_free (src);
+        g_free (dest);
+    }
+
+    g_hash_table_destroy (missing);
+    g_ptr_array_free (keys, TRUE);
+
+    return failed;
+}
+
+/**
+ * Run as a voiceover helper process, serving synthesis requests from
+ * stdin until it is closed.
+ * Returns the process' exit status.
+ */
+gint
+voiceover_helper_main (void)
+{
+    gchar *line = NULL, *text;
+    gsize size = 0;
+    gssize len;
+    gboolean ok;
+    espeak_VOICE voice_props = {0};
+
+    /* don't die along with the parent's terminal before it stops us */
+    signal (SIGINT, SIG_IGN);
+
+    samplerate = espeak_Initialize (AUDIO_OUTPUT_SYNCHRONOUS, 0, NULL, 0);
+    if (samplerate == EE_INTERNAL_ERROR) {
+        return 1;
+    }
+
+    voice_props.languages = VOICE_LANGUAGE;
+    voice_props.gender = VOICE_GENDER;
+    voice_props.age = VOICE_AGE;
+    voice_props.variant = VOICE_VARIANT;
+    espeak_SetVoiceByProperties (&voice_props);
+
+    espeak_SetParameter (espeakPITCH, VOICE_PITCH, 0);
+    espeak_SetParameter (espeakRANGE, VOICE_RANGE, 0);
+    espeak_SetParameter (espeakWORDGAP, VOICE_WORDGAP, 0);
 
     espeak_SetSynthCallback (synth_cb);
 
-    text = g_strdup_printf ("%s. %s.", track->artist, track->title);
-    res = espeak_Synth (text, 0, 0, POS_SENTENCE, 0, espeakCHARS_AUTO, NULL, &ctx);
+    while ((len = getline (&line, &size, stdin)) > 0) {
+        g_strchomp (line);
 
-    g_free (text);
-    g_free (ctx.wavpath);
+        if ((text = strchr (line, '\t'))) {
+            *text++ = '\0';
+            ok = speak (text, line);
+        } else {
+            ok = FALSE;
+        }
+
+        fputs (ok ? "0\n" : "1\n", stdout);
+        fflush (stdout);
+    }
 
-    return res == EE_OK;
+    free (line);
+    espeak_Terminate ();
+
+    return 0;
 }
 
 /**
@@ -0,0 +1,179 @@
+/* Copyright 2012, Guilherme P. Gonçalves (guilherme.p.gonc@gmail.com)
+ *
+ * This file is part of ipod-syncer.
+ *
+ * ipod-syncer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ipod-syncer.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <glib.h>
+
+#include "watch.h"
+
+/* A batch is never held back longer than this many windows since its
+ * first change, however busy the medialib is.
+ */
+#define MAX_WINDOWS 4
+
+/* Collects changes to the medialib into batches.
+ * A batch is flushed once no change came for a whole window, in ms, so a
+ * burst of changes, such as retagging an album, makes a single batch.
+ * Only one batch is handled at a time: changes that come while the last
+ * one is still being applied wait for the next.
+ */
+struct watch_St {
+    guint window;
+    watch_flush_t flush;
+    gpointer udata;
+
+    GHashTable *changed;
+    gboolean pending;
+    gint64 first;
+    guint timeout;
+    gboolean busy;
+};
+
+static void schedule (watch_t *watch);
+static gboolean flush_cb (gpointer udata);
+
+/**
+ * Internal, (re)start the timer for flushing the current batch.
+ */
+static void
+schedule (watch_t *watch)
+{
+    gint64 now, deadline;
+    guint delay;
+
+    if (watch->timeout) {
+        g_source_remove (watch->timeout);
+        watch->timeout = 0;
+    }
+
+    if (watch->busy || !watch->pending) {
+        return;
+    }
+
+    now = g_get_monotonic_time () / 1000;
+    deadline = watch->first + (gint64) watch->window * MAX_WINDOWS;
+    delay = MIN (watch->window, MAX (deadline - now, 0));
+
+    watch->timeout = g_timeout_add (delay, flush_cb, watch);
+
+    return;
+}
+
+static gboolean
+flush_cb (gpointer udata)
+{
+    watch_t *watch = (watch_t *) udata;
+    GHashTableIter iter;
+    gpointer id;
+    GArray *changed;
+    gint32 i;
+
+    watch->timeout = 0;
+
+    changed = g_array_new (FALSE, FALSE, sizeof (gint32));
+
+    g_hash_table_iter_init (&iter, watch->changed);
+    while (g_hash_table_iter_next (&iter, &id, NULL)) {
+        i = GPOINTER_TO_INT (id);
+        g_array_append_val (changed, i);
+    }
+
+    g_hash_table_remove_all (watch->changed);
+    watch->pending = FALSE;
+    watch->busy = TRUE;
+
+    watch->flush (changed, watch->udata);
+
+    return FALSE;
+}
+
+/**
+ * Start batching changes, to be handed to flush.
+ */
+watch_t *
+watch_new (guint window, watch_flush_t flush, gpointer udata)
+{
+    watch_t *watch;
+
+    watch = g_new0 (watch_t, 1);
+    watch->window = window;
+    watch->flush = flush;
+    watch->udata = udata;
+    watch->changed = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+    return watch;
+}
+
+void
+watch_free (watch_t *watch)
+{
+    if (watch->timeout) {
+        g_source_remove (watch->timeout);
+    }
+
+    g_hash_table_destroy (watch->changed);
+    g_free (watch);
+
+    return;
+}
+
+/**
+ * Add a changed medialib entry to the current batch.
+ */
+void
+watch_entry_changed (watch_t *watch, gint32 id)
+{
+    g_hash_table_add (watch->changed, GINT_TO_POINTER (id));
+    watch_refresh (watch);
+
+    return;
+}
+
+/**
+ * Note a change that may affect any entry, such as to a collection,
+ * so that a batch is flushed even if no entry changed.
+ */
+void
+watch_refresh (watch_t *watch)
+{
+    if (!watch->pending) {
+        watch->pending = TRUE;
+        watch->first = g_get_monotonic_time () / 1000;
+    }
+
+    schedule (watch);
+
+    return;
+}
+
+/**
+ * Let the next batch be flushed, once the last one was handled.
+ */
+void
+watch_done (watch_t *watch)
+{
+    watch->busy = FALSE;
+
+    /* changes that came meanwhile have waited long enough */
+    if (watch->pending) {
+        watch->first = 0;
+    }
+
+    schedule (watch);
+
+    return;
+}